@@ -6,21 +6,66 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 /*defines*/
 #define ZOR_VERSION "0.0.1"
 #define ZOR_TAB_STOP 8
 #define ZOR_QUIT_TIMES 1
 #define ZOR_COMMAND_BUFFER_SIZE 256
+#define ZOR_MAX_THREADS 64
+#define ZOR_LOAD_CHUNK (4 << 20)
+#define ZOR_FIRST_BLOCK (64 << 10)
+#define ZOR_STREAM_BLOCK (64 << 20)
+#define ZOR_MAX_WATCHES 32
+#define ZOR_MAX_CLIENTS 16
+#define ZOR_MSG_MAX 8192
+#define ZOR_IOV_MAX 1024
+#define ZOR_REGISTERS 27
+#define ZOR_CACHE_BUDGET (1 << 16)
+#define ZOR_CACHE_PAGE 1024
+/* freed arena blocks kept for reuse */
+#define ZOR_SPARE_BLOCKS 8
+/* derived data below this is not worth a pass over the rows to shed */
+#define ZOR_DERIVED_FLOOR (1 << 20)
+/* longest word the completion index keeps */
+#define ZOR_WORD_MAX 64
+/* rows indexed per idle turn of the event loop */
+#define ZOR_INDEX_BATCH 4096
+/* edits one diff window may take before it is shown as a single hunk */
+#define ZOR_DIFF_MAX_EDITS 1024
+/* unchanged lines shown around a diff hunk */
+#define ZOR_DIFF_CONTEXT 3
+/* a save rewrites in place when at most 1/ZOR_INPLACE_SHARE of it changed */
+#define ZOR_INPLACE_SHARE 2
+#define ZOR_JOURNAL_MAGIC "ZORJNL2\n"
+/* rows a wrapped screen walks one by one before asking the line tree */
+#define ZOR_WRAP_WALK 256
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -39,6 +84,10 @@ enum editorMappings {
 
 enum editorHighlight {
   HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
   HL_STRING,
   HL_NUMBER,
   HL_MATCH,
@@ -47,66 +96,876 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
-enum editorModes { INSERT_MODE, NORMAL_MODE, COMMAND_MODE };
+#define CC_SPACE (1 << 0)
+#define CC_SEP (1 << 1)
+#define CC_DIGIT (1 << 2)
+#define CC_WORD (1 << 3)
+
+enum editorModes { INSERT_MODE, NORMAL_MODE, COMMAND_MODE, VISUAL_MODE };
 
 /*data*/
 
 struct termios orig_termios;
 
+struct editorKeyword {
+  const char *word;
+  int len;
+  unsigned char hl;
+};
+
+/* One language. Its keywords and types are matched through a perfect hash
+ * table laid out at compile time, so a lookup is one hash and one
+ * compare. */
 struct editorSyntax {
   char *filetype;
   char **filematch;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
   int flags;
+  const struct editorKeyword *kw_table;
+  unsigned int kw_mask;
+  unsigned int kw_seed;
+  unsigned char is_delim[256];
 };
 
-typedef struct editorRow {
+struct editorCodec {
+  char *name;
+  char *ext;
+  unsigned char magic[4];
+  int magic_len;
+  char *decompress[4];
+  char *compress[4];
+};
+
+#define ROW_HAS_TABS (1 << 0)
+#define ROW_HL_VALID (1 << 1)
+#define ROW_PACKED (1 << 2)
+#define ROW_HL_OPEN (1 << 3)
+#define ROW_HL_ENTRY (1 << 4)
+#define ROW_INDEXED (1 << 5)
+/* the line ended in \r\n, or in a bare \n, when it was read */
+#define ROW_CRLF (1 << 6)
+#define ROW_LF (1 << 7)
+/* what a row keeps while undo or a splice holds it */
+#define ROW_LINE_FLAGS (ROW_PACKED | ROW_CRLF | ROW_LF)
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 12
+#define ARENA_LARGE ARENA_CLASSES
+
+/* What memory is used for, as reported by :mem. Arena chunks carry their
+ * kind in the header; the rest is counted where it is allocated. */
+enum editorMemKind {
+  MEM_TEXT,
+  MEM_ROWS,
+  MEM_RENDER,
+  MEM_HL,
+  MEM_SEARCH,
+  MEM_INDEX,
+  MEM_UNDO,
+  MEM_OUTPUT,
+  MEM_KINDS
+};
+
+/* Backing store of one buffer. Loaded rows are bump-allocated and packed
+ * back to back in blocks; rows that get edited move into power-of-two size
+ * classes carved from the same blocks, and a chunk too big for the classes
+ * gets a block of its own. The buffer's rows and undo history only point
+ * into its own arena, so it is released a block at a time; whole blocks
+ * go to a spare list that every buffer takes from first. */
+struct arenaBlock {
+  struct arenaBlock *next;
+  size_t size;
+  size_t used;
+  /* register lines pointing into the block. A pinned block outlives its
+   * arena, with arena NULL, until the last pin goes. */
+  struct editorArena *arena;
+  int pins;
+};
+
+/* shares counts holders of the chunk besides the first, for row text that
+ * registers point at: whoever lets go of it last frees it. */
+typedef struct arenaChunk {
+  unsigned short cls;
+  unsigned short kind;
+  unsigned int shares;
+} arenaChunk;
+
+struct editorArena {
+  /* every block, sorted by address so text can be traced to its block */
+  struct arenaBlock **blocks;
+  int num_blocks;
+  int blocks_cap;
+  /* the block small chunks are carved from */
+  struct arenaBlock *bump;
+  void *free_list[ARENA_CLASSES];
+  /* live bytes per kind, and bytes of bump blocks against those of the
+   * small chunks carved from them */
+  size_t used[MEM_KINDS];
+  size_t bump_bytes;
+  size_t small_bytes;
+  /* row caches, in pages of ZOR_CACHE_PAGE slots that never move, and the
+   * head of the free slots */
+  struct editorRowCache **cache_pages;
+  int cache_slots;
+  int cache_free;
+};
+
+/* One slice of a file being indexed. Each thread reads its slice, finds the
+ * line ends in it and later writes its lines into the row arrays. The first
+ * line of a slice may have started in an earlier one; the merge fixes it up
+ * once every slice is in memory. */
+struct lineSpan {
+  size_t start;
   int size;
-  int rsize;
-  char *chars;
+  int tabs;
+  /* carriage returns stripped from the end, -1 if no newline ends it */
+  int cr;
+};
+
+struct loadChunk {
+  int fd;
+  off_t base;
+  char *buf;
+  size_t begin;
+  size_t end;
+  size_t line_start;
+  struct lineSpan *lines;
+  int num_lines;
+  int lines_cap;
+  int row;
+  int err;
+};
+
+/* A block of the file indexed by the loader thread and waiting for the main
+ * thread to turn it into rows. */
+struct loadBatch {
+  struct loadBatch *next;
+  struct arenaBlock *block;
+  struct loadChunk chunks[ZOR_MAX_THREADS];
+  int num_chunks;
+  size_t bytes;
+  /* the block is the file's bytes from offset base */
+  int on_disk;
+  off_t base;
+  int last;
+  int partial;
+  int err;
+};
+
+struct editorLoader {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int fd;
+  int wake[2];
+  pid_t child;
+  int seekable;
+  size_t size;
+  int cancel;
+  struct loadBatch *head;
+  struct loadBatch **tail;
+};
+
+/* State for :follow; off is how far into the file the rows reach. */
+struct editorFollow {
+  int fd;
+  int inotify;
+  int wd;
+  int dir_wd;
+  off_t off;
+  const char *base;
+};
+
+struct editorWatch {
+  int fd;
+  short events;
+  void (*handler)(int fd);
+};
+
+/* A running :[range]!cmd. Rows [next, to] still have to be written to the
+ * child (next_off bytes of row next are already out); its output is read
+ * into cur behind a carried partial line and indexed into lines, and
+ * blocks holds the filled output blocks the lines point into. */
+struct editorFilter {
+  pid_t pid;
+  int in;
+  int out;
+  int from, to;
+  int next;
+  size_t next_off;
+  int use_vmsplice;
+  struct arenaBlock *blocks;
+  struct arenaBlock *cur;
+  size_t cur_len;
+  size_t carry_len;
+  struct loadBatch *batch;
+  struct editorLine *lines;
+  int num_lines;
+  int lines_cap;
+  size_t bytes_out;
+  int running;
+};
+
+typedef struct editorHlSpan {
+  int end;
+  unsigned char hl;
+} editorHlSpan;
+
+/* A search match as a half-open range of render columns. */
+typedef struct editorMatchSpan {
+  int start;
+  int end;
+} editorMatchSpan;
+
+/* Derived per-row data, only built for rows that need it: render is NULL
+ * when the row has no tabs (chars are drawn directly) and hl is NULL when the
+ * whole row is HL_NORMAL. */
+typedef struct editorRowCache {
   char *render;
-  unsigned char *hl;
+  editorHlSpan *hl;
+  int hl_len;
+  editorMatchSpan *match;
+  int match_len;
+  unsigned int match_gen;
+  /* render column each screen line starts at, laid out for wrap_cols */
+  int *wrap;
+  int wrap_len;
+  int wrap_cols;
+  /* next free slot while this one is unused */
+  int next_free;
+} editorRowCache;
+
+typedef struct editorRow {
+  char *chars;
 } editorRow;
 
+/* Row text held outside the buffer. flags keeps ROW_PACKED so chars that
+ * live in a load block are never freed on their own, and the line ending
+ * so the row still matches the file when it comes back. */
+struct editorLine {
+  char *chars;
+  int size;
+  unsigned char flags;
+};
+
+/* Replace rows [at, at + del) with the ins given lines. */
+struct editorHunk {
+  int at;
+  int del;
+  int ins;
+  struct editorLine *lines;
+};
+
+/* Hunks applied together: sorted by at, disjoint, in the coordinates of
+ * the buffer they are applied to. A step with perm set instead reorders
+ * rows [perm_at, perm_at + perm_len) so that new row i is old row
+ * perm_at + perm[i]. */
+struct editorStep {
+  int num_hunks;
+  struct editorHunk *hunks;
+  int perm_at;
+  int perm_len;
+  int *perm;
+};
+
+/* One undo (or redo) entry. Its steps are applied last to first, and
+ * applying them yields the entry that reverses it. */
+struct editorUndo {
+  struct editorUndo *next;
+  int cx, cy;
+  int num_steps;
+  int steps_cap;
+  struct editorStep *steps;
+};
+
+/* Text in a register. A whole row is shared with the buffer: the line
+ * points at the row's text and blocks[i] is the arena block pinned under
+ * it. Parts of rows are copied into own, with blocks[i] NULL. So yanks and
+ * puts of lines pass references around instead of copying bytes. kind is
+ * 'v', 'V' or CTRL_KEY('v') like the visual mode that made it. */
+struct editorText {
+  int refs;
+  int kind;
+  int num_lines;
+  struct editorLine *lines;
+  struct arenaBlock **blocks;
+  char *own;
+};
+
+/* A visual selection in buffer order. For 'v' it runs from (y1, x1) up to
+ * but not including (y2, x2); for 'V' it is rows y1 to y2; for a block it
+ * is rows y1 to y2 and render columns [x1, x2). */
+struct editorRegion {
+  int kind;
+  int y1, x1;
+  int y2, x2;
+};
+
+/* A prefix trie of the words in a buffer. Siblings are kept in byte order
+ * so walking the trie lists words sorted; sub and words let a walk skip
+ * subtrees whose words are all gone. */
+struct indexNode {
+  int child;
+  int next;
+  int count; /* occurrences of the word ending here */
+  int sub;   /* occurrences in the subtree, this node's included */
+  int words; /* distinct words in the subtree */
+  unsigned char ch;
+};
+
+/* A row defining the word at node. Kept sorted by row and moved along
+ * when rows are inserted or deleted above it. */
+struct indexDef {
+  int row;
+  int node;
+};
+
+/* Rows flagged ROW_INDEXED have their words counted here. Rows from scan
+ * on may not be; they are taken in a batch at a time while the editor is
+ * idle, or all at once when a lookup needs them. */
+struct editorIndex {
+  struct indexNode *nodes;
+  int num_nodes;
+  int nodes_cap;
+  struct indexDef *defs;
+  int num_defs;
+  int defs_cap;
+  int scan;
+};
+
+/* Net depth change of one kind of bracket over a run of rows, and the
+ * lowest depth reached inside it, both relative to its start. */
+struct bracketSum {
+  int sum;
+  int min;
+};
+
+/* Sums over the rows as a segment tree of nodes elem bytes each. Node 1
+ * is the root and row i is leaf size + i. Leaves below rows are up to
+ * date, and so are the inner nodes over leaves below built; the rest is
+ * redone when a lookup needs it. leaf counts a row into its leaf and
+ * returns whether the rows after it must be counted again; pull sums a
+ * node from its two children. */
+struct editorSumTree {
+  void *nodes;
+  size_t elem;
+  int size;
+  int rows;
+  int built;
+  /* leaves from rows up to high may hold rows that are gone */
+  int high;
+  int (*leaf)(struct editorSumTree *t, int at);
+  void (*pull)(struct editorSumTree *t, int node);
+};
+
+/* Bracket depth over the rows, for % and folding; each node has a sum for
+ * (), [] and {}. The tree comes first so its callbacks can get back to
+ * the rest. */
+struct editorBrackets {
+  struct editorSumTree tree;
+  /* whether each row ends inside a block comment */
+  unsigned char *open;
+};
+
+/* Screen lines each row takes with :set wrap, for jumps too long to walk.
+ * Leaves were counted for a screen cols wide. */
+struct editorLayout {
+  struct editorSumTree tree;
+  int cols;
+};
+
+/* A cursor besides cx, cy for multi-cursor editing, in the same terms. */
+struct editorCursor {
+  int x, y;
+};
+
+/* Closed fold: rows [start, end] show as one line. */
+struct editorFold {
+  int start;
+  int end;
+};
+
+/* Load block holding the file's bytes from off on. */
+struct diskExtent {
+  char *text;
+  size_t len;
+  off_t off;
+};
+
+/* Where unedited rows came from: their chars still point into the load
+ * blocks, sorted here by address, so a row's offset in the file is found
+ * from its pointer. Good while the file is as it was when stamped. */
+struct editorDisk {
+  struct diskExtent *ext;
+  int num_ext;
+  int ext_cap;
+  int valid;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  /* an in-place save moved the rows read from here on */
+  off_t moved;
+};
+
+/* Rows [from, to) go to off in an in-place save, len bytes with their
+ * newlines. */
+struct saveExtent {
+  long long off;
+  long long len;
+  int from, to;
+};
+
+/* A line of the file or a row, as the diff compares them. */
+struct diffLine {
+  const char *s;
+  int len;
+  unsigned long long hash;
+};
+
+/* File lines [a, a + na) became rows [b, b + nb); the deleted lines start
+ * at old in editorDiff.old. */
+struct diffHunk {
+  int a, na;
+  int b, nb;
+  int old;
+};
+
+/* One :diff: the hunks in order, the file lines they delete and the reads
+ * those lines point into. */
+struct editorDiff {
+  struct diffHunk *hunks;
+  int num_hunks;
+  int hunks_cap;
+  struct diffLine *old;
+  int num_old;
+  int old_cap;
+  char **bufs;
+  int num_bufs;
+  int bufs_cap;
+};
+
+/* A buffer that is not on screen. The active buffer lives in editorConf;
+ * switching stashes its state here and restores the other one's. A buffer
+ * named on the command line is not loaded until it is first shown. */
+struct editorBuffer {
+  int loaded;
+  int cx, cy;
+  int row_off, col_off;
+  int wrap_off;
+  int num_rows;
+  int row_cap;
+  int *row_size;
+  int *row_cache;
+  unsigned char *row_flags;
+  editorRow *row;
+  int cached_rows;
+  struct editorArena *arena;
+  struct editorLoader *loader;
+  size_t load_bytes;
+  int load_partial;
+  int follow;
+  struct editorFollow *follower;
+  int dirty;
+  char *filename;
+  struct editorCodec *codec;
+  struct editorSyntax *syntax;
+  int hl_state_rows;
+  struct editorIndex *index;
+  struct editorBrackets *brackets;
+  struct editorLayout *layout;
+  struct editorFold *folds;
+  int num_folds;
+  int folds_cap;
+  struct editorDisk disk;
+  struct editorUndo *undo;
+  struct editorUndo *redo;
+  unsigned long last_shown;
+};
+
+/* What one terminal shows: a hash per screen line and the offsets it was
+ * drawn at. */
+struct editorScreen {
+  unsigned long long *hash;
+  int valid;
+  int drawn_row_off;
+  int drawn_wrap_off;
+  int drawn_col_off;
+};
+
+/* A terminal attached to the server. Messages from it are a type byte, a
+ * 32-bit length and a payload: 'i' keys, 'w' window size, 'o' a file to
+ * show and 'a' one to add. Keys queue up in in until the editor reads
+ * them. What its socket would not take of a frame waits in out. */
+struct editorClient {
+  int fd;
+  int rows, cols;
+  char msg[ZOR_MSG_MAX];
+  int msg_len;
+  char *in;
+  size_t in_len, in_pos, in_cap;
+  char *out;
+  size_t out_len, out_pos;
+  struct editorScreen screen;
+};
+
+/* Rows [from, to) for one :s worker. The rewritten lines go into block,
+ * which becomes part of the arena afterwards. */
+struct substTask {
+  int from, to;
+  const char *pat;
+  size_t pat_len;
+  const char *rep;
+  size_t rep_len;
+  int global;
+  struct arenaBlock *block;
+  size_t block_cap;
+  struct substLine *lines;
+  int num_lines;
+  int lines_cap;
+  long long count;
+};
+
+struct substLine {
+  int row;
+  int size;
+  size_t off;
+};
+
+/* Rows [from, to) for one :g or :v worker, collecting the rows to drop. */
+struct globalTask {
+  int from, to;
+  const char *pat;
+  size_t pat_len;
+  int invert;
+  int *rows;
+  int num_rows;
+  int rows_cap;
+};
+
+/* Shared by the :sort workers. idx holds row offsets from the start of the
+ * range; num holds the numeric keys for "n". */
+struct sortCtx {
+  int from;
+  int numeric;
+  long long *num;
+  unsigned char *has_num;
+};
+
+struct sortTask {
+  struct sortCtx *ctx;
+  int *src;
+  int *dst;
+  int lo, mid, hi;
+};
+
 struct editorConf {
   int cx, cy;
   int rx;
   int row_off;
   int col_off;
+  /* with wrap set: screen lines of row_off scrolled off the top */
+  int wrap;
+  int wrap_off;
   int screen_rows;
   int screen_cols;
   int num_rows;
+  int row_cap;
+  /* hot per-row fields live in parallel arrays indexed like row; row_cache
+   * is a cache slot in the arena, 0 for none */
+  int *row_size;
+  int *row_cache;
+  unsigned char *row_flags;
   editorRow *row;
+  /* rows that have a cache, counted against ZOR_CACHE_BUDGET */
+  int cached_rows;
+  struct editorArena *arena;
+  /* whole blocks released arenas left for the next one, and the bytes of
+   * released blocks that registers still pin */
+  struct arenaBlock *spare;
+  int num_spare;
+  size_t pinned_bytes;
+  /* malloc'd bytes per kind; the arena counts its own */
+  size_t mem[MEM_KINDS];
+  size_t mem_budget;
+  struct editorBuffer *buffers;
+  int num_buffers;
+  int buffers_cap;
+  int cur_buffer;
+  unsigned long buffer_tick;
+  struct editorLoader *loader;
+  size_t load_bytes;
+  int load_partial;
+  int follow;
+  struct editorFollow *follower;
   int dirty;
   char *filename;
-  char statusmsg[80];
+  struct editorCodec *codec;
+  char statusmsg[256];
   time_t statusmsg_time;
   char command_buffer[ZOR_COMMAND_BUFFER_SIZE];
   int command_len;
+  int count;
+  int pending;
+  /* visual selection kind and the end the cursor left behind */
+  int visual;
+  int vx, vy;
+  struct editorText *registers[ZOR_REGISTERS];
+  int reg;
+  char *search_query;
+  unsigned int search_gen;
   struct editorSyntax *syntax;
+  int hl_state_rows;
+  struct editorIndex *index;
+  struct editorBrackets *brackets;
+  struct editorLayout *layout;
+  /* closed folds, sorted and disjoint */
+  struct editorFold *folds;
+  int num_folds;
+  int folds_cap;
+  /* extra cursors, sorted and apart from each other and from cx, cy */
+  struct editorCursor *cursors;
+  int num_cursors;
+  int cursors_cap;
+  struct editorDisk disk;
+  /* Ctrl-N/Ctrl-P: the word shown at (complete_x, complete_y), whose
+   * first complete_plen bytes were typed */
+  int complete_x, complete_y;
+  int complete_plen;
+  char complete_word[ZOR_WORD_MAX + 1];
+  struct editorUndo *undo;
+  struct editorUndo *redo;
+  int undo_open;
   struct termios orig_termios;
   enum editorModes mode;
+  struct editorWatch watches[ZOR_MAX_WATCHES];
+  int num_watches;
+  struct editorFilter *filter;
+  struct editorScreen screen;
+  /* with --server: the listening socket (-1 otherwise), the attached
+   * terminals and the one whose keys were read last */
+  int server;
+  struct editorClient *clients[ZOR_MAX_CLIENTS];
+  int num_clients;
+  struct editorClient *client;
 };
 
 struct editorConf editorConf;
 
 /*filetypes*/
 
+const unsigned char editorCharClass[256] = {
+    ['\0'] = CC_SEP,
+    ['\t'] = CC_SPACE | CC_SEP,
+    ['\n'] = CC_SPACE | CC_SEP,
+    ['\v'] = CC_SPACE | CC_SEP,
+    ['\f'] = CC_SPACE | CC_SEP,
+    ['\r'] = CC_SPACE | CC_SEP,
+    [' '] = CC_SPACE | CC_SEP,
+    [','] = CC_SEP,
+    ['.'] = CC_SEP,
+    ['('] = CC_SEP,
+    [')'] = CC_SEP,
+    ['+'] = CC_SEP,
+    ['-'] = CC_SEP,
+    ['/'] = CC_SEP,
+    ['*'] = CC_SEP,
+    ['='] = CC_SEP,
+    ['~'] = CC_SEP,
+    ['%'] = CC_SEP,
+    ['<'] = CC_SEP,
+    ['>'] = CC_SEP,
+    ['['] = CC_SEP,
+    [']'] = CC_SEP,
+    [';'] = CC_SEP,
+    ['0' ... '9'] = CC_DIGIT | CC_WORD,
+    ['A' ... 'Z'] = CC_WORD,
+    ['a' ... 'z'] = CC_WORD,
+    ['_'] = CC_WORD,
+};
+
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
+/* Keywords (HL_KEYWORD1) and types (HL_KEYWORD2), each in the slot
+ * editorKeywordHash picks for it under the language's kw_seed, a seed no
+ * two of them collide under. editorKeywordCheck runs at startup and names
+ * the slot a misplaced word belongs in; if that slot is taken, the table
+ * needs a new seed. */
+const struct editorKeyword C_HL_keywords[256] = {
+    [6] = {"goto", 4, HL_KEYWORD1},
+    [16] = {"else", 4, HL_KEYWORD1},
+    [24] = {"break", 5, HL_KEYWORD1},
+    [29] = {"sizeof", 6, HL_KEYWORD1},
+    [32] = {"enum", 4, HL_KEYWORD1},
+    [37] = {"float", 5, HL_KEYWORD2},
+    [38] = {"if", 2, HL_KEYWORD1},
+    [40] = {"double", 6, HL_KEYWORD2},
+    [48] = {"for", 3, HL_KEYWORD1},
+    [52] = {"do", 2, HL_KEYWORD1},
+    [53] = {"signed", 6, HL_KEYWORD2},
+    [61] = {"char", 4, HL_KEYWORD2},
+    [64] = {"struct", 6, HL_KEYWORD1},
+    [68] = {"NULL", 4, HL_KEYWORD1},
+    [70] = {"unsigned", 8, HL_KEYWORD2},
+    [84] = {"inline", 6, HL_KEYWORD1},
+    [91] = {"static", 6, HL_KEYWORD1},
+    [93] = {"bool", 4, HL_KEYWORD2},
+    [100] = {"continue", 8, HL_KEYWORD1},
+    [110] = {"while", 5, HL_KEYWORD1},
+    [115] = {"long", 4, HL_KEYWORD2},
+    [116] = {"const", 5, HL_KEYWORD1},
+    [117] = {"short", 5, HL_KEYWORD2},
+    [120] = {"ssize_t", 7, HL_KEYWORD2},
+    [126] = {"default", 7, HL_KEYWORD1},
+    [127] = {"void", 4, HL_KEYWORD2},
+    [141] = {"volatile", 8, HL_KEYWORD1},
+    [145] = {"switch", 6, HL_KEYWORD1},
+    [148] = {"union", 5, HL_KEYWORD1},
+    [151] = {"size_t", 6, HL_KEYWORD2},
+    [159] = {"class", 5, HL_KEYWORD1},
+    [193] = {"off_t", 5, HL_KEYWORD2},
+    [196] = {"typedef", 7, HL_KEYWORD1},
+    [209] = {"case", 4, HL_KEYWORD1},
+    [215] = {"extern", 6, HL_KEYWORD1},
+    [223] = {"return", 6, HL_KEYWORD1},
+    [224] = {"register", 8, HL_KEYWORD1},
+    [254] = {"int", 3, HL_KEYWORD2},
+};
+
+char *PY_HL_extensions[] = {".py", NULL};
+const struct editorKeyword PY_HL_keywords[256] = {
+    [0] = {"int", 3, HL_KEYWORD2},
+    [1] = {"self", 4, HL_KEYWORD2},
+    [11] = {"bool", 4, HL_KEYWORD2},
+    [23] = {"list", 4, HL_KEYWORD2},
+    [30] = {"import", 6, HL_KEYWORD1},
+    [32] = {"not", 3, HL_KEYWORD1},
+    [38] = {"finally", 7, HL_KEYWORD1},
+    [40] = {"lambda", 6, HL_KEYWORD1},
+    [45] = {"return", 6, HL_KEYWORD1},
+    [46] = {"False", 5, HL_KEYWORD1},
+    [52] = {"global", 6, HL_KEYWORD1},
+    [58] = {"for", 3, HL_KEYWORD1},
+    [59] = {"float", 5, HL_KEYWORD2},
+    [64] = {"while", 5, HL_KEYWORD1},
+    [78] = {"else", 4, HL_KEYWORD1},
+    [85] = {"nonlocal", 8, HL_KEYWORD1},
+    [95] = {"dict", 4, HL_KEYWORD2},
+    [116] = {"in", 2, HL_KEYWORD1},
+    [120] = {"and", 3, HL_KEYWORD1},
+    [130] = {"break", 5, HL_KEYWORD1},
+    [131] = {"True", 4, HL_KEYWORD1},
+    [137] = {"raise", 5, HL_KEYWORD1},
+    [145] = {"None", 4, HL_KEYWORD1},
+    [149] = {"set", 3, HL_KEYWORD2},
+    [150] = {"except", 6, HL_KEYWORD1},
+    [166] = {"continue", 8, HL_KEYWORD1},
+    [174] = {"def", 3, HL_KEYWORD1},
+    [176] = {"try", 3, HL_KEYWORD1},
+    [177] = {"elif", 4, HL_KEYWORD1},
+    [188] = {"yield", 5, HL_KEYWORD1},
+    [195] = {"from", 4, HL_KEYWORD1},
+    [199] = {"tuple", 5, HL_KEYWORD2},
+    [209] = {"class", 5, HL_KEYWORD1},
+    [214] = {"or", 2, HL_KEYWORD1},
+    [218] = {"bytes", 5, HL_KEYWORD2},
+    [219] = {"as", 2, HL_KEYWORD1},
+    [220] = {"if", 2, HL_KEYWORD1},
+    [225] = {"assert", 6, HL_KEYWORD1},
+    [236] = {"object", 6, HL_KEYWORD2},
+    [240] = {"del", 3, HL_KEYWORD1},
+    [242] = {"pass", 4, HL_KEYWORD1},
+    [243] = {"is", 2, HL_KEYWORD1},
+    [246] = {"str", 3, HL_KEYWORD2},
+    [247] = {"with", 4, HL_KEYWORD1},
+};
 
 struct editorSyntax HLDB[] = {
     {
-        "c",
-        C_HL_extensions,
-        HL_HIGHLIGHT_NUMBERS || HL_HIGHLIGHT_STRINGS,
+        .filetype = "c",
+        .filematch = C_HL_extensions,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .kw_table = C_HL_keywords,
+        .kw_mask = 255,
+        .kw_seed = 32,
+        .is_delim = {['"'] = 1, ['\''] = 1},
+    },
+    {
+        .filetype = "python",
+        .filematch = PY_HL_extensions,
+        .singleline_comment_start = "#",
+        .multiline_comment_start = "\"\"\"",
+        .multiline_comment_end = "\"\"\"",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .kw_table = PY_HL_keywords,
+        .kw_mask = 255,
+        .kw_seed = 10,
+        .is_delim = {['"'] = 1, ['\''] = 1},
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+struct editorCodec CODECS[] = {
+    {
+        "gzip",
+        ".gz",
+        {0x1f, 0x8b},
+        2,
+        {"gzip", "-dc", NULL},
+        {"gzip", "-c", NULL},
+    },
+    {
+        "zstd",
+        ".zst",
+        {0x28, 0xb5, 0x2f, 0xfd},
+        4,
+        {"zstd", "-dcq", NULL},
+        {"zstd", "-cq", NULL},
+    },
+};
+
+#define CODECS_ENTRIES (sizeof(CODECS) / sizeof(CODECS[0]))
+
 /*prototypes*/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorWaitInput();
+void editorWaitRows(int n);
+void editorUndoClear();
+void editorSetSearch(const char *query);
+void editorFilter(int from, int to, char *cmd);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorGotoLine(int at);
+int editorRowCxToRx(int at, int cx);
+int editorRowRsize(int at);
+int editorModifiedBuffers();
+int editorBufferCommand(char *command);
+void editorEnforceBudget();
+int editorIndexPending();
+void editorIndexStep(int batch);
+int editorMemCommand(char *command);
+void editorDiskStamp(struct stat *st);
+void editorDiskAdd(char *text, size_t len, off_t off);
+void editorDiskCut(off_t from, off_t to);
+void editorDiffCommand();
+int editorDiskSame(struct stat *st);
+off_t editorDiskOrigin(int at, int *hint);
+void editorDiskReset();
+struct editorClient *editorInputClient();
+void editorDropClient(struct editorClient *c);
+int editorClientSend(struct editorClient *c, const char *data, size_t len);
+void editorQuit();
+void editorInvalidateScreens();
+void editorWinched();
+void editorCursorsShift(struct editorHunk *hunks, int n);
+void editorCursorsEdit(int c);
+void editorMoveCursor(int key);
+int editorMotion(int c, int count, int has_count);
 
 /*terminal*/
 
@@ -142,25 +1001,41 @@ void enableRawMode() {
     die("tcsetattr");
 }
 
+/* Read a byte of input like read(2): from the terminal, or in server mode
+ * from the client whose keys are being handled. */
+ssize_t editorReadInput(char *c) {
+  if (editorConf.server == -1)
+    return read(STDIN_FILENO, c, 1);
+  struct editorClient *cl = editorInputClient();
+  if (cl == NULL)
+    return 0;
+  *c = cl->in[cl->in_pos++];
+  if (cl->in_pos == cl->in_len)
+    cl->in_pos = cl->in_len = 0;
+  return 1;
+}
+
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  editorWaitInput();
+  while ((nread = editorReadInput(&c)) != 1) {
     if (nread == -1 && errno != EAGAIN)
       die("read");
+    editorWaitInput();
   };
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (editorReadInput(&seq[0]) != 1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+    if (editorReadInput(&seq[1]) != 1) {
       return '\x1b';
     }
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+        if (editorReadInput(&seq[2]) != 1) {
           return '\x1b';
         }
         if (seq[2] == '~') {
@@ -252,311 +1127,5472 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*syntax highlighter*/
+/*threads*/
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int editorThreadCount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  return n > ZOR_MAX_THREADS ? ZOR_MAX_THREADS : n;
 }
 
-void editorUpdateSyntax(editorRow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (editorConf.syntax == NULL)
-    return;
+/* Run fn over n task structs of task_size bytes, one thread each; task 0
+ * runs on the calling thread. */
+void editorRunParallel(void *(*fn)(void *), void *tasks, size_t task_size,
+                       int n) {
+  pthread_t tid[ZOR_MAX_THREADS];
+  int started[ZOR_MAX_THREADS] = {0};
+  int i;
+
+  for (i = 1; i < n; i++) {
+    started[i] =
+        pthread_create(&tid[i], NULL, fn, (char *)tasks + i * task_size) == 0;
+  }
+  fn(tasks);
+  for (i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(tid[i], NULL);
+    else
+      fn((char *)tasks + i * task_size);
+  }
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
+/*events*/
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void editorWatchFd(int fd, short events, void (*handler)(int fd)) {
+  if (editorConf.num_watches == ZOR_MAX_WATCHES)
+    return;
+  editorConf.watches[editorConf.num_watches].fd = fd;
+  editorConf.watches[editorConf.num_watches].events = events;
+  editorConf.watches[editorConf.num_watches].handler = handler;
+  editorConf.num_watches++;
+}
 
-    if (editorConf.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+/* Change what a watched descriptor is polled for. */
+void editorRewatchFd(int fd, short events) {
+  for (int i = 0; i < editorConf.num_watches; i++) {
+    if (editorConf.watches[i].fd == fd)
+      editorConf.watches[i].events = events;
+  }
+}
 
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
+void editorUnwatchFd(int fd) {
+  for (int i = 0; i < editorConf.num_watches; i++) {
+    if (editorConf.watches[i].fd == fd) {
+      editorConf.watches[i] = editorConf.watches[--editorConf.num_watches];
+      return;
     }
+  }
+}
 
-    if (editorConf.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+/* Wait until stdin (a client, in server mode) or a watched descriptor is
+ * ready, run the handlers of the ready watches and redraw after them.
+ * Returns whether a key is available. */
+int editorPollEvents() {
+  struct pollfd fds[ZOR_MAX_WATCHES + 1];
+  int n = editorConf.num_watches;
+
+  if (editorConf.server != -1 && editorInputClient())
+    return 1;
+  fds[0].fd = editorConf.server == -1 ? STDIN_FILENO : -1;
+  fds[0].events = POLLIN;
+  for (int i = 0; i < n; i++) {
+    fds[i + 1].fd = editorConf.watches[i].fd;
+    fds[i + 1].events = editorConf.watches[i].events;
+  }
+  int idle = editorIndexPending();
+  int ready = poll(fds, n + 1, idle ? 0 : -1);
+  if (ready == -1) {
+    if (errno == EINTR) {
+      editorWinched();
+      return 0;
+    }
+    die("poll");
+  }
+  if (ready == 0) {
+    editorIndexStep(ZOR_INDEX_BATCH);
+    return 0;
+  }
 
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
+  int handled = 0;
+  for (int i = 1; i <= n; i++) {
+    if (fds[i].revents == 0)
+      continue;
+    /* handlers may add or drop watches, so look the fd up again */
+    for (int j = 0; j < editorConf.num_watches; j++) {
+      if (editorConf.watches[j].fd == fds[i].fd) {
+        editorConf.watches[j].handler(fds[i].fd);
+        handled = 1;
+        break;
       }
     }
-
-    prev_sep = is_separator(c);
-    i++;
   }
+  if (handled)
+    editorRefreshScreen();
+  if (editorConf.server != -1)
+    return editorInputClient() != NULL;
+  return fds[0].revents != 0;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-  case HL_STRING:
-    return 35;
-  case HL_NORMAL:
-    return 31;
-  case HL_MATCH:
-    return 105;
-  default:
-    return 37;
-  }
+/* Block until a key is available, serving other watches meanwhile. */
+void editorWaitInput() {
+  while (!editorPollEvents())
+    ;
 }
 
-void editorSelectSyntaxHighlight() {
-  editorConf.syntax = NULL;
-  if (editorConf.filename == NULL)
-    return;
+/*processes*/
+
+/* Start argv with the given stdin and stdout. Our own descriptors are all
+ * close-on-exec, so the child only sees these two. */
+pid_t editorSpawn(char *const argv[], int in, int out) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  signal(SIGPIPE, SIG_DFL);
+  if (in != STDIN_FILENO)
+    dup2(in, STDIN_FILENO);
+  if (out != STDOUT_FILENO)
+    dup2(out, STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (null != -1)
+    dup2(null, STDERR_FILENO);
+  execvp(argv[0], argv);
+  _exit(127);
+}
 
-  char *ext = strrchr(editorConf.filename, '.');
+int editorReap(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(editorConf.filename, s->filematch[i]))) {
-        editorConf.syntax = s;
+/*arena*/
+
+/* Index of the first block of a that starts above p. */
+int arenaBlockSearch(struct editorArena *a, const void *p) {
+  int lo = 0, hi = a->num_blocks;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((const char *)(a->blocks[mid] + 1) <= (const char *)p)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-        int file_row;
-        for (file_row = 0; file_row < editorConf.num_rows; file_row++) {
-          editorUpdateSyntax(&editorConf.row[file_row]);
-        }
+/* The block of a that p points into, or NULL. */
+struct arenaBlock *arenaBlockOf(struct editorArena *a, const void *p) {
+  int i = arenaBlockSearch(a, p) - 1;
+  if (i < 0)
+    return NULL;
+  struct arenaBlock *b = a->blocks[i];
+  if ((const char *)p >= (const char *)(b + 1) + b->size)
+    return NULL;
+  return b;
+}
 
-        return;
-      }
-    }
+void arenaAddBlock(struct editorArena *a, struct arenaBlock *b) {
+  if (a->num_blocks == a->blocks_cap) {
+    a->blocks_cap = a->blocks_cap ? a->blocks_cap * 2 : 16;
+    a->blocks = realloc(a->blocks, sizeof(*a->blocks) * a->blocks_cap);
+    if (a->blocks == NULL)
+      die("realloc");
   }
+  int i = arenaBlockSearch(a, b + 1);
+  memmove(&a->blocks[i + 1], &a->blocks[i],
+          sizeof(*a->blocks) * (a->num_blocks - i));
+  a->blocks[i] = b;
+  a->num_blocks++;
+  b->arena = a;
+  b->pins = 0;
 }
 
-/*row handler*/
+/* Let go of a block nothing points into any more. */
+void arenaDropBlock(struct arenaBlock *b) {
+  if (b->size == ARENA_BLOCK_SIZE && editorConf.num_spare < ZOR_SPARE_BLOCKS) {
+    b->next = editorConf.spare;
+    editorConf.spare = b;
+    editorConf.num_spare++;
+    return;
+  }
+  free(b);
+}
 
-int editorRowCxToRx(editorRow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (ZOR_TAB_STOP - 1) - (rx % ZOR_TAB_STOP);
-    rx++;
+struct arenaBlock *arenaNewBlock(struct editorArena *a, size_t size) {
+  struct arenaBlock *b;
+  if (size == ARENA_BLOCK_SIZE && editorConf.spare) {
+    b = editorConf.spare;
+    editorConf.spare = b->next;
+    editorConf.num_spare--;
+  } else {
+    b = malloc(sizeof(struct arenaBlock) + size);
+    if (b == NULL)
+      die("malloc");
   }
-  return rx;
+  b->size = size;
+  b->used = 0;
+  arenaAddBlock(a, b);
+  return b;
 }
 
-int editorRowRxToCx(editorRow *row, int rx) {
-  int curr_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      curr_rx += (ZOR_TAB_STOP - 1) - (curr_rx % ZOR_TAB_STOP);
-    curr_rx++;
-    if (curr_rx > rx)
-      return cx;
+void *arenaBump(struct editorArena *a, size_t n, size_t align) {
+  struct arenaBlock *b = a->bump;
+  size_t off = b ? (b->used + align - 1) & ~(align - 1) : 0;
+
+  if (b == NULL || off + n > b->size) {
+    size_t size = n > ARENA_BLOCK_SIZE / 4 ? n : ARENA_BLOCK_SIZE;
+    b = arenaNewBlock(a, size);
+    off = 0;
+    a->bump_bytes += size;
+    /* oversized requests get a private block so the current one keeps
+     * filling up */
+    if (size <= ARENA_BLOCK_SIZE || a->bump == NULL)
+      a->bump = b;
   }
-  return cx;
+  b->used = off + n;
+  return (char *)(b + 1) + off;
 }
 
-void editorUpdateRow(editorRow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
-  }
-  free(row->render);
-  row->render = malloc(row->size + tabs * (ZOR_TAB_STOP - 1) + 1);
-
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % ZOR_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+void *arenaAlloc(struct editorArena *a, size_t n, int kind) {
+  unsigned int cls = 0;
+  while (cls < ARENA_CLASSES && ((size_t)1 << (cls + ARENA_MIN_SHIFT)) < n)
+    cls++;
+
+  arenaChunk *c;
+  if (cls == ARENA_LARGE) {
+    struct arenaBlock *b = arenaNewBlock(a, sizeof(arenaChunk) + n);
+    b->used = b->size;
+    c = (arenaChunk *)(b + 1);
+    c->cls = ARENA_LARGE;
+    c->kind = kind;
+    c->shares = 0;
+    a->used[kind] += n;
+    return c + 1;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 
-  editorUpdateSyntax(row);
+  size_t size = (size_t)1 << (cls + ARENA_MIN_SHIFT);
+  a->used[kind] += size;
+  a->small_bytes += size;
+  void *p = a->free_list[cls];
+  if (p) {
+    a->free_list[cls] = *(void **)p;
+    c = (arenaChunk *)p - 1;
+  } else {
+    c = arenaBump(a, sizeof(arenaChunk) + size, sizeof(void *));
+    c->cls = cls;
+  }
+  c->kind = kind;
+  c->shares = 0;
+  return c + 1;
 }
 
-void editorInsertRow(int pos, char *s, size_t len) {
-  if (pos < 0 || pos > editorConf.num_rows)
+size_t arenaChunkSize(void *p) {
+  arenaChunk *c = (arenaChunk *)p - 1;
+  if (c->cls == ARENA_LARGE)
+    return ((struct arenaBlock *)c - 1)->size - sizeof(arenaChunk);
+  return (size_t)1 << (c->cls + ARENA_MIN_SHIFT);
+}
+
+void arenaFree(struct editorArena *a, void *p) {
+  if (p == NULL)
+    return;
+  arenaChunk *c = (arenaChunk *)p - 1;
+  if (c->shares) {
+    c->shares--;
     return;
-  editorConf.row =
-      realloc(editorConf.row, sizeof(editorRow) * (editorConf.num_rows + 1));
-  memmove(&editorConf.row[pos + 1], &editorConf.row[pos],
-          sizeof(editorRow) * (editorConf.num_rows - pos));
-  editorConf.row =
-      realloc(editorConf.row, sizeof(editorRow) * (editorConf.num_rows + 1));
+  }
+  size_t size = arenaChunkSize(p);
+  a->used[c->kind] -= size;
+  if (c->cls == ARENA_LARGE) {
+    struct arenaBlock *b = (struct arenaBlock *)c - 1;
+    int i = arenaBlockSearch(a, b + 1) - 1;
+    memmove(&a->blocks[i], &a->blocks[i + 1],
+            sizeof(*a->blocks) * (a->num_blocks - i - 1));
+    a->num_blocks--;
+    free(b);
+    return;
+  }
+  a->small_bytes -= size;
+  *(void **)p = a->free_list[c->cls];
+  a->free_list[c->cls] = p;
+}
 
-  editorConf.row[pos].size = len;
-  editorConf.row[pos].chars = malloc(len + 1);
-  memcpy(editorConf.row[pos].chars, s, len);
-  editorConf.row[pos].chars[len] = '\0';
+void *arenaRealloc(struct editorArena *a, void *p, size_t n, int kind) {
+  if (p && arenaChunkSize(p) >= n)
+    return p;
+  void *q = arenaAlloc(a, n, kind);
+  if (p) {
+    memcpy(q, p, arenaChunkSize(p));
+    arenaFree(a, p);
+  }
+  return q;
+}
 
-  editorConf.row[pos].rsize = 0;
-  editorConf.row[pos].render = NULL;
-  editorConf.row[pos].hl = NULL;
-  editorUpdateRow(&editorConf.row[pos]);
+/* Another holder for chunk p; it stays until each has freed it. */
+void arenaShare(void *p) { ((arenaChunk *)p - 1)->shares++; }
 
-  editorConf.num_rows++;
-  editorConf.dirty++;
-}
+int arenaShared(void *p) { return ((arenaChunk *)p - 1)->shares != 0; }
 
-void editorFreeRow(editorRow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+/* Count a chunk as another kind, for text that moves between the rows and
+ * the undo history without being copied. */
+void arenaRetag(struct editorArena *a, void *p, int kind) {
+  arenaChunk *c = (arenaChunk *)p - 1;
+  size_t size = arenaChunkSize(p);
+  a->used[c->kind] -= size;
+  a->used[kind] += size;
+  c->kind = kind;
 }
 
-void editorDeleteRow(int pos) {
-  if (pos < 0 || pos >= editorConf.num_rows)
-    return;
-  editorFreeRow(&editorConf.row[pos]);
-  memmove(&editorConf.row[pos], &editorConf.row[pos + 1],
-          sizeof(editorRow) * (editorConf.num_rows - pos - 1));
-  editorConf.num_rows--;
-  editorConf.dirty++;
+/* Take ownership of a block filled elsewhere. The whole block counts as
+ * kind, since it is never carved into chunks. */
+void arenaAdopt(struct editorArena *a, struct arenaBlock *b, int kind) {
+  a->used[kind] += b->size;
+  b->used = b->size;
+  arenaAddBlock(a, b);
 }
 
-void editorRowInsertChar(editorRow *row, int pos, int c) {
-  if (pos < 0 || pos > row->size)
-    pos = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[pos + 1], &row->chars[pos], row->size - pos + 1);
-  row->size++;
-  row->chars[pos] = c;
-  editorUpdateRow(row);
-  editorConf.dirty++;
+/* Keep the block under p from being freed with its arena. */
+struct arenaBlock *arenaPin(struct editorArena *a, const void *p) {
+  struct arenaBlock *b = arenaBlockOf(a, p);
+  if (b)
+    b->pins++;
+  return b;
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  editorConf.dirty++;
+/* Undo an arenaPin. A block whose arena is gone goes with its last pin. */
+void arenaUnpin(struct arenaBlock *b) {
+  if (--b->pins > 0 || b->arena)
+    return;
+  editorConf.pinned_bytes -= b->size;
+  free(b);
 }
 
-void editorRowDeleteChar(editorRow *row, int pos) {
-  if (pos < 0 || pos >= row->size)
-    return;
-  memmove(&row->chars[pos], &row->chars[pos + 1], row->size - pos);
-  row->size--;
-  editorUpdateRow(row);
-  editorConf.dirty++;
+/* Free every block of a in one pass, leaving it empty. Blocks that
+ * registers still point into stay behind on their own. */
+void arenaRelease(struct editorArena *a) {
+  for (int i = 0; i < a->num_blocks; i++) {
+    struct arenaBlock *b = a->blocks[i];
+    if (b->pins) {
+      b->arena = NULL;
+      editorConf.pinned_bytes += b->size;
+    } else {
+      arenaDropBlock(b);
+    }
+  }
+  free(a->blocks);
+  free(a->cache_pages);
+  memset(a, 0, sizeof(struct editorArena));
 }
 
-/*editor operations*/
+/*syntax highlighter*/
 
-void editorInsertChar(int c) {
-  if (editorConf.cy == editorConf.num_rows) {
-    editorInsertRow(editorConf.num_rows, "", 0);
+int is_separator(int c) { return editorCharClass[(unsigned char)c] & CC_SEP; }
+
+unsigned int editorKeywordHash(const char *s, int len, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
   }
-  editorRowInsertChar(&editorConf.row[editorConf.cy], editorConf.cx, c);
-  editorConf.cx++;
+  return h;
 }
 
-void editorInsertNewline() {
-  if (editorConf.cx == 0) {
-    editorInsertRow(editorConf.cy, "", 0);
+int editorKeywordLookup(struct editorSyntax *syn, const char *s, int len) {
+  const struct editorKeyword *e =
+      &syn->kw_table[editorKeywordHash(s, len, syn->kw_seed) & syn->kw_mask];
+  if (e->len == len && !memcmp(e->word, s, len))
+    return e->hl;
+  return HL_NORMAL;
+}
+
+/* The keyword tables are laid out by hand; refuse to start on one whose
+ * words do not sit where editorKeywordLookup looks for them. */
+void editorKeywordCheck(void) {
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *syn = &HLDB[j];
+    for (unsigned int k = 0; k <= syn->kw_mask; k++) {
+      const struct editorKeyword *e = &syn->kw_table[k];
+      if (!e->word)
+        continue;
+      int len = strlen(e->word);
+      unsigned int at =
+          editorKeywordHash(e->word, len, syn->kw_seed) & syn->kw_mask;
+      if (len != e->len) {
+        fprintf(stderr, "zor: %s keyword \"%s\" has length %d, not %d\n",
+                syn->filetype, e->word, len, e->len);
+        exit(1);
+      }
+      if (at != k) {
+        fprintf(stderr,
+                "zor: %s keyword \"%s\" is in slot %u but hashes to %u\n",
+                syn->filetype, e->word, k, at);
+        exit(1);
+      }
+    }
+  }
+}
+
+char *editorRowRender(int at);
+
+editorRowCache *editorCacheAt(struct editorArena *a, int slot) {
+  if (slot == 0)
+    return NULL;
+  return &a->cache_pages[slot / ZOR_CACHE_PAGE][slot % ZOR_CACHE_PAGE];
+}
+
+editorRowCache *editorCacheSlot(int slot) {
+  return editorCacheAt(editorConf.arena, slot);
+}
+
+/* A zeroed cache slot from the active buffer's arena. Slot 0 stands for
+ * no cache and is never handed out. */
+int editorCacheNew() {
+  struct editorArena *a = editorConf.arena;
+  int slot = a->cache_free;
+  if (slot) {
+    a->cache_free = editorCacheAt(a, slot)->next_free;
+  } else {
+    if (a->cache_slots % ZOR_CACHE_PAGE == 0) {
+      int pages = a->cache_slots / ZOR_CACHE_PAGE;
+      a->cache_pages =
+          realloc(a->cache_pages, sizeof(editorRowCache *) * (pages + 1));
+      if (a->cache_pages == NULL)
+        die("realloc");
+      a->cache_pages[pages] =
+          arenaAlloc(a, sizeof(editorRowCache) * ZOR_CACHE_PAGE, MEM_RENDER);
+      if (pages == 0)
+        a->cache_slots = 1;
+    }
+    slot = a->cache_slots++;
+  }
+  memset(editorCacheAt(a, slot), 0, sizeof(editorRowCache));
+  return slot;
+}
+
+void editorFreeCache(struct editorArena *a, int slot) {
+  editorRowCache *cache = editorCacheAt(a, slot);
+  arenaFree(a, cache->render);
+  arenaFree(a, cache->hl);
+  arenaFree(a, cache->match);
+  arenaFree(a, cache->wrap);
+  cache->next_free = a->cache_free;
+  a->cache_free = slot;
+}
+
+void editorRowDropCache(int at) {
+  int slot = editorConf.row_cache[at];
+  editorConf.row_flags[at] &= ~ROW_HL_VALID;
+  if (slot == 0)
+    return;
+  editorFreeCache(editorConf.arena, slot);
+  editorConf.row_cache[at] = 0;
+  editorConf.cached_rows--;
+}
+
+editorRowCache *editorRowCacheOf(int at) {
+  if (editorConf.row_cache[at] == 0) {
+    editorConf.row_cache[at] = editorCacheNew();
+    editorConf.cached_rows++;
+  }
+  return editorCacheSlot(editorConf.row_cache[at]);
+}
+
+void editorInvalidateHighlight(int at) {
+  editorRowCache *cache = editorCacheSlot(editorConf.row_cache[at]);
+  editorConf.row_flags[at] &= ~ROW_HL_VALID;
+  if (cache == NULL)
+    return;
+  arenaFree(editorConf.arena, cache->hl);
+  cache->hl = NULL;
+  cache->hl_len = 0;
+}
+
+/* Classify the chars of one row into hl given whether it starts inside a
+ * block comment, and return whether it ends inside one. */
+int editorHighlightRow(int at, int open, unsigned char *hl) {
+  struct editorSyntax *syn = editorConf.syntax;
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  memset(hl, HL_NORMAL, size);
+
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = open;
+
+  int i = 0;
+  while (i < size) {
+    char c = chars[i];
+    unsigned char cc = editorCharClass[(unsigned char)c];
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment && c == scs[0] &&
+        !strncmp(&chars[i], scs, scs_len)) {
+      memset(&hl[i], HL_COMMENT, size - i);
+      break;
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        hl[i] = HL_MLCOMMENT;
+        if (c == mce[0] && !strncmp(&chars[i], mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (c == mcs[0] && !strncmp(&chars[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < size) {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      } else if (syn->is_delim[(unsigned char)c]) {
+        in_string = c;
+        hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (((cc & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        hl[i] = HL_NUMBER;
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep && (cc & CC_WORD)) {
+      int j = i + 1;
+      while (j < size && (editorCharClass[(unsigned char)chars[j]] & CC_WORD))
+        j++;
+      int kw = editorKeywordLookup(syn, &chars[i], j - i);
+      if (kw != HL_NORMAL)
+        memset(&hl[i], kw, j - i);
+      i = j;
+      prev_sep = 0;
+      continue;
+    }
+
+    prev_sep = cc & CC_SEP;
+    i++;
+  }
+  return in_comment;
+}
+
+unsigned char *editorHighlightScratch(int size) {
+  static unsigned char *hl = NULL;
+  static int hl_cap = 0;
+  if (size > hl_cap) {
+    hl_cap = size * 2;
+    hl = realloc(hl, hl_cap);
+    if (hl == NULL)
+      die("realloc");
+  }
+  return hl;
+}
+
+/* Whether row at ends inside a block comment. End states are known for a
+ * prefix of the buffer (hl_state_rows); asking past it extends the prefix. */
+int editorSyntaxOpen(int at) {
+  struct editorSyntax *syn = editorConf.syntax;
+  if (at < 0 || syn == NULL || !syn->multiline_comment_start)
+    return 0;
+
+  while (editorConf.hl_state_rows <= at) {
+    int r = editorConf.hl_state_rows;
+    int open = r > 0 && (editorConf.row_flags[r - 1] & ROW_HL_OPEN);
+    unsigned char *hl = editorHighlightScratch(editorConf.row_size[r]);
+    if (editorHighlightRow(r, open, hl))
+      editorConf.row_flags[r] |= ROW_HL_OPEN;
+    else
+      editorConf.row_flags[r] &= ~ROW_HL_OPEN;
+    editorConf.hl_state_rows++;
+  }
+  return (editorConf.row_flags[at] & ROW_HL_OPEN) != 0;
+}
+
+void editorUpdateSyntax(int at) {
+  int open = editorSyntaxOpen(at - 1);
+  editorInvalidateHighlight(at);
+  editorConf.row_flags[at] |= ROW_HL_VALID;
+  if (open)
+    editorConf.row_flags[at] |= ROW_HL_ENTRY;
+  else
+    editorConf.row_flags[at] &= ~ROW_HL_ENTRY;
+
+  int size = editorConf.row_size[at];
+  if (editorConf.syntax == NULL || size == 0)
+    return;
+
+  unsigned char *hl = editorHighlightScratch(size);
+  int closed = !editorHighlightRow(at, open, hl);
+  if (at < editorConf.hl_state_rows &&
+      closed == !(editorConf.row_flags[at] & ROW_HL_OPEN)) {
+    /* keep the known prefix */
+  } else if (at <= editorConf.hl_state_rows) {
+    editorConf.row_flags[at] =
+        closed ? editorConf.row_flags[at] & ~ROW_HL_OPEN
+               : editorConf.row_flags[at] | ROW_HL_OPEN;
+    editorConf.hl_state_rows = at + 1;
+  }
+
+  /* store the row as runs over render columns; an all-normal row needs no
+   * spans at all */
+  char *chars = editorConf.row[at].chars;
+  int tabs = editorConf.row_flags[at] & ROW_HAS_TABS;
+  int runs = 0;
+  int i;
+  for (i = 0; i < size; i++) {
+    if (i == 0 || hl[i] != hl[i - 1])
+      runs++;
+  }
+  editorRowCache *cache = editorCacheSlot(editorConf.row_cache[at]);
+  if (runs == 1 && hl[0] == HL_NORMAL) {
+    if (cache && cache->render == NULL && cache->match_gen == 0 &&
+        cache->wrap == NULL) {
+      editorFreeCache(editorConf.arena, editorConf.row_cache[at]);
+      editorConf.row_cache[at] = 0;
+      editorConf.cached_rows--;
+    }
+    return;
+  }
+
+  cache = editorRowCacheOf(at);
+  cache->hl =
+      arenaAlloc(editorConf.arena, sizeof(editorHlSpan) * runs, MEM_HL);
+  cache->hl_len = 0;
+  int rx = 0;
+  for (i = 0; i < size; i++) {
+    if (tabs && chars[i] == '\t')
+      rx += ZOR_TAB_STOP - (rx % ZOR_TAB_STOP);
+    else
+      rx++;
+    if (i + 1 == size || hl[i + 1] != hl[i]) {
+      cache->hl[cache->hl_len].end = rx;
+      cache->hl[cache->hl_len].hl = hl[i];
+      cache->hl_len++;
+    }
+  }
+}
+
+editorHlSpan *editorRowHighlight(int at, int *len) {
+  /* spans built under a different block comment state are stale too */
+  int open = editorSyntaxOpen(at - 1);
+  if (!(editorConf.row_flags[at] & ROW_HL_VALID) ||
+      open != !!(editorConf.row_flags[at] & ROW_HL_ENTRY))
+    editorUpdateSyntax(at);
+  editorRowCache *cache = editorCacheSlot(editorConf.row_cache[at]);
+  if (cache == NULL) {
+    *len = 0;
+    return NULL;
+  }
+  *len = cache->hl_len;
+  return cache->hl;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_STRING:
+    return 35;
+  case HL_NORMAL:
+    return 31;
+  case HL_MATCH:
+    return 105;
+  default:
+    return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  editorConf.syntax = NULL;
+  editorConf.hl_state_rows = 0;
+  if (editorConf.filename == NULL)
+    return;
+
+  char *ext = strrchr(editorConf.filename, '.');
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(editorConf.filename, s->filematch[i]))) {
+        editorConf.syntax = s;
+
+        /* highlighting is rebuilt lazily as rows are drawn */
+        editorConf.hl_state_rows = 0;
+        int file_row;
+        for (file_row = 0; file_row < editorConf.num_rows; file_row++) {
+          editorInvalidateHighlight(file_row);
+        }
+
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*index*/
+
+struct editorIndex *editorIndexNew() {
+  struct editorIndex *ix = calloc(1, sizeof(struct editorIndex));
+  if (ix == NULL)
+    die("calloc");
+  ix->nodes_cap = 256;
+  ix->nodes = calloc(ix->nodes_cap, sizeof(struct indexNode));
+  if (ix->nodes == NULL)
+    die("calloc");
+  ix->nodes[0].child = -1;
+  ix->nodes[0].next = -1;
+  ix->num_nodes = 1;
+  editorConf.mem[MEM_INDEX] += sizeof(struct indexNode) * ix->nodes_cap;
+  return ix;
+}
+
+void editorIndexFree(struct editorIndex *ix) {
+  if (ix == NULL)
+    return;
+  editorConf.mem[MEM_INDEX] -= sizeof(struct indexNode) * ix->nodes_cap +
+                               sizeof(struct indexDef) * ix->defs_cap;
+  free(ix->nodes);
+  free(ix->defs);
+  free(ix);
+}
+
+/* Start the active buffer's index over. Buffers with a filetype get one
+ * that fills in while the editor is idle; others build theirs when a
+ * lookup first needs it. */
+void editorIndexReset() {
+  editorIndexFree(editorConf.index);
+  editorConf.index = editorConf.syntax ? editorIndexNew() : NULL;
+  for (int i = 0; i < editorConf.num_rows; i++)
+    editorConf.row_flags[i] &= ~ROW_INDEXED;
+}
+
+/* The child of node for byte ch, added in order if create is set. Returns
+ * -1 if there is none. */
+int editorIndexChild(struct editorIndex *ix, int node, unsigned char ch,
+                     int create) {
+  int prev = -1;
+  int c = ix->nodes[node].child;
+  while (c != -1 && ix->nodes[c].ch < ch) {
+    prev = c;
+    c = ix->nodes[c].next;
+  }
+  if (c != -1 && ix->nodes[c].ch == ch)
+    return c;
+  if (!create)
+    return -1;
+
+  if (ix->num_nodes == ix->nodes_cap) {
+    editorConf.mem[MEM_INDEX] += sizeof(struct indexNode) * ix->nodes_cap;
+    ix->nodes_cap *= 2;
+    ix->nodes = realloc(ix->nodes, sizeof(struct indexNode) * ix->nodes_cap);
+    if (ix->nodes == NULL)
+      die("realloc");
+  }
+  int n = ix->num_nodes++;
+  memset(&ix->nodes[n], 0, sizeof(struct indexNode));
+  ix->nodes[n].ch = ch;
+  ix->nodes[n].child = -1;
+  ix->nodes[n].next = c;
+  if (prev == -1)
+    ix->nodes[node].child = n;
+  else
+    ix->nodes[prev].next = n;
+  return n;
+}
+
+/* The node for s, or -1 if no word starts with it. */
+int editorIndexFind(struct editorIndex *ix, const char *s, int len) {
+  int node = 0;
+  for (int i = 0; i < len && node != -1; i++)
+    node = editorIndexChild(ix, node, s[i], 0);
+  return node;
+}
+
+/* Count delta more occurrences of s and return its node. */
+int editorIndexAdd(struct editorIndex *ix, const char *s, int len,
+                   int delta) {
+  int path[ZOR_WORD_MAX + 1];
+  path[0] = 0;
+  for (int i = 0; i < len; i++)
+    path[i + 1] = editorIndexChild(ix, path[i], s[i], 1);
+  struct indexNode *node = &ix->nodes[path[len]];
+  int was = node->count > 0;
+  node->count += delta;
+  int words = (node->count > 0) - was;
+  for (int i = 0; i <= len; i++) {
+    ix->nodes[path[i]].sub += delta;
+    ix->nodes[path[i]].words += words;
+  }
+  return path[len];
+}
+
+/* The first def at or after row. */
+int editorIndexDefAt(struct editorIndex *ix, int row) {
+  int lo = 0, hi = ix->num_defs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ix->defs[mid].row < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void editorIndexAddDef(struct editorIndex *ix, int row, int node) {
+  if (ix->num_defs == ix->defs_cap) {
+    int cap = ix->defs_cap ? ix->defs_cap * 2 : 64;
+    editorConf.mem[MEM_INDEX] +=
+        sizeof(struct indexDef) * (cap - ix->defs_cap);
+    ix->defs_cap = cap;
+    ix->defs = realloc(ix->defs, sizeof(struct indexDef) * cap);
+    if (ix->defs == NULL)
+      die("realloc");
+  }
+  int i = editorIndexDefAt(ix, row + 1);
+  memmove(&ix->defs[i + 1], &ix->defs[i],
+          sizeof(struct indexDef) * (ix->num_defs - i));
+  ix->defs[i].row = row;
+  ix->defs[i].node = node;
+  ix->num_defs++;
+}
+
+/* Whether the word [s, s + len) of row at is defined there: it follows
+ * #define, struct, union, enum, class or def, or it is called in a row
+ * that starts in column 0 with its return type and is not a prototype. */
+int editorIndexIsDef(int at, int s, int len) {
+  static const char *intro[] = {"struct", "union", "enum", "class", "def",
+                                NULL};
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+
+  int e = s + len;
+  while (e < size && (editorCharClass[(unsigned char)chars[e]] & CC_SPACE))
+    e++;
+  int next = e < size ? chars[e] : '\0';
+  int p = s;
+  while (p > 0 && (editorCharClass[(unsigned char)chars[p - 1]] & CC_SPACE))
+    p--;
+  int prev_end = p;
+  while (p > 0 && (editorCharClass[(unsigned char)chars[p - 1]] & CC_WORD))
+    p--;
+  int prev_len = prev_end - p;
+
+  if (prev_len == 6 && memcmp(chars + p, "define", 6) == 0) {
+    int h = 0;
+    while (h < p && (editorCharClass[(unsigned char)chars[h]] & CC_SPACE))
+      h++;
+    return chars[h] == '#';
+  }
+  for (int i = 0; intro[i]; i++) {
+    if (prev_len == (int)strlen(intro[i]) &&
+        memcmp(chars + p, intro[i], prev_len) == 0)
+      return next == '{' || next == '(' || next == ':' || next == '\0';
+  }
+
+  if (next != '(' || !(editorCharClass[(unsigned char)chars[0]] & CC_WORD))
+    return 0;
+  p = s;
+  while (p > 0 && ((editorCharClass[(unsigned char)chars[p - 1]] & CC_SPACE) ||
+                   chars[p - 1] == '*'))
+    p--;
+  prev_end = p;
+  while (p > 0 && (editorCharClass[(unsigned char)chars[p - 1]] & CC_WORD))
+    p--;
+  if (p == prev_end)
+    return 0;
+  struct editorSyntax *syn = editorConf.syntax;
+  if (syn && (editorKeywordLookup(syn, chars + p, prev_end - p) ==
+                  HL_KEYWORD1 ||
+              editorKeywordLookup(syn, chars + s, len) != HL_NORMAL))
+    return 0;
+  int last = size;
+  while (last > 0 &&
+         (editorCharClass[(unsigned char)chars[last - 1]] & CC_SPACE))
+    last--;
+  return chars[last - 1] != ';';
+}
+
+/* Count the words of row at into the index (delta 1) or out of it (-1).
+ * Words are runs of keyword characters, as the highlighter splits them,
+ * of 2 to ZOR_WORD_MAX bytes that do not start with a digit. */
+void editorIndexRow(int at, int delta) {
+  struct editorIndex *ix = editorConf.index;
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+
+  if (delta < 0) {
+    int i = editorIndexDefAt(ix, at);
+    int j = i;
+    while (j < ix->num_defs && ix->defs[j].row == at)
+      j++;
+    memmove(&ix->defs[i], &ix->defs[j],
+            sizeof(struct indexDef) * (ix->num_defs - j));
+    ix->num_defs -= j - i;
+  }
+  int i = 0;
+  while (i < size) {
+    if (!(editorCharClass[(unsigned char)chars[i]] & CC_WORD)) {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < size && (editorCharClass[(unsigned char)chars[i]] & CC_WORD))
+      i++;
+    int len = i - start;
+    if (len < 2 || len > ZOR_WORD_MAX ||
+        (editorCharClass[(unsigned char)chars[start]] & CC_DIGIT))
+      continue;
+    int node = editorIndexAdd(ix, chars + start, len, delta);
+    if (delta > 0 && editorIndexIsDef(at, start, len))
+      editorIndexAddDef(ix, at, node);
+  }
+  if (delta > 0)
+    editorConf.row_flags[at] |= ROW_INDEXED;
+  else
+    editorConf.row_flags[at] &= ~ROW_INDEXED;
+}
+
+/* Rows from at on may no longer be indexed. */
+void editorIndexDirty(int at) {
+  if (editorConf.index && at < editorConf.index->scan)
+    editorConf.index->scan = at;
+}
+
+/* Take row at out of the index before its text changes or goes away. */
+void editorIndexDropRow(int at) {
+  if (editorConf.row_flags[at] & ROW_INDEXED)
+    editorIndexRow(at, -1);
+  editorIndexDirty(at);
+}
+
+/* Move the defs along after the splice of n hunks, in the coordinates from
+ * before it. Defs in deleted rows went when those rows were dropped. */
+void editorIndexShift(struct editorHunk *hunks, int n) {
+  struct editorIndex *ix = editorConf.index;
+  if (ix == NULL || n == 0)
+    return;
+  int h = 0, delta = 0;
+  for (int i = 0; i < ix->num_defs; i++) {
+    while (h < n && hunks[h].at + hunks[h].del <= ix->defs[i].row) {
+      delta += hunks[h].ins - hunks[h].del;
+      h++;
+    }
+    ix->defs[i].row += delta;
+  }
+  editorIndexDirty(hunks[0].at);
+}
+
+int editorIndexDefCompare(const void *a, const void *b) {
+  const struct indexDef *x = a, *y = b;
+  return (x->row > y->row) - (x->row < y->row);
+}
+
+/* Follow rows [at, at + n) that moved so the one at offset i went to
+ * offset to[i]. */
+void editorIndexPermute(int at, int n, int *to) {
+  struct editorIndex *ix = editorConf.index;
+  if (ix == NULL)
+    return;
+  int i = editorIndexDefAt(ix, at);
+  int j = editorIndexDefAt(ix, at + n);
+  for (int k = i; k < j; k++)
+    ix->defs[k].row = at + to[ix->defs[k].row - at];
+  qsort(&ix->defs[i], j - i, sizeof(struct indexDef), editorIndexDefCompare);
+}
+
+int editorIndexPending() {
+  return editorConf.index && editorConf.index->scan < editorConf.num_rows;
+}
+
+/* Index up to batch rows that are not, going on from where the last step
+ * stopped. */
+void editorIndexStep(int batch) {
+  struct editorIndex *ix = editorConf.index;
+  if (ix == NULL)
+    return;
+  while (ix->scan < editorConf.num_rows && batch > 0) {
+    if (!(editorConf.row_flags[ix->scan] & ROW_INDEXED)) {
+      editorIndexRow(ix->scan, 1);
+      batch--;
+    }
+    ix->scan++;
+  }
+}
+
+/* The active buffer's index with every row in it, for a lookup. */
+struct editorIndex *editorIndexUpdate() {
+  if (editorConf.index == NULL)
+    editorConf.index = editorIndexNew();
+  editorIndexStep(INT_MAX);
+  return editorConf.index;
+}
+
+/* Append the first word under node in byte order to buf[0..len) and
+ * return its length. node must have a word under it. */
+int editorIndexFirst(struct editorIndex *ix, int node, char *buf, int len) {
+  while (ix->nodes[node].count == 0) {
+    int c = ix->nodes[node].child;
+    while (ix->nodes[c].sub == 0)
+      c = ix->nodes[c].next;
+    buf[len++] = ix->nodes[c].ch;
+    node = c;
+  }
+  return len;
+}
+
+/* Like editorIndexFirst, for the last word. */
+int editorIndexLast(struct editorIndex *ix, int node, char *buf, int len) {
+  for (;;) {
+    int last = -1;
+    for (int c = ix->nodes[node].child; c != -1; c = ix->nodes[c].next) {
+      if (ix->nodes[c].sub)
+        last = c;
+    }
+    if (last == -1)
+      return len;
+    buf[len++] = ix->nodes[last].ch;
+    node = last;
+  }
+}
+
+/* Step word to the next (dir 1) or previous (dir -1) word in byte order
+ * among those longer than plen that share its first plen bytes. word is
+ * rewritten in place; returns the new length, or -1 past either end. */
+int editorIndexNext(struct editorIndex *ix, char *word, int len, int plen,
+                    int dir) {
+  int path[ZOR_WORD_MAX + 1];
+  path[0] = 0;
+  for (int i = 0; i < len; i++) {
+    path[i + 1] = editorIndexChild(ix, path[i], word[i], 0);
+    if (path[i + 1] == -1)
+      return -1;
+  }
+
+  if (dir > 0) {
+    for (int c = ix->nodes[path[len]].child; c != -1; c = ix->nodes[c].next) {
+      if (ix->nodes[c].sub) {
+        word[len] = ix->nodes[c].ch;
+        return editorIndexFirst(ix, c, word, len + 1);
+      }
+    }
+    for (int d = len - 1; d >= plen; d--) {
+      for (int c = ix->nodes[path[d + 1]].next; c != -1;
+           c = ix->nodes[c].next) {
+        if (ix->nodes[c].sub) {
+          word[d] = ix->nodes[c].ch;
+          return editorIndexFirst(ix, c, word, d + 1);
+        }
+      }
+    }
+    return -1;
+  }
+
+  for (int d = len - 1; d >= plen; d--) {
+    int last = -1;
+    for (int c = ix->nodes[path[d]].child; c != path[d + 1];
+         c = ix->nodes[c].next) {
+      if (ix->nodes[c].sub)
+        last = c;
+    }
+    if (last != -1) {
+      word[d] = ix->nodes[last].ch;
+      return editorIndexLast(ix, last, word, d + 1);
+    }
+    if (d > plen && ix->nodes[path[d]].count)
+      return d;
+  }
+  return -1;
+}
+
+/* Where word falls among the words editorIndexNext steps through, from
+ * 1. */
+int editorIndexRank(struct editorIndex *ix, const char *word, int len,
+                    int plen) {
+  int rank = 1, node = 0;
+  for (int i = 0; i < len; i++) {
+    int next = editorIndexChild(ix, node, word[i], 0);
+    if (i >= plen) {
+      if (i > plen && ix->nodes[node].count)
+        rank++;
+      for (int c = ix->nodes[node].child; c != next; c = ix->nodes[c].next)
+        rank += ix->nodes[c].words;
+    }
+    node = next;
+  }
+  return rank;
+}
+
+/*sum trees*/
+
+void *editorSumTreeNode(struct editorSumTree *t, int node) {
+  return (char *)t->nodes + t->elem * node;
+}
+
+void editorSumTreeFree(struct editorSumTree *t) {
+  editorConf.mem[MEM_INDEX] -= t->elem * 2 * t->size;
+  free(t->nodes);
+}
+
+/* Rows from at on are to be counted again. */
+void editorSumTreeInvalidate(struct editorSumTree *t, int at) {
+  if (t->rows > t->high)
+    t->high = t->rows;
+  if (at < t->rows)
+    t->rows = at;
+  if (at < t->built)
+    t->built = at;
+}
+
+/* Row at's text changed in place. */
+void editorSumTreeRowChanged(struct editorSumTree *t, int at) {
+  if (at >= t->rows)
+    return;
+  if (t->leaf(t, at))
+    editorSumTreeInvalidate(t, at + 1);
+  if (at < t->built) {
+    for (int node = (t->size + at) / 2; node >= 1; node /= 2)
+      t->pull(t, node);
+  }
+}
+
+/* Follow a splice of n hunks. A single one just moves the leaves after
+ * it, and the rows it inserts are counted as they go in; anything else
+ * counts again from the first hunk. Returns whether the leaves moved. */
+int editorSumTreeShift(struct editorSumTree *t, struct editorHunk *hunks,
+                       int n) {
+  if (n == 0)
+    return 0;
+  int at = hunks[0].at;
+  int rows = t->rows + hunks[0].ins - hunks[0].del;
+  if (n > 1 || at + hunks[0].del > t->rows || rows > t->size) {
+    editorSumTreeInvalidate(t, at);
+    return 0;
+  }
+  if (t->rows > t->high)
+    t->high = t->rows;
+  memmove(editorSumTreeNode(t, t->size + at + hunks[0].ins),
+          editorSumTreeNode(t, t->size + at + hunks[0].del),
+          t->elem * (t->rows - at - hunks[0].del));
+  t->rows = rows;
+  if (at < t->built)
+    t->built = at;
+  return 1;
+}
+
+/* Make room for n rows. Returns whether the tree grew, which leaves its
+ * inner nodes to be built again. */
+int editorSumTreeGrow(struct editorSumTree *t, int n) {
+  if (t->size && n <= t->size)
+    return 0;
+  int size = t->size ? t->size : 64;
+  while (size < n)
+    size *= 2;
+  void *nodes = calloc(2 * size, t->elem);
+  if (nodes == NULL)
+    die("calloc");
+  if (t->nodes)
+    memcpy((char *)nodes + t->elem * size, editorSumTreeNode(t, t->size),
+           t->elem * t->rows);
+  editorConf.mem[MEM_INDEX] += t->elem * 2 * (size - t->size);
+  free(t->nodes);
+  t->nodes = nodes;
+  t->size = size;
+  t->built = 0;
+  t->high = t->rows;
+  return 1;
+}
+
+/* Count the rows not yet in the tree and build the inner nodes over
+ * them. */
+void editorSumTreeUpdate(struct editorSumTree *t) {
+  int n = editorConf.num_rows;
+  editorSumTreeGrow(t, n);
+  for (int i = t->rows; i < n; i++)
+    t->leaf(t, i);
+  if (t->high > n)
+    memset(editorSumTreeNode(t, t->size + n), 0, t->elem * (t->high - n));
+  if (t->rows < t->built)
+    t->built = t->rows;
+  t->rows = n;
+  t->high = n;
+
+  if (t->built < t->size) {
+    for (int lo = (t->size + t->built) / 2, hi = t->size; lo >= 1;
+         lo /= 2, hi /= 2) {
+      for (int node = lo; node < hi; node++)
+        t->pull(t, node);
+      if (hi == 1)
+        break;
+    }
+    t->built = t->size;
+  }
+}
+
+/*brackets*/
+
+/* Classify chars[i] for bracket matching: 0 to 2 for an opening (, [ or
+ * {, 3 to 5 for the closing one, -1 for anything else and -2 at a line
+ * comment, which ends the row. *quote follows string literals and block
+ * comments from one char to the next and starts at 0 for each row, so a
+ * comment spanning rows is still counted. */
+int editorBracketClass(char *chars, int size, int i, int *quote) {
+  struct editorSyntax *syn = editorConf.syntax;
+  unsigned char c = chars[i];
+  if (*quote >= 0x200) {
+    /* the end of the comment may not overlap its start */
+    char *mce = syn->multiline_comment_end;
+    int n = strlen(mce);
+    if (*quote > 0x200)
+      (*quote)--;
+    else if (memcmp(chars + i + 1 - n, mce, n) == 0)
+      *quote = 0;
+    return -1;
+  }
+  if (*quote) {
+    if (*quote & 0x100)
+      *quote &= 0xff;
+    else if (c == '\\')
+      *quote |= 0x100;
+    else if (c == *quote)
+      *quote = 0;
+    return -1;
+  }
+  if (syn) {
+    char *mcs = syn->multiline_comment_start;
+    int n = mcs ? strlen(mcs) : 0;
+    if (n && syn->multiline_comment_end && i + n <= size &&
+        memcmp(chars + i, mcs, n) == 0) {
+      *quote = 0x200 + n - 1 + strlen(syn->multiline_comment_end) - 1;
+      return -1;
+    }
+    if (syn->is_delim[c]) {
+      *quote = c;
+      return -1;
+    }
+    char *scs = syn->singleline_comment_start;
+    n = scs ? strlen(scs) : 0;
+    if (n && i + n <= size && memcmp(chars + i, scs, n) == 0)
+      return -2;
+  }
+  switch (c) {
+  case '(':
+    return 0;
+  case '[':
+    return 1;
+  case '{':
+    return 2;
+  case ')':
+    return 3;
+  case ']':
+    return 4;
+  case '}':
+    return 5;
+  }
+  return -1;
+}
+
+void editorBracketsFree(struct editorBrackets *b) {
+  if (b == NULL)
+    return;
+  editorConf.mem[MEM_INDEX] -= b->tree.size;
+  editorSumTreeFree(&b->tree);
+  free(b->open);
+  free(b);
+}
+
+/* The quote state row at starts in: inside a block comment if the row
+ * before ended in one, which the tree must already hold. */
+int editorBracketsQuote(struct editorBrackets *b, int at) {
+  struct editorSyntax *syn = editorConf.syntax;
+  if (at == 0 || !b->open[at - 1] || syn == NULL ||
+      !syn->multiline_comment_end)
+    return 0;
+  return 0x200 + strlen(syn->multiline_comment_end) - 1;
+}
+
+/* Count row at into its leaf. Returns whether the row's block comment
+ * state at its end changed. */
+int editorBracketsLeaf(struct editorSumTree *t, int at) {
+  struct editorBrackets *b = (struct editorBrackets *)t;
+  struct bracketSum *leaf = editorSumTreeNode(t, t->size + at);
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  int quote = editorBracketsQuote(b, at);
+  memset(leaf, 0, t->elem);
+  for (int i = 0; i < size; i++) {
+    int k = editorBracketClass(chars, size, i, &quote);
+    if (k == -2)
+      break;
+    if (k < 0)
+      continue;
+    if (k < 3) {
+      leaf[k].sum++;
+    } else if (--leaf[k - 3].sum < leaf[k - 3].min) {
+      leaf[k - 3].min = leaf[k - 3].sum;
+    }
+  }
+  int open = quote >= 0x200;
+  if (open == b->open[at])
+    return 0;
+  b->open[at] = open;
+  return 1;
+}
+
+void editorBracketsPull(struct editorSumTree *t, int node) {
+  struct bracketSum(*tree)[3] = t->nodes;
+  for (int k = 0; k < 3; k++) {
+    struct bracketSum *l = &tree[2 * node][k];
+    struct bracketSum *r = &tree[2 * node + 1][k];
+    tree[node][k].sum = l->sum + r->sum;
+    tree[node][k].min = l->min < l->sum + r->min ? l->min : l->sum + r->min;
+  }
+}
+
+/* Rows from at on are to be recounted. */
+void editorBracketsInvalidate(int at) {
+  if (editorConf.brackets)
+    editorSumTreeInvalidate(&editorConf.brackets->tree, at);
+}
+
+/* Row at's text changed in place. */
+void editorBracketsRowChanged(int at) {
+  if (editorConf.brackets)
+    editorSumTreeRowChanged(&editorConf.brackets->tree, at);
+}
+
+/* Follow a splice of n hunks, carrying each row's block comment state
+ * along with its leaf. */
+void editorBracketsShift(struct editorHunk *hunks, int n) {
+  struct editorBrackets *b = editorConf.brackets;
+  if (b == NULL)
+    return;
+  int rows = b->tree.rows;
+  if (!editorSumTreeShift(&b->tree, hunks, n))
+    return;
+  int at = hunks[0].at, ins = hunks[0].ins, del = hunks[0].del;
+  /* the last row put in is checked against the state the rows after it
+   * start in */
+  unsigned char open = at + del > 0 ? b->open[at + del - 1] : 0;
+  memmove(&b->open[at + ins], &b->open[at + del], rows - at - del);
+  if (ins)
+    b->open[at + ins - 1] = open;
+  if (ins == 0 && open != (at > 0 && b->open[at - 1]))
+    editorSumTreeInvalidate(&b->tree, at);
+}
+
+/* The tree over the active buffer, brought up to date. */
+struct editorBrackets *editorBracketsUpdate() {
+  struct editorBrackets *b = editorConf.brackets;
+  if (b == NULL) {
+    b = calloc(1, sizeof(struct editorBrackets));
+    if (b == NULL)
+      die("calloc");
+    b->tree.elem = sizeof(struct bracketSum[3]);
+    b->tree.leaf = editorBracketsLeaf;
+    b->tree.pull = editorBracketsPull;
+    editorConf.brackets = b;
+  }
+  /* grown first, so open has room for the rows counted in */
+  int size = b->tree.size;
+  if (editorSumTreeGrow(&b->tree, editorConf.num_rows)) {
+    b->open = realloc(b->open, b->tree.size);
+    if (b->open == NULL)
+      die("realloc");
+    memset(b->open + size, 0, b->tree.size - size);
+    editorConf.mem[MEM_INDEX] += b->tree.size - size;
+  }
+  editorSumTreeUpdate(&b->tree);
+  return b;
+}
+
+/* Depth of kind k at the start of row at. */
+int editorBracketsDepth(struct editorBrackets *b, int k, int at) {
+  struct bracketSum(*tree)[3] = b->tree.nodes;
+  int depth = 0;
+  for (int lo = b->tree.size, hi = b->tree.size + at; lo < hi;
+       lo /= 2, hi /= 2) {
+    if (lo & 1)
+      depth += tree[lo++][k].sum;
+    if (hi & 1)
+      depth += tree[--hi][k].sum;
+  }
+  return depth;
+}
+
+/* First row at or after from whose depth of kind k drops to target or
+ * lower, given in *depth the depth at from. Walks node's range [lo, hi)
+ * and returns -1 if it has no such row. */
+int editorBracketsFirst(struct editorBrackets *b, int node, int lo, int hi,
+                        int from, int k, int target, int *depth) {
+  if (hi <= from)
+    return -1;
+  struct bracketSum(*tree)[3] = b->tree.nodes;
+  struct bracketSum *s = &tree[node][k];
+  if (lo >= from && *depth + s->min > target) {
+    *depth += s->sum;
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = lo + (hi - lo) / 2;
+  int r = editorBracketsFirst(b, 2 * node, lo, mid, from, k, target, depth);
+  if (r == -1)
+    r = editorBracketsFirst(b, 2 * node + 1, mid, hi, from, k, target, depth);
+  return r;
+}
+
+/* Last row at or before to whose depth of kind k drops to target or
+ * lower, given in *depth the depth after row to. */
+int editorBracketsLast(struct editorBrackets *b, int node, int lo, int hi,
+                       int to, int k, int target, int *depth) {
+  if (lo > to)
+    return -1;
+  struct bracketSum(*tree)[3] = b->tree.nodes;
+  struct bracketSum *s = &tree[node][k];
+  if (hi <= to + 1 && *depth - s->sum + s->min > target) {
+    *depth -= s->sum;
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = lo + (hi - lo) / 2;
+  int r = editorBracketsLast(b, 2 * node + 1, mid, hi, to, k, target, depth);
+  if (r == -1)
+    r = editorBracketsLast(b, 2 * node, lo, mid, to, k, target, depth);
+  return r;
+}
+
+/* Walk the brackets of kind k in row at, which starts at depth. With dir
+ * 1, return the column of the first closer after column from that brings
+ * the depth down to target; with dir -1, the last opener before column
+ * from that starts at depth target. -1 if there is none. */
+int editorBracketFind(struct editorBrackets *b, int at, int k, int depth,
+                      int from, int target, int dir) {
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  int quote = editorBracketsQuote(b, at), found = -1;
+  for (int i = 0; i < size; i++) {
+    int c = editorBracketClass(chars, size, i, &quote);
+    if (c == -2 || (dir < 0 && i >= from))
+      break;
+    if (c == k) {
+      if (dir < 0 && depth == target)
+        found = i;
+      depth++;
+    } else if (c == k + 3) {
+      depth--;
+      if (dir > 0 && i > from && depth == target)
+        return i;
+    }
+  }
+  return found;
+}
+
+/* Depth of kind k just before column col of row at, which starts at
+ * depth. */
+int editorBracketDepthAt(struct editorBrackets *b, int at, int k, int depth,
+                         int col) {
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  int quote = editorBracketsQuote(b, at);
+  for (int i = 0; i < col && i < size; i++) {
+    int c = editorBracketClass(chars, size, i, &quote);
+    if (c == -2)
+      break;
+    if (c == k)
+      depth++;
+    else if (c == k + 3)
+      depth--;
+  }
+  return depth;
+}
+
+/* Find the bracket matching the opener (closer if dir is -1) of kind k at
+ * (*col, *row) and move both there. Returns -1 if it has no match. */
+int editorBracketMatch(int k, int dir, int *row, int *col) {
+  struct editorBrackets *b = editorBracketsUpdate();
+  int at = *row;
+  int start = editorBracketsDepth(b, k, at);
+  int target = editorBracketDepthAt(b, at, k, start, *col) - (dir < 0);
+  int c = editorBracketFind(b, at, k, start, *col, target, dir);
+  if (c == -1) {
+    int depth;
+    if (dir > 0) {
+      depth = editorBracketsDepth(b, k, at + 1);
+      at = editorBracketsFirst(b, 1, 0, b->tree.size, at + 1, k, target,
+                               &depth);
+    } else {
+      depth = start;
+      at = at > 0 ? editorBracketsLast(b, 1, 0, b->tree.size, at - 1, k,
+                                       target, &depth)
+                  : -1;
+    }
+    if (at == -1 || at >= editorConf.num_rows)
+      return -1;
+    c = editorBracketFind(b, at, k, editorBracketsDepth(b, k, at),
+                          dir > 0 ? -1 : INT_MAX, target, dir);
+    if (c == -1)
+      return -1;
+  }
+  *row = at;
+  *col = c;
+  return 0;
+}
+
+/* %: jump to the bracket matching the first one at or after the cursor on
+ * its row. */
+void editorMatchBracket() {
+  int cy = editorConf.cy;
+  if (cy >= editorConf.num_rows)
+    return;
+  char *chars = editorConf.row[cy].chars;
+  int size = editorConf.row_size[cy];
+  int quote = editorBracketsQuote(editorBracketsUpdate(), cy);
+  int col = -1, k = -1;
+  for (int i = 0; i < size; i++) {
+    int c = editorBracketClass(chars, size, i, &quote);
+    if (c == -2)
+      break;
+    if (c >= 0 && i >= editorConf.cx) {
+      col = i;
+      k = c;
+      break;
+    }
+  }
+  if (col == -1)
+    return;
+  int dir = k < 3 ? 1 : -1;
+  if (editorBracketMatch(k % 3, dir, &cy, &col) == -1) {
+    /* the match may be in rows still loading */
+    if (dir < 0 || editorConf.loader == NULL) {
+      editorSetStatusMessage("No matching bracket");
+      return;
+    }
+    editorWaitRows(INT_MAX);
+    if (editorBracketMatch(k % 3, dir, &cy, &col) == -1) {
+      editorSetStatusMessage("No matching bracket");
+      return;
+    }
+  }
+  editorGotoLine(cy);
+  editorConf.cx = col;
+}
+
+/*wrap*/
+
+/* Lay row at out in screen lines cols wide, breaking after the last blank
+ * that fits or else at the edge, and return how many it takes. starts,
+ * if given, gets the render column each line starts at. */
+int editorWrapBreaks(int at, int cols, int *starts) {
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  int n = 1, start = 0, blank = 0, rx = 0;
+  if (starts)
+    starts[0] = 0;
+  for (int i = 0; i < size; i++) {
+    int w = chars[i] == '\t' ? ZOR_TAB_STOP - rx % ZOR_TAB_STOP : 1;
+    while (rx + w - start > cols && rx > start) {
+      start = blank > start ? blank : rx;
+      if (starts)
+        starts[n] = start;
+      n++;
+    }
+    rx += w;
+    if (chars[i] == ' ' || chars[i] == '\t')
+      blank = rx;
+  }
+  return n;
+}
+
+void editorLayoutFree(struct editorLayout *l) {
+  if (l == NULL)
+    return;
+  editorSumTreeFree(&l->tree);
+  free(l);
+}
+
+int editorLayoutLeaf(struct editorSumTree *t, int at) {
+  struct editorLayout *l = (struct editorLayout *)t;
+  int *leaf = editorSumTreeNode(t, t->size + at);
+  *leaf = editorRowRsize(at) <= l->cols ? 1
+                                        : editorWrapBreaks(at, l->cols, NULL);
+  return 0;
+}
+
+void editorLayoutPull(struct editorSumTree *t, int node) {
+  int *tree = t->nodes;
+  tree[node] = tree[2 * node] + tree[2 * node + 1];
+}
+
+/* Row at's text changed in place. */
+void editorLayoutRowChanged(int at) {
+  if (editorConf.layout)
+    editorSumTreeRowChanged(&editorConf.layout->tree, at);
+}
+
+/* Rows from at on are to be laid out again. */
+void editorLayoutInvalidate(int at) {
+  if (editorConf.layout)
+    editorSumTreeInvalidate(&editorConf.layout->tree, at);
+}
+
+/* Follow a splice of n hunks. */
+void editorLayoutShift(struct editorHunk *hunks, int n) {
+  if (editorConf.layout)
+    editorSumTreeShift(&editorConf.layout->tree, hunks, n);
+}
+
+/* The tree over the active buffer for the current width, brought up to
+ * date. A new width lays out every row again, but one that fits in a line
+ * costs only a look at its length. */
+struct editorLayout *editorLayoutUpdate() {
+  struct editorLayout *l = editorConf.layout;
+  if (l == NULL) {
+    l = calloc(1, sizeof(struct editorLayout));
+    if (l == NULL)
+      die("calloc");
+    l->tree.elem = sizeof(int);
+    l->tree.leaf = editorLayoutLeaf;
+    l->tree.pull = editorLayoutPull;
+    l->cols = editorConf.screen_cols;
+    editorConf.layout = l;
+  }
+  if (l->cols != editorConf.screen_cols) {
+    editorSumTreeInvalidate(&l->tree, 0);
+    l->cols = editorConf.screen_cols;
+  }
+  editorSumTreeUpdate(&l->tree);
+  return l;
+}
+
+/* Screen lines taken by rows [0, at). */
+int editorLayoutPrefix(struct editorLayout *l, int at) {
+  int *tree = l->tree.nodes, lines = 0;
+  for (int lo = l->tree.size, hi = l->tree.size + at; lo < hi;
+       lo /= 2, hi /= 2) {
+    if (lo & 1)
+      lines += tree[lo++];
+    if (hi & 1)
+      lines += tree[--hi];
+  }
+  return lines;
+}
+
+/* The row that screen line *line, counted from the top of the buffer, is
+ * in; *line becomes the line within that row. */
+int editorLayoutFind(struct editorLayout *l, int *line) {
+  int *tree = l->tree.nodes, node = 1;
+  while (node < l->tree.size) {
+    if (tree[2 * node] > *line) {
+      node = 2 * node;
+    } else {
+      *line -= tree[2 * node];
+      node = 2 * node + 1;
+    }
+  }
+  return node - l->tree.size;
+}
+
+/* Where each screen line of row at starts, laid out once per width and
+ * kept in the row's cache; *n gets how many there are. */
+int *editorRowWrap(int at, int *n) {
+  static int whole = 0;
+  int cols = editorConf.screen_cols;
+  if (editorRowRsize(at) <= cols) {
+    *n = 1;
+    return &whole;
+  }
+  editorRowCache *cache = editorRowCacheOf(at);
+  if (cache->wrap == NULL || cache->wrap_cols != cols) {
+    arenaFree(editorConf.arena, cache->wrap);
+    cache->wrap_len = editorWrapBreaks(at, cols, NULL);
+    cache->wrap = arenaAlloc(editorConf.arena,
+                             sizeof(int) * cache->wrap_len, MEM_RENDER);
+    editorWrapBreaks(at, cols, cache->wrap);
+    cache->wrap_cols = cols;
+  }
+  *n = cache->wrap_len;
+  return cache->wrap;
+}
+
+/* Screen lines row at takes; always one without wrap. */
+int editorRowLines(int at) {
+  int cols = editorConf.screen_cols;
+  if (!editorConf.wrap || at >= editorConf.num_rows ||
+      editorRowRsize(at) <= cols)
+    return 1;
+  editorRowCache *cache = editorCacheSlot(editorConf.row_cache[at]);
+  if (cache && cache->wrap && cache->wrap_cols == cols)
+    return cache->wrap_len;
+  struct editorLayout *l = editorConf.layout;
+  if (l && l->cols == cols && at < l->tree.rows)
+    return *(int *)editorSumTreeNode(&l->tree, l->tree.size + at);
+  return editorWrapBreaks(at, cols, NULL);
+}
+
+/* The screen line of row at that render column rx is on, with the column
+ * that line starts at in *start. */
+int editorWrapLine(int at, int rx, int *start) {
+  *start = 0;
+  if (!editorConf.wrap || at >= editorConf.num_rows)
+    return 0;
+  int n;
+  int *starts = editorRowWrap(at, &n);
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = hi - (hi - lo) / 2;
+    if (starts[mid] <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *start = starts[lo];
+  return lo;
+}
+
+/* Screen lines taken by rows [from, to), folds aside. Short runs are
+ * counted row by row; longer ones come from the tree. */
+int editorWrapLines(int from, int to) {
+  if (!editorConf.wrap || from >= to)
+    return to - from;
+  int past = 0;
+  if (to > editorConf.num_rows) {
+    past = to - (from > editorConf.num_rows ? from : editorConf.num_rows);
+    to = editorConf.num_rows;
+  }
+  if (to - from > ZOR_WRAP_WALK) {
+    struct editorLayout *l = editorLayoutUpdate();
+    return editorLayoutPrefix(l, to) - editorLayoutPrefix(l, from) + past;
+  }
+  int lines = past;
+  for (int at = from; at < to; at++)
+    lines += editorRowLines(at);
+  return lines;
+}
+
+/*folds*/
+
+/* Index of the first fold that ends at or after row. */
+int editorFoldSearch(int row) {
+  int lo = 0, hi = editorConf.num_folds;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (editorConf.folds[mid].end < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* The fold row is in, or -1. */
+int editorFoldAt(int row) {
+  int i = editorFoldSearch(row);
+  if (i < editorConf.num_folds && editorConf.folds[i].start <= row)
+    return i;
+  return -1;
+}
+
+/* The row shown for row: the first row of its fold, if it is in one. */
+int editorFoldStart(int row) {
+  int i = editorFoldAt(row);
+  return i == -1 ? row : editorConf.folds[i].start;
+}
+
+/* Open the folds with rows in [from, to). */
+void editorFoldDrop(int from, int to) {
+  int i = editorFoldSearch(from);
+  int j = i;
+  while (j < editorConf.num_folds && editorConf.folds[j].start < to)
+    j++;
+  memmove(&editorConf.folds[i], &editorConf.folds[j],
+          sizeof(struct editorFold) * (editorConf.num_folds - j));
+  editorConf.num_folds -= j - i;
+}
+
+/* Close rows [from, to] into one line, taking in the folds inside. */
+void editorFoldClose(int from, int to) {
+  editorFoldDrop(from, to + 1);
+  if (editorConf.num_folds == editorConf.folds_cap) {
+    editorConf.folds_cap = editorConf.folds_cap ? editorConf.folds_cap * 2 : 8;
+    editorConf.folds = realloc(editorConf.folds, sizeof(struct editorFold) *
+                                                     editorConf.folds_cap);
+    if (editorConf.folds == NULL)
+      die("realloc");
+  }
+  int i = editorFoldSearch(from);
+  memmove(&editorConf.folds[i + 1], &editorConf.folds[i],
+          sizeof(struct editorFold) * (editorConf.num_folds - i));
+  editorConf.folds[i].start = from;
+  editorConf.folds[i].end = to;
+  editorConf.num_folds++;
+}
+
+/* Move the folds along after a splice of n hunks; a fold that a hunk
+ * touches is opened. */
+void editorFoldShift(struct editorHunk *hunks, int n) {
+  int h = 0, delta = 0, kept = 0;
+  for (int i = 0; i < editorConf.num_folds; i++) {
+    struct editorFold f = editorConf.folds[i];
+    while (h < n && hunks[h].at + hunks[h].del <= f.start) {
+      delta += hunks[h].ins - hunks[h].del;
+      h++;
+    }
+    if (h < n && hunks[h].at <= f.end)
+      continue;
+    f.start += delta;
+    f.end += delta;
+    editorConf.folds[kept++] = f;
+  }
+  editorConf.num_folds = kept;
+}
+
+/* Screen lines taken by rows [from, to): a closed fold takes one. */
+int editorVisibleLines(int from, int to) {
+  int n = 0, row = from;
+  for (int i = editorFoldSearch(from);
+       i < editorConf.num_folds && editorConf.folds[i].start < to; i++) {
+    if (editorConf.folds[i].start >= row)
+      n += editorWrapLines(row, editorConf.folds[i].start) + 1;
+    row = editorConf.folds[i].end + 1;
+  }
+  if (row < to)
+    n += editorWrapLines(row, to);
+  return n;
+}
+
+/* The row count lines below (above, if negative) row on screen. Runs of
+ * rows outside folds are crossed in one step. */
+int editorVisibleRow(int row, int count) {
+  while (count > 0) {
+    int i = editorFoldSearch(row);
+    if (i == editorConf.num_folds)
+      return row + count;
+    struct editorFold *f = &editorConf.folds[i];
+    if (f->start <= row) {
+      row = f->end + 1;
+      count--;
+    } else {
+      int step = f->start - row < count ? f->start - row : count;
+      row += step;
+      count -= step;
+    }
+  }
+  while (count < 0 && row > 0) {
+    int i = editorFoldSearch(row - 1);
+    if (i < editorConf.num_folds && editorConf.folds[i].start <= row - 1) {
+      row = editorConf.folds[i].start;
+      count++;
+      continue;
+    }
+    int prev = i > 0 ? editorConf.folds[i - 1].end : -1;
+    int step = row - 1 - prev < -count ? row - 1 - prev : -count;
+    row -= step;
+    count += step;
+  }
+  return row;
+}
+
+/* Like editorVisibleRow, counting the screen lines of wrapped rows: the
+ * line count lines below (above) line *sub of row, as its row and its
+ * line in *sub. Long moves through rows outside folds use the tree. */
+int editorDisplayRow(int row, int *sub, int count) {
+  if (!editorConf.wrap) {
+    *sub = 0;
+    return editorVisibleRow(row, count);
+  }
+  while (count > 0 && row < editorConf.num_rows) {
+    int i = editorFoldSearch(row);
+    if (i < editorConf.num_folds && editorConf.folds[i].start <= row) {
+      row = editorConf.folds[i].end + 1;
+      *sub = 0;
+      count--;
+      continue;
+    }
+    int stop = i < editorConf.num_folds ? editorConf.folds[i].start
+                                        : editorConf.num_rows;
+    if (count > ZOR_WRAP_WALK && stop - row > ZOR_WRAP_WALK) {
+      struct editorLayout *l = editorLayoutUpdate();
+      int line = editorLayoutPrefix(l, row) + *sub + count;
+      int end = editorLayoutPrefix(l, stop);
+      if (line < end) {
+        *sub = line;
+        return editorLayoutFind(l, sub);
+      }
+      count = line - end;
+      row = stop;
+      *sub = 0;
+      continue;
+    }
+    int lines = editorRowLines(row);
+    if (*sub + count < lines) {
+      *sub += count;
+      return row;
+    }
+    count -= lines - *sub;
+    row++;
+    *sub = 0;
+  }
+  if (count > 0)
+    return row + count;
+  while (count < 0 && (row > 0 || *sub > 0)) {
+    if (*sub > 0) {
+      int step = *sub < -count ? *sub : -count;
+      *sub -= step;
+      count += step;
+      continue;
+    }
+    int i = editorFoldSearch(row - 1);
+    if (i < editorConf.num_folds && editorConf.folds[i].start <= row - 1) {
+      row = editorConf.folds[i].start;
+      count++;
+      continue;
+    }
+    int stop = i > 0 ? editorConf.folds[i - 1].end + 1 : 0;
+    if (row > editorConf.num_rows)
+      stop = row - 1;
+    if (-count > ZOR_WRAP_WALK && row - stop > ZOR_WRAP_WALK) {
+      struct editorLayout *l = editorLayoutUpdate();
+      int line = editorLayoutPrefix(l, row) + count;
+      int start = editorLayoutPrefix(l, stop);
+      if (line >= start) {
+        *sub = line;
+        return editorLayoutFind(l, sub);
+      }
+      count = line - start;
+      row = stop;
+      continue;
+    }
+    row--;
+    *sub = editorRowLines(row) - 1;
+    count++;
+  }
+  return row;
+}
+
+/* Indentation of row at in render columns, or -1 if it is blank. */
+int editorIndentOf(int at) {
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  int i = 0;
+  while (i < size && (chars[i] == ' ' || chars[i] == '\t'))
+    i++;
+  return i == size ? -1 : editorRowCxToRx(at, i);
+}
+
+/* The block around row at: from its opening brace to its closing one, or
+ * failing that the rows indented under the header line. Returns -1 if at
+ * is in neither. */
+int editorFoldBlock(int at, int *from, int *to) {
+  struct editorBrackets *b = editorBracketsUpdate();
+  int start = editorBracketsDepth(b, 2, at);
+  int end = editorBracketsDepth(b, 2, at + 1);
+  struct bracketSum *leaf = editorSumTreeNode(&b->tree, b->tree.size + at);
+  int low = start + leaf[2].min;
+  int target = end > low ? end - 1 : low - 1;
+  if (target >= 0) {
+    int depth = editorBracketsDepth(b, 2, at + 1);
+    int close = editorBracketsFirst(b, 1, 0, b->tree.size, at + 1, 2, target,
+                                    &depth);
+    depth = start;
+    int open = end > low ? at
+               : at > 0  ? editorBracketsLast(b, 1, 0, b->tree.size, at - 1,
+                                              2, target, &depth)
+                         : -1;
+    if (open != -1 && close != -1 && close < editorConf.num_rows) {
+      *from = open;
+      *to = close;
+      return 0;
+    }
+  }
+
+  int indent = editorIndentOf(at);
+  int next = at + 1;
+  while (next < editorConf.num_rows && editorIndentOf(next) == -1)
+    next++;
+  int head = at;
+  if (indent == -1 || next == editorConf.num_rows ||
+      editorIndentOf(next) <= indent) {
+    if (indent == -1)
+      indent = next < editorConf.num_rows ? editorIndentOf(next) : 0;
+    head = at - 1;
+    while (head >= 0) {
+      int i = editorIndentOf(head);
+      if (i != -1 && i < indent)
+        break;
+      head--;
+    }
+    if (head < 0)
+      return -1;
+  }
+  indent = editorIndentOf(head);
+  int last = head;
+  for (int r = head + 1; r < editorConf.num_rows; r++) {
+    int i = editorIndentOf(r);
+    if (i == -1)
+      continue;
+    if (i <= indent)
+      break;
+    last = r;
+  }
+  if (last == head)
+    return -1;
+  *from = head;
+  *to = last;
+  return 0;
+}
+
+/* zc, zo, za and zR. */
+void editorFoldKey(int c) {
+  int cy = editorConf.cy;
+  if (c == 'R') {
+    editorConf.num_folds = 0;
+    return;
+  }
+  if (cy >= editorConf.num_rows)
+    return;
+  int i = editorFoldAt(cy);
+  if (c == 'o' || (c == 'a' && i != -1)) {
+    if (i != -1)
+      editorFoldDrop(cy, cy + 1);
+    return;
+  }
+  if (c != 'c' && c != 'a')
+    return;
+  int from, to;
+  int found = editorFoldBlock(cy, &from, &to) == 0;
+  if (!found && editorConf.loader) {
+    editorWaitRows(INT_MAX);
+    found = editorFoldBlock(cy, &from, &to) == 0;
+  }
+  if (!found) {
+    editorSetStatusMessage("No fold found");
+    return;
+  }
+  editorFoldClose(from, to);
+  editorConf.cy = from;
+}
+
+/* Keep the index, the bracket and line trees, the folds and the extra
+ * cursors in step with a splice of n hunks, given in the row numbers from
+ * before it. */
+void editorRowsShifted(struct editorHunk *hunks, int n) {
+  editorIndexShift(hunks, n);
+  editorBracketsShift(hunks, n);
+  editorLayoutShift(hunks, n);
+  editorFoldShift(hunks, n);
+  editorCursorsShift(hunks, n);
+}
+
+/*row handler*/
+
+int editorRowCxToRx(int at, int cx) {
+  if (!(editorConf.row_flags[at] & ROW_HAS_TABS))
+    return cx;
+  char *chars = editorConf.row[at].chars;
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++) {
+    if (chars[j] == '\t')
+      rx += (ZOR_TAB_STOP - 1) - (rx % ZOR_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+/* Render width of the row. Only rows with tabs pay for a walk over their
+ * chars, which keeps a width out of every row. */
+int editorRowRsize(int at) {
+  return editorRowCxToRx(at, editorConf.row_size[at]);
+}
+
+int editorRowRxToCx(int at, int rx) {
+  int size = editorConf.row_size[at];
+  if (!(editorConf.row_flags[at] & ROW_HAS_TABS))
+    return rx < size ? rx : size;
+  char *chars = editorConf.row[at].chars;
+  int curr_rx = 0;
+  int cx;
+  for (cx = 0; cx < size; cx++) {
+    if (chars[cx] == '\t')
+      curr_rx += (ZOR_TAB_STOP - 1) - (curr_rx % ZOR_TAB_STOP);
+    curr_rx++;
+    if (curr_rx > rx)
+      return cx;
+  }
+  return cx;
+}
+
+char *editorRowRender(int at) {
+  if (!(editorConf.row_flags[at] & ROW_HAS_TABS))
+    return editorConf.row[at].chars;
+
+  editorRowCache *cache = editorRowCacheOf(at);
+  if (cache->render == NULL) {
+    char *chars = editorConf.row[at].chars;
+    int size = editorConf.row_size[at];
+    cache->render =
+        arenaAlloc(editorConf.arena, editorRowRsize(at) + 1, MEM_RENDER);
+
+    int idx = 0;
+    for (int j = 0; j < size; j++) {
+      if (chars[j] == '\t') {
+        cache->render[idx++] = ' ';
+        while (idx % ZOR_TAB_STOP != 0)
+          cache->render[idx++] = ' ';
+      } else {
+        cache->render[idx++] = chars[j];
+      }
+    }
+    cache->render[idx] = '\0';
+  }
+  return cache->render;
+}
+
+void editorUpdateRow(int at) {
+  editorBracketsRowChanged(at);
+  int size = editorConf.row_size[at];
+  char *tab = memchr(editorConf.row[at].chars, '\t', size);
+
+  editorRowDropCache(at);
+  if (at < editorConf.hl_state_rows)
+    editorConf.hl_state_rows = at;
+  if (tab == NULL)
+    editorConf.row_flags[at] &= ~ROW_HAS_TABS;
+  else
+    editorConf.row_flags[at] |= ROW_HAS_TABS;
+  editorLayoutRowChanged(at);
+}
+
+/* Bytes taken by the row arrays for cap rows. */
+size_t editorRowsBytes(int cap) {
+  return (size_t)cap * (2 * sizeof(int) + 1 + sizeof(editorRow));
+}
+
+void editorRowsResize(int cap) {
+  editorConf.mem[MEM_ROWS] += editorRowsBytes(cap);
+  editorConf.mem[MEM_ROWS] -= editorRowsBytes(editorConf.row_cap);
+  editorConf.row_size = realloc(editorConf.row_size, sizeof(int) * cap);
+  editorConf.row_cache = realloc(editorConf.row_cache, sizeof(int) * cap);
+  editorConf.row_flags = realloc(editorConf.row_flags, cap);
+  editorConf.row = realloc(editorConf.row, sizeof(editorRow) * cap);
+  if (cap && (editorConf.row_size == NULL || editorConf.row_cache == NULL ||
+              editorConf.row_flags == NULL || editorConf.row == NULL))
+    die("realloc");
+  editorConf.row_cap = cap;
+}
+
+void editorRowsReserve(int n) {
+  if (n <= editorConf.row_cap)
+    return;
+  int cap = editorConf.row_cap ? editorConf.row_cap : 64;
+  while (cap < n)
+    cap *= 2;
+  editorRowsResize(cap);
+}
+
+void editorRowsMove(int dst, int src, int n) {
+  memmove(&editorConf.row_size[dst], &editorConf.row_size[src],
+          sizeof(int) * n);
+  memmove(&editorConf.row_cache[dst], &editorConf.row_cache[src],
+          sizeof(int) * n);
+  memmove(&editorConf.row_flags[dst], &editorConf.row_flags[src], n);
+  memmove(&editorConf.row[dst], &editorConf.row[src], sizeof(editorRow) * n);
+}
+
+/* Insert a row whose chars already live in the arena; flags says whether
+ * they are packed load data or a pool chunk owned by the row. */
+void editorAttachRow(int pos, char *chars, size_t len, int flags) {
+  struct editorHunk h = {.at = pos, .del = 0, .ins = 1};
+  editorRowsShifted(&h, 1);
+  editorRowsReserve(editorConf.num_rows + 1);
+  editorRowsMove(pos + 1, pos, editorConf.num_rows - pos);
+
+  editorConf.row_size[pos] = len;
+  editorConf.row_flags[pos] = flags;
+  editorConf.row[pos].chars = chars;
+  editorConf.row_cache[pos] = 0;
+  editorUpdateRow(pos);
+
+  editorConf.num_rows++;
+}
+
+void editorInsertRow(int pos, char *s, size_t len) {
+  if (pos < 0 || pos > editorConf.num_rows)
+    return;
+  char *chars = arenaAlloc(editorConf.arena, len + 1, MEM_TEXT);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  editorAttachRow(pos, chars, len, 0);
+  editorConf.dirty++;
+}
+
+void editorFreeRow(int at) {
+  editorIndexDropRow(at);
+  editorRowDropCache(at);
+  if (!(editorConf.row_flags[at] & ROW_PACKED))
+    arenaFree(editorConf.arena, editorConf.row[at].chars);
+}
+
+void editorDeleteRow(int pos) {
+  if (pos < 0 || pos >= editorConf.num_rows)
+    return;
+  editorFreeRow(pos);
+  if (pos < editorConf.hl_state_rows)
+    editorConf.hl_state_rows = pos;
+  struct editorHunk h = {.at = pos, .del = 1, .ins = 0};
+  editorRowsShifted(&h, 1);
+  editorRowsMove(pos, pos + 1, editorConf.num_rows - pos - 1);
+  editorConf.num_rows--;
+  editorConf.dirty++;
+}
+
+/* Empty the buffer. Its text and caches all live in its arena, which is
+ * released a block at a time without looking at the rows. */
+void editorFreeRows() {
+  editorUndoClear();
+  editorIndexFree(editorConf.index);
+  editorConf.index = NULL;
+  editorBracketsFree(editorConf.brackets);
+  editorConf.brackets = NULL;
+  editorLayoutFree(editorConf.layout);
+  editorConf.layout = NULL;
+  editorConf.num_folds = 0;
+  editorConf.num_cursors = 0;
+  editorDiskReset();
+  arenaRelease(editorConf.arena);
+  editorRowsResize(0);
+  editorConf.num_rows = 0;
+  editorConf.cached_rows = 0;
+  editorConf.hl_state_rows = 0;
+}
+
+/* Make the row's chars writable with room for n bytes, moving packed load
+ * data, or text a register shares, into a chunk of its own the first time
+ * the row is edited. */
+char *editorRowReserve(int at, size_t n) {
+  editorIndexDropRow(at);
+  editorFoldDrop(at, at + 1);
+  char *chars = editorConf.row[at].chars;
+  int packed = editorConf.row_flags[at] & ROW_PACKED;
+  if (packed || arenaShared(chars)) {
+    char *copy = arenaAlloc(editorConf.arena, n, MEM_TEXT);
+    memcpy(copy, chars, editorConf.row_size[at] + 1);
+    if (!packed)
+      arenaFree(editorConf.arena, chars);
+    editorConf.row_flags[at] &= ~ROW_PACKED;
+    chars = copy;
+  } else {
+    chars = arenaRealloc(editorConf.arena, chars, n, MEM_TEXT);
+  }
+  editorConf.row[at].chars = chars;
+  return chars;
+}
+
+void editorRowInsertChar(int at, int pos, int c) {
+  int size = editorConf.row_size[at];
+  if (pos < 0 || pos > size)
+    pos = size;
+  char *chars = editorRowReserve(at, size + 2);
+  memmove(&chars[pos + 1], &chars[pos], size - pos + 1);
+  chars[pos] = c;
+  editorConf.row_size[at]++;
+  editorUpdateRow(at);
+  editorConf.dirty++;
+}
+
+void editorRowAppendString(int at, char *s, size_t len) {
+  int size = editorConf.row_size[at];
+  char *chars = editorRowReserve(at, size + len + 1);
+  memcpy(&chars[size], s, len);
+  chars[size + len] = '\0';
+  editorConf.row_size[at] += len;
+  editorUpdateRow(at);
+  editorConf.dirty++;
+}
+
+void editorRowDeleteChar(int at, int pos) {
+  int size = editorConf.row_size[at];
+  if (pos < 0 || pos >= size)
+    return;
+  char *chars = editorRowReserve(at, size + 1);
+  memmove(&chars[pos], &chars[pos + 1], size - pos);
+  editorConf.row_size[at]--;
+  editorUpdateRow(at);
+  editorConf.dirty++;
+}
+
+/*undo*/
+
+void editorFreeLines(struct editorLine *lines, int n) {
+  for (int i = 0; i < n; i++) {
+    if (!(lines[i].flags & ROW_PACKED))
+      arenaFree(editorConf.arena, lines[i].chars);
+  }
+  free(lines);
+}
+
+/* Bytes a step holds besides its text. */
+size_t editorStepBytes(struct editorStep *step) {
+  size_t n = sizeof(struct editorHunk) * step->num_hunks;
+  for (int i = 0; i < step->num_hunks; i++)
+    n += sizeof(struct editorLine) * (step->hunks[i].ins + 1);
+  return n + sizeof(int) * step->perm_len;
+}
+
+/* Free a step, and its text too unless the whole arena is going. */
+void editorFreeStep(struct editorStep *step, int text) {
+  editorConf.mem[MEM_UNDO] -= editorStepBytes(step);
+  for (int i = 0; i < step->num_hunks; i++) {
+    if (text)
+      editorFreeLines(step->hunks[i].lines, step->hunks[i].ins);
+    else
+      free(step->hunks[i].lines);
+  }
+  free(step->hunks);
+  free(step->perm);
+}
+
+void editorFreeUndo(struct editorUndo *u, int text) {
+  while (u) {
+    struct editorUndo *next = u->next;
+    for (int i = 0; i < u->num_steps; i++)
+      editorFreeStep(&u->steps[i], text);
+    free(u->steps);
+    free(u);
+    u = next;
+  }
+}
+
+/* Drop the history of a buffer whose arena is released with it. */
+void editorUndoClear() {
+  editorFreeUndo(editorConf.undo, 0);
+  editorFreeUndo(editorConf.redo, 0);
+  editorConf.undo = NULL;
+  editorConf.redo = NULL;
+  editorConf.undo_open = 0;
+}
+
+/* Apply a step to the rows and return the step that reverts it. The
+ * step's lines become rows and the rows it replaces become the lines of
+ * the result, so nothing is copied. A step that changes the row count at
+ * several places is applied in one pass over the row arrays. */
+struct editorStep editorSpliceRows(struct editorStep step) {
+  struct editorStep inv = {0};
+  inv.num_hunks = step.num_hunks;
+  inv.hunks = malloc(sizeof(struct editorHunk) * step.num_hunks);
+  if (inv.hunks == NULL)
+    die("malloc");
+
+  int delta = 0;
+  int resized = 0;
+  for (int i = 0; i < step.num_hunks; i++) {
+    struct editorHunk *h = &step.hunks[i];
+    struct editorHunk *r = &inv.hunks[i];
+    r->at = h->at + delta;
+    r->del = h->ins;
+    r->ins = h->del;
+    r->lines = malloc(sizeof(struct editorLine) * (h->del ? h->del : 1));
+    if (r->lines == NULL)
+      die("malloc");
+    for (int j = 0; j < h->del; j++) {
+      int at = h->at + j;
+      editorIndexDropRow(at);
+      editorRowDropCache(at);
+      r->lines[j].chars = editorConf.row[at].chars;
+      r->lines[j].size = editorConf.row_size[at];
+      r->lines[j].flags = editorConf.row_flags[at] & ROW_LINE_FLAGS;
+      if (!(r->lines[j].flags & ROW_PACKED))
+        arenaRetag(editorConf.arena, r->lines[j].chars, MEM_UNDO);
+    }
+    delta += h->ins - h->del;
+    if (h->ins != h->del)
+      resized = 1;
+  }
+  if (step.num_hunks && step.hunks[0].at < editorConf.hl_state_rows)
+    editorConf.hl_state_rows = step.hunks[0].at;
+  editorRowsShifted(step.hunks, step.num_hunks);
+
+  int num_rows = editorConf.num_rows + delta;
+  if (resized && step.num_hunks == 1) {
+    struct editorHunk *h = &step.hunks[0];
+    editorRowsReserve(num_rows);
+    editorRowsMove(h->at + h->ins, h->at + h->del,
+                   editorConf.num_rows - h->at - h->del);
+  } else if (resized) {
+    /* build fresh arrays so each untouched row moves exactly once */
+    int cap = num_rows > 64 ? num_rows : 64;
+    int *row_size = malloc(sizeof(int) * cap);
+    int *row_cache = malloc(sizeof(int) * cap);
+    unsigned char *row_flags = malloc(cap);
+    editorRow *row = malloc(sizeof(editorRow) * cap);
+    if (row_size == NULL || row_cache == NULL || row_flags == NULL ||
+        row == NULL)
+      die("malloc");
+    int src = 0;
+    for (int i = 0; i <= step.num_hunks; i++) {
+      int end = i < step.num_hunks ? step.hunks[i].at : editorConf.num_rows;
+      int dst = i < step.num_hunks ? inv.hunks[i].at : num_rows;
+      int n = end - src;
+      dst -= n;
+      memcpy(&row_size[dst], &editorConf.row_size[src], sizeof(int) * n);
+      memcpy(&row_cache[dst], &editorConf.row_cache[src], sizeof(int) * n);
+      memcpy(&row_flags[dst], &editorConf.row_flags[src], n);
+      memcpy(&row[dst], &editorConf.row[src], sizeof(editorRow) * n);
+      if (i < step.num_hunks)
+        src = end + step.hunks[i].del;
+    }
+    free(editorConf.row_size);
+    free(editorConf.row_cache);
+    free(editorConf.row_flags);
+    free(editorConf.row);
+    editorConf.row_size = row_size;
+    editorConf.row_cache = row_cache;
+    editorConf.row_flags = row_flags;
+    editorConf.row = row;
+    editorConf.mem[MEM_ROWS] += editorRowsBytes(cap);
+    editorConf.mem[MEM_ROWS] -= editorRowsBytes(editorConf.row_cap);
+    editorConf.row_cap = cap;
+  }
+  editorConf.num_rows = num_rows;
+
+  for (int i = 0; i < step.num_hunks; i++) {
+    struct editorHunk *h = &step.hunks[i];
+    for (int j = 0; j < h->ins; j++) {
+      int at = inv.hunks[i].at + j;
+      editorConf.row[at].chars = h->lines[j].chars;
+      editorConf.row_cache[at] = 0;
+      editorConf.row_size[at] = h->lines[j].size;
+      editorConf.row_flags[at] = h->lines[j].flags & ROW_LINE_FLAGS;
+      if (!(editorConf.row_flags[at] & ROW_PACKED))
+        arenaRetag(editorConf.arena, h->lines[j].chars, MEM_TEXT);
+      editorUpdateRow(at);
+    }
+    free(h->lines);
+  }
+  free(step.hunks);
+  editorConf.dirty++;
+  return inv;
+}
+
+/* Reorder rows as the step's perm says and return the reverse order. Rows
+ * keep their text and caches; only the block comment state is redone. */
+struct editorStep editorPermuteRows(struct editorStep step) {
+  int at = step.perm_at;
+  int n = step.perm_len;
+  struct editorStep inv = {0};
+  inv.perm_at = at;
+  inv.perm_len = n;
+  inv.perm = malloc(sizeof(int) * (n ? n : 1));
+  int *row_size = malloc(sizeof(int) * (n ? n : 1));
+  int *row_cache = malloc(sizeof(int) * (n ? n : 1));
+  unsigned char *row_flags = malloc(n ? n : 1);
+  editorRow *row = malloc(sizeof(editorRow) * (n ? n : 1));
+  if (inv.perm == NULL || row_size == NULL || row_cache == NULL ||
+      row_flags == NULL || row == NULL)
+    die("malloc");
+
+  for (int i = 0; i < n; i++) {
+    int src = at + step.perm[i];
+    inv.perm[step.perm[i]] = i;
+    row_size[i] = editorConf.row_size[src];
+    row_cache[i] = editorConf.row_cache[src];
+    row_flags[i] = editorConf.row_flags[src];
+    row[i] = editorConf.row[src];
+  }
+  memcpy(&editorConf.row_size[at], row_size, sizeof(int) * n);
+  memcpy(&editorConf.row_cache[at], row_cache, sizeof(int) * n);
+  memcpy(&editorConf.row_flags[at], row_flags, n);
+  memcpy(&editorConf.row[at], row, sizeof(editorRow) * n);
+  free(row_size);
+  free(row_cache);
+  free(row_flags);
+  free(row);
+
+  if (at < editorConf.hl_state_rows)
+    editorConf.hl_state_rows = at;
+  editorIndexPermute(at, n, inv.perm);
+  editorBracketsInvalidate(at);
+  editorLayoutInvalidate(at);
+  editorFoldDrop(at, at + n);
+  free(step.perm);
+  editorConf.dirty++;
+  return inv;
+}
+
+struct editorStep editorApplyStep(struct editorStep step) {
+  if (step.perm)
+    return editorPermuteRows(step);
+  return editorSpliceRows(step);
+}
+
+/* End the current undo entry; the next change starts a new one. */
+void editorUndoBreak() { editorConf.undo_open = 0; }
+
+struct editorUndo *editorUndoOpen() {
+  if (editorConf.undo_open)
+    return editorConf.undo;
+
+  editorFreeUndo(editorConf.redo, 1);
+  editorConf.redo = NULL;
+  struct editorUndo *u = calloc(1, sizeof(struct editorUndo));
+  if (u == NULL)
+    die("calloc");
+  u->cx = editorConf.cx;
+  u->cy = editorConf.cy;
+  u->next = editorConf.undo;
+  editorConf.undo = u;
+  editorConf.undo_open = 1;
+  return u;
+}
+
+void editorUndoPush(struct editorUndo *u, struct editorStep step) {
+  if (u->num_steps == u->steps_cap) {
+    u->steps_cap = u->steps_cap ? u->steps_cap * 2 : 4;
+    u->steps = realloc(u->steps, sizeof(struct editorStep) * u->steps_cap);
+    if (u->steps == NULL)
+      die("realloc");
+  }
+  u->steps[u->num_steps++] = step;
+  editorConf.mem[MEM_UNDO] += editorStepBytes(&step);
+}
+
+/* Record that rows [at, at + del) are about to be replaced by ins rows.
+ * Edits that stay inside the rows the open entry already covers only
+ * widen it, so typing a paragraph keeps a single saved copy. */
+void editorUndoRows(int at, int del, int ins) {
+  struct editorUndo *u = editorUndoOpen();
+  if (u->num_steps) {
+    struct editorStep *last = &u->steps[u->num_steps - 1];
+    struct editorHunk *h = &last->hunks[0];
+    if (last->num_hunks == 1 && at >= h->at && at + del <= h->at + h->del) {
+      h->del += ins - del;
+      return;
+    }
+  }
+
+  struct editorStep step = {0};
+  step.num_hunks = 1;
+  step.hunks = malloc(sizeof(struct editorHunk));
+  struct editorLine *lines = malloc(sizeof(struct editorLine) * (del + 1));
+  if (step.hunks == NULL || lines == NULL)
+    die("malloc");
+  for (int i = 0; i < del; i++) {
+    int row = at + i;
+    int size = editorConf.row_size[row];
+    lines[i].size = size;
+    lines[i].flags = editorConf.row_flags[row] & ROW_LINE_FLAGS;
+    if (lines[i].flags & ROW_PACKED) {
+      /* packed text is copied on write, so the row's bytes stay put */
+      lines[i].chars = editorConf.row[row].chars;
+    } else {
+      lines[i].chars = arenaAlloc(editorConf.arena, size + 1, MEM_UNDO);
+      memcpy(lines[i].chars, editorConf.row[row].chars, size + 1);
+    }
+  }
+  step.hunks[0].at = at;
+  step.hunks[0].del = ins;
+  step.hunks[0].ins = del;
+  step.hunks[0].lines = lines;
+  editorUndoPush(u, step);
+}
+
+/* Pop an entry off from, apply it and push its reverse onto to. */
+int editorUndoApply(struct editorUndo **from, struct editorUndo **to) {
+  struct editorUndo *u = *from;
+  if (u == NULL)
+    return -1;
+  *from = u->next;
+  editorConf.undo_open = 0;
+
+  struct editorUndo *r = calloc(1, sizeof(struct editorUndo));
+  if (r == NULL)
+    die("calloc");
+  r->cx = editorConf.cx;
+  r->cy = editorConf.cy;
+  for (int i = u->num_steps - 1; i >= 0; i--) {
+    editorConf.mem[MEM_UNDO] -= editorStepBytes(&u->steps[i]);
+    editorUndoPush(r, editorApplyStep(u->steps[i]));
+  }
+  r->next = *to;
+  *to = r;
+
+  editorConf.cy = u->cy < editorConf.num_rows ? u->cy : editorConf.num_rows;
+  editorConf.cx = u->cx;
+  if (editorConf.cy == editorConf.num_rows)
+    editorConf.cx = 0;
+  else if (editorConf.cx > editorConf.row_size[editorConf.cy])
+    editorConf.cx = editorConf.row_size[editorConf.cy];
+  free(u->steps);
+  free(u);
+  return 0;
+}
+
+void editorUndo() {
+  if (editorUndoApply(&editorConf.undo, &editorConf.redo) == -1)
+    editorSetStatusMessage("Already at oldest change");
+}
+
+void editorRedo() {
+  if (editorUndoApply(&editorConf.redo, &editorConf.undo) == -1)
+    editorSetStatusMessage("Already at newest change");
+}
+
+/*editor operations*/
+
+void editorInsertChar(int c) {
+  if (editorConf.num_cursors) {
+    editorCursorsEdit(c);
+    return;
+  }
+  if (editorConf.cy == editorConf.num_rows) {
+    /* a new last line has to come after everything still loading */
+    editorWaitRows(INT_MAX);
+    editorUndoRows(editorConf.num_rows, 0, 1);
+    editorInsertRow(editorConf.num_rows, "", 0);
+  }
+  editorUndoRows(editorConf.cy, 1, 1);
+  editorRowInsertChar(editorConf.cy, editorConf.cx, c);
+  editorConf.cx++;
+}
+
+void editorInsertNewline() {
+  if (editorConf.num_cursors) {
+    editorCursorsEdit('\r');
+    return;
+  }
+  if (editorConf.cy == editorConf.num_rows)
+    editorWaitRows(INT_MAX);
+  if (editorConf.cx == 0) {
+    editorUndoRows(editorConf.cy, 0, 1);
+    editorInsertRow(editorConf.cy, "", 0);
+  } else {
+    editorUndoRows(editorConf.cy, 1, 2);
+    editorInsertRow(editorConf.cy + 1,
+                    &editorConf.row[editorConf.cy].chars[editorConf.cx],
+                    editorConf.row_size[editorConf.cy] - editorConf.cx);
+    char *chars = editorRowReserve(editorConf.cy, editorConf.cx + 1);
+    editorConf.row_size[editorConf.cy] = editorConf.cx;
+    chars[editorConf.cx] = '\0';
+    editorUpdateRow(editorConf.cy);
+  }
+  editorConf.cy++;
+  editorConf.cx = 0;
+}
+
+void editorDeleteChar() {
+  if (editorConf.num_cursors) {
+    editorCursorsEdit(BACKSPACE);
+    return;
+  }
+  if (editorConf.cy == editorConf.num_rows)
+    return;
+  if (editorConf.cx == 0 && editorConf.cy == 0)
+    return;
+  if (editorConf.cx > 0) {
+    editorUndoRows(editorConf.cy, 1, 1);
+    editorRowDeleteChar(editorConf.cy, editorConf.cx - 1);
+    editorConf.cx--;
+  } else {
+    editorUndoRows(editorConf.cy - 1, 2, 1);
+    editorConf.cx = editorConf.row_size[editorConf.cy - 1];
+    editorRowAppendString(editorConf.cy - 1,
+                          editorConf.row[editorConf.cy].chars,
+                          editorConf.row_size[editorConf.cy]);
+    editorDeleteRow(editorConf.cy);
+    editorConf.cy--;
+  }
+}
+
+/* Ctrl-N and Ctrl-P in insert mode: replace the word before the cursor
+ * with the next or previous indexed word it starts, in byte order. Past
+ * either end the typed word comes back. */
+void editorComplete(int dir) {
+  int cy = editorConf.cy;
+  if (cy >= editorConf.num_rows)
+    return;
+  char *word = editorConf.complete_word;
+  int shown = strlen(word);
+  int x = editorConf.complete_x;
+  char *chars = editorConf.row[cy].chars;
+  if (editorConf.complete_y != cy || editorConf.cx != x + shown ||
+      memcmp(chars + x, word, shown) != 0) {
+    x = editorConf.cx;
+    while (x > 0 && (editorCharClass[(unsigned char)chars[x - 1]] & CC_WORD))
+      x--;
+    shown = editorConf.cx - x;
+    if (shown == 0 || shown > ZOR_WORD_MAX) {
+      editorSetStatusMessage("No word to complete");
+      return;
+    }
+    memcpy(word, chars + x, shown);
+    word[shown] = '\0';
+    editorConf.complete_y = cy;
+    editorConf.complete_x = x;
+    editorConf.complete_plen = shown;
+  }
+
+  struct editorIndex *ix = editorIndexUpdate();
+  int plen = editorConf.complete_plen;
+  int node = editorIndexFind(ix, word, plen);
+  int total = node == -1 ? 0
+                         : ix->nodes[node].words - (ix->nodes[node].count > 0);
+  if (total == 0) {
+    editorSetStatusMessage("No match for %.*s", plen, word);
+    return;
+  }
+  char next[ZOR_WORD_MAX + 1];
+  memcpy(next, word, shown);
+  int len;
+  if (shown == plen && dir < 0)
+    len = editorIndexLast(ix, node, next, plen);
+  else
+    len = editorIndexNext(ix, next, shown, plen, dir);
+  if (len < plen)
+    len = plen;
+  next[len] = '\0';
+
+  editorUndoRows(cy, 1, 1);
+  int size = editorConf.row_size[cy];
+  chars = editorRowReserve(cy, size - shown + len + 1);
+  memmove(chars + x + len, chars + x + shown, size - x - shown);
+  memcpy(chars + x, next, len);
+  editorConf.row_size[cy] = size - shown + len;
+  chars[editorConf.row_size[cy]] = '\0';
+  editorUpdateRow(cy);
+  editorConf.dirty++;
+  memcpy(word, next, len + 1);
+  editorConf.cx = x + len;
+  if (len == plen)
+    editorSetStatusMessage("Back at original");
+  else
+    editorSetStatusMessage("Match %d of %d",
+                           editorIndexRank(ix, word, len, plen), total);
+}
+
+/* :sym name moves to the next row that defines name, wrapping around;
+ * with no name it looks up the word under the cursor. */
+void editorSymCommand(char *name) {
+  char buf[ZOR_WORD_MAX + 1];
+  int cy = editorConf.cy;
+  if (*name == '\0' && cy < editorConf.num_rows) {
+    char *chars = editorConf.row[cy].chars;
+    int from = editorConf.cx, to = editorConf.cx;
+    while (from > 0 &&
+           (editorCharClass[(unsigned char)chars[from - 1]] & CC_WORD))
+      from--;
+    while (to < editorConf.row_size[cy] &&
+           (editorCharClass[(unsigned char)chars[to]] & CC_WORD))
+      to++;
+    if (to - from <= ZOR_WORD_MAX) {
+      memcpy(buf, chars + from, to - from);
+      buf[to - from] = '\0';
+      name = buf;
+    }
+  }
+  int len = strlen(name);
+  if (len == 0) {
+    editorSetStatusMessage("No symbol name");
+    return;
+  }
+
+  struct editorIndex *ix = editorIndexUpdate();
+  int node = len <= ZOR_WORD_MAX ? editorIndexFind(ix, name, len) : -1;
+  int n = 0, first = -1, pick = -1, rank = 0;
+  for (int i = 0; node != -1 && i < ix->num_defs; i++) {
+    if (ix->defs[i].node != node)
+      continue;
+    n++;
+    if (first == -1)
+      first = i;
+    if (pick == -1 && ix->defs[i].row > cy) {
+      pick = i;
+      rank = n;
+    }
+  }
+  if (n == 0) {
+    editorSetStatusMessage("No definition of %s", name);
+    return;
+  }
+  if (pick == -1) {
+    pick = first;
+    rank = 1;
+  }
+
+  int at = ix->defs[pick].row;
+  char *chars = editorConf.row[at].chars;
+  int size = editorConf.row_size[at];
+  editorGotoLine(at);
+  for (int i = 0; i + len <= size; i++) {
+    if (memcmp(chars + i, name, len) == 0 &&
+        (i == 0 || !(editorCharClass[(unsigned char)chars[i - 1]] & CC_WORD)) &&
+        (i + len == size ||
+         !(editorCharClass[(unsigned char)chars[i + len]] & CC_WORD)) &&
+        editorIndexIsDef(at, i, len)) {
+      editorConf.cx = i;
+      break;
+    }
+  }
+  editorSetStatusMessage("%s: definition %d of %d", name, rank, n);
+}
+
+/*registers*/
+
+/* Register slot for a register name: 0 is the unnamed one, then a-z. */
+int editorRegisterIndex(int c) {
+  if (c == '"')
+    return 0;
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 1;
+  return -1;
+}
+
+/* Bytes a register text holds of its own. */
+size_t editorTextBytes(struct editorText *t) {
+  size_t n = (sizeof(struct editorLine) + sizeof(struct arenaBlock *)) *
+             t->num_lines;
+  for (int i = 0; i < t->num_lines; i++) {
+    if (t->blocks[i] == NULL)
+      n += t->lines[i].size;
+  }
+  return n;
+}
+
+void editorTextRelease(struct editorText *t) {
+  if (t == NULL || --t->refs > 0)
+    return;
+  editorConf.mem[MEM_TEXT] -= editorTextBytes(t);
+  for (int i = 0; i < t->num_lines; i++) {
+    struct arenaBlock *b = t->blocks[i];
+    if (b == NULL)
+      continue;
+    if (b->arena == NULL) {
+      arenaUnpin(b);
+      continue;
+    }
+    /* the chunk may be the block's only content, so unpin first */
+    arenaUnpin(b);
+    if (!(t->lines[i].flags & ROW_PACKED))
+      arenaFree(b->arena, t->lines[i].chars);
+  }
+  free(t->lines);
+  free(t->blocks);
+  free(t->own);
+  free(t);
+}
+
+void editorStoreRegister(int slot, struct editorText *t) {
+  t->refs++;
+  editorTextRelease(editorConf.registers[slot]);
+  editorConf.registers[slot] = t;
+}
+
+struct editorRegion editorVisualRegion() {
+  struct editorRegion r;
+  int last = editorConf.num_rows - 1;
+  int ay = editorConf.vy < last ? editorConf.vy : last;
+  int ax = editorConf.vx < editorConf.row_size[ay] ? editorConf.vx
+                                                   : editorConf.row_size[ay];
+  int by = editorConf.cy < last ? editorConf.cy : last;
+  int bx = editorConf.cx < editorConf.row_size[by] ? editorConf.cx
+                                                   : editorConf.row_size[by];
+  r.kind = editorConf.visual;
+  if (r.kind == CTRL_KEY('v')) {
+    int ra = editorRowCxToRx(ay, ax);
+    int rb = editorRowCxToRx(by, bx);
+    r.y1 = ay < by ? ay : by;
+    r.y2 = ay < by ? by : ay;
+    r.x1 = ra < rb ? ra : rb;
+    r.x2 = (ra < rb ? rb : ra) + 1;
+    return r;
+  }
+  if (by < ay || (by == ay && bx < ax)) {
+    int y = ay, x = ax;
+    ay = by;
+    ax = bx;
+    by = y;
+    bx = x;
+  }
+  /* the character under the end is included; past the end of a row that
+   * is the line break */
+  if (++bx > editorConf.row_size[by]) {
+    if (by < last) {
+      by++;
+      bx = 0;
+    } else {
+      bx = editorConf.row_size[by];
+    }
+  }
+  r.y1 = ay;
+  r.x1 = ax;
+  r.y2 = by;
+  r.x2 = bx;
+  return r;
+}
+
+/* The chars [*from, *to) of row at that lie inside the region. */
+void editorRegionSlice(struct editorRegion *r, int at, int *from, int *to) {
+  int size = editorConf.row_size[at];
+  *from = 0;
+  *to = size;
+  if (r->kind == 'v') {
+    if (at == r->y1)
+      *from = r->x1;
+    if (at == r->y2)
+      *to = r->x2;
+  } else if (r->kind == CTRL_KEY('v')) {
+    *from = editorRowRxToCx(at, r->x1);
+    *to = editorRowRxToCx(at, r->x2 - 1);
+    if (*to < size)
+      (*to)++;
+  }
+}
+
+/* Take the region's text: whole rows are shared with the buffer, which
+ * leaves its blocks pinned and a chunk with one more holder, and parts of
+ * rows are copied. */
+struct editorText *editorYankRegion(struct editorRegion *r) {
+  int n = r->y2 - r->y1 + 1;
+  struct editorText *t = calloc(1, sizeof(struct editorText));
+  if (t == NULL)
+    die("calloc");
+  t->lines = malloc(sizeof(struct editorLine) * n);
+  t->blocks = malloc(sizeof(struct arenaBlock *) * n);
+  if (t->lines == NULL || t->blocks == NULL)
+    die("malloc");
+  t->kind = r->kind;
+  t->num_lines = n;
+
+  size_t own = 0;
+  for (int i = 0; i < n; i++) {
+    int at = r->y1 + i, from, to;
+    editorRegionSlice(r, at, &from, &to);
+    t->blocks[i] = NULL;
+    if (from == 0 && to == editorConf.row_size[at])
+      t->blocks[i] = arenaPin(editorConf.arena, editorConf.row[at].chars);
+    if (t->blocks[i] == NULL)
+      own += to - from;
+  }
+  t->own = malloc(own ? own : 1);
+  if (t->own == NULL)
+    die("malloc");
+  own = 0;
+  for (int i = 0; i < n; i++) {
+    int at = r->y1 + i, from, to;
+    char *chars = editorConf.row[at].chars;
+    editorRegionSlice(r, at, &from, &to);
+    t->lines[i].size = to - from;
+    if (t->blocks[i]) {
+      t->lines[i].chars = chars;
+      t->lines[i].flags = editorConf.row_flags[at] & ROW_PACKED;
+      if (!t->lines[i].flags)
+        arenaShare(chars);
+    } else {
+      t->lines[i].chars = t->own + own;
+      t->lines[i].flags = 0;
+      memcpy(t->own + own, chars + from, to - from);
+      own += to - from;
+    }
+  }
+  editorConf.mem[MEM_TEXT] += editorTextBytes(t);
+  return t;
+}
+
+/* A new line of size bytes for the caller to fill in. */
+struct editorLine editorNewLine(int size) {
+  struct editorLine l;
+  l.chars = arenaAlloc(editorConf.arena, size + 1, MEM_TEXT);
+  l.chars[size] = '\0';
+  l.size = size;
+  l.flags = 0;
+  return l;
+}
+
+/* Line i of t to become a row: shared when it is a whole row in this
+ * buffer's arena, copied into it otherwise. */
+struct editorLine editorTextLine(struct editorText *t, int i) {
+  struct editorLine l = t->lines[i];
+  struct arenaBlock *b = t->blocks[i];
+  if (b && b->arena == editorConf.arena) {
+    if (!(l.flags & ROW_PACKED))
+      arenaShare(l.chars);
+    return l;
+  }
+  struct editorLine copy = editorNewLine(l.size);
+  memcpy(copy.chars, l.chars, l.size);
+  return copy;
+}
+
+/* Replace rows [at, at + del) with ins lines as one undoable splice. */
+void editorReplaceRows(int at, int del, struct editorLine *lines, int ins) {
+  struct editorStep step = {0};
+  step.num_hunks = 1;
+  step.hunks = malloc(sizeof(struct editorHunk));
+  if (step.hunks == NULL)
+    die("malloc");
+  step.hunks[0].at = at;
+  step.hunks[0].del = del;
+  step.hunks[0].ins = ins;
+  step.hunks[0].lines = lines;
+  editorUndoPush(editorUndoOpen(), editorSpliceRows(step));
+}
+
+void editorDeleteRegion(struct editorRegion *r) {
+  int n = r->y2 - r->y1 + 1;
+  if (r->kind == 'V') {
+    editorReplaceRows(r->y1, n, NULL, 0);
+    return;
+  }
+
+  if (r->kind == 'v') {
+    int tail = editorConf.row_size[r->y2] - r->x2;
+    struct editorLine *l = malloc(sizeof(struct editorLine));
+    if (l == NULL)
+      die("malloc");
+    *l = editorNewLine(r->x1 + tail);
+    memcpy(l->chars, editorConf.row[r->y1].chars, r->x1);
+    memcpy(l->chars + r->x1, editorConf.row[r->y2].chars + r->x2, tail);
+    editorReplaceRows(r->y1, n, l, 1);
+    return;
+  }
+
+  struct editorLine *lines = malloc(sizeof(struct editorLine) * n);
+  if (lines == NULL)
+    die("malloc");
+  for (int i = 0; i < n; i++) {
+    int at = r->y1 + i;
+    int size = editorConf.row_size[at];
+    char *chars = editorConf.row[at].chars;
+    int from, to;
+    editorRegionSlice(r, at, &from, &to);
+    lines[i] = editorNewLine(size - (to - from));
+    memcpy(lines[i].chars, chars, from);
+    memcpy(lines[i].chars + from, chars + to, size - to);
+  }
+  editorReplaceRows(r->y1, n, lines, n);
+}
+
+/* Put register text after the cursor, or before it for P, in one splice.
+ * Whole lines go in as references to the register's text; only the rows
+ * the text is joined into are built anew. */
+void editorPut(struct editorText *t, int before, int count) {
+  int n = t->num_lines;
+
+  if (t->kind == 'V') {
+    int at = before ? editorConf.cy : editorConf.cy + 1;
+    if (at >= editorConf.num_rows) {
+      editorWaitRows(INT_MAX);
+      if (at > editorConf.num_rows)
+        at = editorConf.num_rows;
+    }
+    struct editorLine *lines = malloc(sizeof(struct editorLine) * n * count);
+    if (lines == NULL)
+      die("malloc");
+    for (int i = 0; i < n * count; i++)
+      lines[i] = editorTextLine(t, i % n);
+    editorReplaceRows(at, 0, lines, n * count);
+    editorConf.cy = at;
+    editorConf.cx = 0;
+    if (n * count > 2)
+      editorSetStatusMessage("%d more lines", n * count);
+    return;
+  }
+
+  int cy = editorConf.cy;
+  editorWaitRows(cy + n + 1);
+  int exists = cy < editorConf.num_rows;
+  char *chars = exists ? editorConf.row[cy].chars : "";
+  int size = exists ? editorConf.row_size[cy] : 0;
+  int pos = before ? editorConf.cx : editorConf.cx + 1;
+  if (pos > size)
+    pos = size;
+
+  struct editorLine *lines = malloc(sizeof(struct editorLine) * n);
+  if (lines == NULL)
+    die("malloc");
+  if (t->kind == 'v') {
+    struct editorLine *first = &t->lines[0];
+    struct editorLine *last = &t->lines[n - 1];
+    for (int i = 1; i < n - 1; i++)
+      lines[i] = editorTextLine(t, i);
+    if (n == 1) {
+      lines[0] = editorNewLine(size + first->size);
+      memcpy(lines[0].chars, chars, pos);
+      memcpy(lines[0].chars + pos, first->chars, first->size);
+      memcpy(lines[0].chars + pos + first->size, chars + pos, size - pos);
+    } else {
+      lines[0] = editorNewLine(pos + first->size);
+      memcpy(lines[0].chars, chars, pos);
+      memcpy(lines[0].chars + pos, first->chars, first->size);
+      lines[n - 1] = editorNewLine(last->size + size - pos);
+      memcpy(lines[n - 1].chars, last->chars, last->size);
+      memcpy(lines[n - 1].chars + last->size, chars + pos, size - pos);
+    }
+    editorReplaceRows(cy, exists, lines, n);
+    editorConf.cx = pos;
+    return;
+  }
+
+  /* a block goes into each row at the same column, padding short rows */
+  int del = editorConf.num_rows - cy < n ? editorConf.num_rows - cy : n;
+  for (int i = 0; i < n; i++) {
+    struct editorLine *piece = &t->lines[i];
+    int at = cy + i;
+    char *row = at < editorConf.num_rows ? editorConf.row[at].chars : "";
+    int row_size = at < editorConf.num_rows ? editorConf.row_size[at] : 0;
+    int col = pos < row_size ? pos : row_size;
+    int pad = pos - col;
+    lines[i] = editorNewLine(row_size + pad + piece->size);
+    char *dst = lines[i].chars;
+    memcpy(dst, row, col);
+    memset(dst + col, ' ', pad);
+    memcpy(dst + col + pad, piece->chars, piece->size);
+    memcpy(dst + col + pad + piece->size, row + col, row_size - col);
+  }
+  editorReplaceRows(cy, del, lines, n);
+  editorConf.cx = pos;
+}
+
+/* p and P in normal mode, from the register picked with "x. */
+void editorPutRegister(int before, int count) {
+  int slot = editorConf.reg;
+  editorConf.reg = 0;
+  struct editorText *t = editorConf.registers[slot];
+  if (t == NULL) {
+    editorSetStatusMessage("Nothing in register %c",
+                           slot ? 'a' + slot - 1 : '"');
+    return;
+  }
+  editorPut(t, before, count);
+}
+
+/* The render columns [*from, *to) of row at to show as selected; a range
+ * past the end of the row covers its line break. */
+void editorVisualColumns(int at, int *from, int *to) {
+  *from = *to = 0;
+  if (editorConf.mode != VISUAL_MODE || editorConf.num_rows == 0)
+    return;
+  struct editorRegion r = editorVisualRegion();
+  if (at < r.y1 || at > r.y2)
+    return;
+  int cf, ct;
+  editorRegionSlice(&r, at, &cf, &ct);
+  *from = editorRowCxToRx(at, cf);
+  *to = editorRowCxToRx(at, ct);
+  if (r.kind == 'V' || (r.kind == 'v' && at < r.y2))
+    *to = editorRowRsize(at) + 1;
+}
+
+/* Keys in visual mode other than motions. */
+void editorVisualKey(int c) {
+  switch (c) {
+  case 'v':
+  case 'V':
+  case CTRL_KEY('v'):
+    if (c == editorConf.visual)
+      editorConf.mode = NORMAL_MODE;
+    else
+      editorConf.visual = c;
+    break;
+  case 'o': {
+    int y = editorConf.vy, x = editorConf.vx;
+    editorConf.vy = editorConf.cy;
+    editorConf.vx = editorConf.cx;
+    editorGotoLine(y);
+    editorConf.cx = x;
+  } break;
+  case ':': {
+    struct editorRegion r = editorVisualRegion();
+    editorConf.mode = COMMAND_MODE;
+    editorConf.command_len =
+        snprintf(editorConf.command_buffer, sizeof(editorConf.command_buffer),
+                 "%d,%d", r.y1 + 1, r.y2 + 1);
+    editorSetStatusMessage(":%s", editorConf.command_buffer);
+  } break;
+  case 'y':
+  case 'd':
+  case 'x': {
+    struct editorRegion r = editorVisualRegion();
+    int n = r.y2 - r.y1 + 1;
+    struct editorText *t = editorYankRegion(&r);
+    editorStoreRegister(0, t);
+    if (editorConf.reg)
+      editorStoreRegister(editorConf.reg, t);
+    editorConf.reg = 0;
+    if (c != 'y')
+      editorDeleteRegion(&r);
+    editorConf.mode = NORMAL_MODE;
+    editorGotoLine(r.y1);
+    if (r.kind == 'V')
+      editorConf.cx = c == 'y' ? editorConf.cx : 0;
+    else if (r.kind == 'v')
+      editorConf.cx = r.x1;
+    else
+      editorConf.cx = editorRowRxToCx(r.y1, r.x1);
+    if (n > 2)
+      editorSetStatusMessage(c == 'y' ? "%d lines yanked" : "%d fewer lines",
+                             n);
+  } break;
+  case 27:
+    editorConf.mode = NORMAL_MODE;
+    break;
+  }
+}
+
+/*cursors*/
+
+int editorCursorCompare(const void *a, const void *b) {
+  const struct editorCursor *p = a, *q = b;
+  if (p->y != q->y)
+    return (p->y > q->y) - (p->y < q->y);
+  return (p->x > q->x) - (p->x < q->x);
+}
+
+/* Index of the first extra cursor on row or after it. */
+int editorCursorSearch(int row) {
+  int lo = 0, hi = editorConf.num_cursors;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (editorConf.cursors[mid].y < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Render column of extra cursor i if it is on row, else -1. */
+int editorCursorRx(int i, int row) {
+  if (i >= editorConf.num_cursors || editorConf.cursors[i].y != row)
+    return -1;
+  int x = editorConf.cursors[i].x;
+  if (x > editorConf.row_size[row])
+    x = editorConf.row_size[row];
+  return editorRowCxToRx(row, x);
+}
+
+void editorCursorsAdd(int y, int x) {
+  if (editorConf.num_cursors == editorConf.cursors_cap) {
+    editorConf.cursors_cap =
+        editorConf.cursors_cap ? editorConf.cursors_cap * 2 : 64;
+    editorConf.cursors =
+        realloc(editorConf.cursors,
+                sizeof(struct editorCursor) * editorConf.cursors_cap);
+    if (editorConf.cursors == NULL)
+      die("realloc");
+  }
+  editorConf.cursors[editorConf.num_cursors].y = y;
+  editorConf.cursors[editorConf.num_cursors].x = x;
+  editorConf.num_cursors++;
+}
+
+/* Clamp the extra cursors, which are in order, to the rows and drop the
+ * ones that met each other or the primary cursor. */
+void editorCursorsTidy() {
+  int kept = 0;
+  for (int i = 0; i < editorConf.num_cursors; i++) {
+    struct editorCursor c = editorConf.cursors[i];
+    if (c.y >= editorConf.num_rows)
+      break;
+    if (c.x > editorConf.row_size[c.y])
+      c.x = editorConf.row_size[c.y];
+    if ((kept && c.y == editorConf.cursors[kept - 1].y &&
+         c.x == editorConf.cursors[kept - 1].x) ||
+        (c.y == editorConf.cy && c.x == editorConf.cx))
+      continue;
+    editorConf.cursors[kept++] = c;
+  }
+  editorConf.num_cursors = kept;
+}
+
+/* Move the extra cursors along after a splice of n hunks. One in rows a
+ * hunk replaced goes to the start of the hunk, which keeps them in order;
+ * an edit through the cursors puts them where they belong afterwards. */
+void editorCursorsShift(struct editorHunk *hunks, int n) {
+  int h = 0, delta = 0;
+  for (int i = 0; i < editorConf.num_cursors; i++) {
+    struct editorCursor *c = &editorConf.cursors[i];
+    while (h < n && hunks[h].at + hunks[h].del <= c->y) {
+      delta += hunks[h].ins - hunks[h].del;
+      h++;
+    }
+    if (h < n && hunks[h].at <= c->y) {
+      c->y = hunks[h].at + delta;
+      c->x = 0;
+    } else {
+      c->y += delta;
+    }
+  }
+}
+
+/* Move every extra cursor the way key c moved the primary one, each in
+ * turn standing in for it: as editorMotion does with count, or as
+ * editorMoveCursor does if count is 0. */
+void editorCursorsFollow(int c, int count, int has_count) {
+  int cx = editorConf.cx, cy = editorConf.cy;
+  for (int i = 0; i < editorConf.num_cursors; i++) {
+    editorConf.cx = editorConf.cursors[i].x;
+    editorConf.cy = editorConf.cursors[i].y;
+    if (count)
+      editorMotion(c, count, has_count);
+    else
+      editorMoveCursor(c);
+    editorConf.cursors[i].x = editorConf.cx;
+    editorConf.cursors[i].y = editorConf.cy;
+  }
+  editorConf.cx = cx;
+  editorConf.cy = cy;
+  qsort(editorConf.cursors, editorConf.num_cursors,
+        sizeof(struct editorCursor), editorCursorCompare);
+  editorCursorsTidy();
+}
+
+/* After a splice whose inverse is inv, keep the block comment states known
+ * for the first state rows before it past each hunk whose last row ends
+ * as was_open says it did, so the rows between hunks are not scanned
+ * again on the way to the screen. */
+void editorSyntaxCarry(struct editorStep *inv, int state,
+                       unsigned char *was_open) {
+  struct editorSyntax *syn = editorConf.syntax;
+  if (syn == NULL || !syn->multiline_comment_start)
+    return;
+  int delta = 0;
+  for (int i = 0; i < inv->num_hunks; i++) {
+    struct editorHunk *h = &inv->hunks[i];
+    if (editorConf.hl_state_rows != h->at || h->del == 0 ||
+        h->at - delta + h->ins > state)
+      return;
+    int last = h->at + h->del - 1;
+    if (editorSyntaxOpen(last) != was_open[i])
+      return;
+    delta += h->del - h->ins;
+    int next = i + 1 < inv->num_hunks ? inv->hunks[i + 1].at - delta : INT_MAX;
+    int reach = next < state ? next : state;
+    editorConf.hl_state_rows = reach + delta;
+    if (reach < next)
+      return;
+  }
+}
+
+/* Whether step a, the last one undo holds, covers the same rows as b, so
+ * that b, which kept the row count, adds nothing to it. */
+int editorStepSameRows(struct editorStep *a, struct editorStep *b) {
+  if (a->perm || a->num_hunks != b->num_hunks)
+    return 0;
+  for (int i = 0; i < b->num_hunks; i++) {
+    if (a->hunks[i].at != b->hunks[i].at ||
+        a->hunks[i].del != b->hunks[i].del ||
+        b->hunks[i].del != b->hunks[i].ins)
+      return 0;
+  }
+  return 1;
+}
+
+/* Apply key c (a char, '\r' or BACKSPACE) at the primary and every extra
+ * cursor as one splice. Each touched row is rebuilt once however many
+ * cursors it holds, runs of touched rows share a hunk, and keys that keep
+ * the rows in place widen the undo step the last one made. */
+void editorCursorsEdit(int c) {
+  editorCursorsTidy();
+  int n = editorConf.num_cursors;
+  struct editorCursor *all = malloc(sizeof(struct editorCursor) * (n + 1));
+  if (all == NULL)
+    die("malloc");
+  int primary = -1;
+  int i = editorCursorSearch(editorConf.cy);
+  while (i < n && editorConf.cursors[i].y == editorConf.cy &&
+         editorConf.cursors[i].x < editorConf.cx)
+    i++;
+  memcpy(all, editorConf.cursors, sizeof(struct editorCursor) * i);
+  if (editorConf.cy < editorConf.num_rows) {
+    primary = i;
+    all[i].y = editorConf.cy;
+    all[i].x = editorConf.cx;
+  }
+  memcpy(all + i + (primary != -1), editorConf.cursors + i,
+         sizeof(struct editorCursor) * (n - i));
+  n += primary != -1;
+
+  struct editorStep step = {0};
+  step.hunks = malloc(sizeof(struct editorHunk) * (n ? n : 1));
+  unsigned char *was_open = malloc(n ? n : 1);
+  int *starts = NULL;
+  int starts_cap = 0;
+  char *out = NULL;
+  size_t out_len = 0, out_cap = 0;
+  if (step.hunks == NULL || was_open == NULL)
+    die("malloc");
+
+  int delta = 0;
+  for (int k = 0; k < n;) {
+    /* a backspace at the start of a row takes the row above with it */
+    int a = all[k].y - (c == BACKSPACE && all[k].x == 0 && all[k].y > 0);
+    int b = all[k].y;
+    int j = k + 1;
+    while (j < n &&
+           all[j].y - (c == BACKSPACE && all[j].x == 0) <= b + 1) {
+      b = all[j].y;
+      j++;
+    }
+
+    int num_lines = 0;
+    out_len = 0;
+    for (int r = a; r <= b; r++) {
+      char *chars = editorConf.row[r].chars;
+      int size = editorConf.row_size[r];
+      /* room for the row, one char per cursor and a line start each */
+      if (out_len + size + (j - k) > out_cap) {
+        out_cap = (out_len + size + (j - k)) * 2;
+        out = realloc(out, out_cap);
+      }
+      if (num_lines + (j - k) + 1 > starts_cap) {
+        starts_cap = (num_lines + (j - k) + 1) * 2;
+        starts = realloc(starts, sizeof(int) * starts_cap);
+      }
+      if (out == NULL || starts == NULL)
+        die("realloc");
+      starts[num_lines++] = out_len;
+      int pos = 0;
+      for (; k < j && all[k].y == r; k++) {
+        int x = all[k].x;
+        memcpy(out + out_len, chars + pos, x - pos);
+        out_len += x - pos;
+        pos = x;
+        if (c == '\r')
+          starts[num_lines++] = out_len;
+        else if (c == BACKSPACE && x > 0)
+          out_len--;
+        else if (c == BACKSPACE && r > a)
+          num_lines--;
+        else if (c != BACKSPACE)
+          out[out_len++] = c;
+        all[k].y = a + delta + num_lines - 1;
+        all[k].x = out_len - starts[num_lines - 1];
+      }
+      memcpy(out + out_len, chars + pos, size - pos);
+      out_len += size - pos;
+    }
+
+    struct editorHunk *h = &step.hunks[step.num_hunks];
+    was_open[step.num_hunks++] =
+        (editorConf.row_flags[b] & ROW_HL_OPEN) != 0;
+    h->at = a;
+    h->del = b - a + 1;
+    h->ins = num_lines;
+    h->lines = malloc(sizeof(struct editorLine) * num_lines);
+    if (h->lines == NULL)
+      die("malloc");
+    for (int l = 0; l < num_lines; l++) {
+      int end = l + 1 < num_lines ? starts[l + 1] : (int)out_len;
+      h->lines[l] = editorNewLine(end - starts[l]);
+      memcpy(h->lines[l].chars, out + starts[l], end - starts[l]);
+    }
+    delta += h->ins - h->del;
+  }
+  free(out);
+  free(starts);
+
+  if (step.num_hunks) {
+    int state = editorConf.hl_state_rows;
+    struct editorUndo *u = editorUndoOpen();
+    struct editorStep inv = editorSpliceRows(step);
+    editorSyntaxCarry(&inv, state, was_open);
+    if (u->num_steps && editorStepSameRows(&u->steps[u->num_steps - 1], &inv)) {
+      for (int l = 0; l < inv.num_hunks; l++)
+        editorFreeLines(inv.hunks[l].lines, inv.hunks[l].ins);
+      free(inv.hunks);
+    } else {
+      editorUndoPush(u, inv);
+    }
+  } else {
+    free(step.hunks);
+  }
+  free(was_open);
+
+  if (primary != -1) {
+    editorConf.cy = all[primary].y;
+    editorConf.cx = all[primary].x;
+    memmove(all + primary, all + primary + 1,
+            sizeof(struct editorCursor) * (n - primary - 1));
+    n--;
+  }
+  memcpy(editorConf.cursors, all, sizeof(struct editorCursor) * n);
+  editorConf.num_cursors = n;
+  free(all);
+  editorCursorsTidy();
+}
+
+/* :[range]cursors puts an extra cursor at every match of the last search
+ * in the range, the whole buffer by default. */
+void editorCursorsCommand(int from, int to) {
+  const char *query = editorConf.search_query;
+  if (query == NULL || *query == '\0') {
+    editorSetStatusMessage("No previous pattern");
+    return;
+  }
+  size_t len = strlen(query);
+  editorConf.num_cursors = 0;
+  for (int at = from; at <= to; at++) {
+    char *chars = editorConf.row[at].chars;
+    int size = editorConf.row_size[at];
+    char *m = chars;
+    while ((m = memmem(m, chars + size - m, query, len)) != NULL) {
+      editorCursorsAdd(at, m - chars);
+      m += len;
+    }
+  }
+  editorCursorsTidy();
+  if (editorConf.num_cursors == 0)
+    editorSetStatusMessage("Pattern not found: %s", query);
+  else
+    editorSetStatusMessage("%d cursors; Esc drops the extra ones",
+                           editorConf.num_cursors + 1);
+}
+
+/*commands*/
+
+int editorParseAddress(char **p, int *line) {
+  char *s = *p;
+  if (*s == '.') {
+    *line = editorConf.cy;
+    s++;
+  } else if (*s == '$') {
+    editorWaitRows(INT_MAX);
+    *line = editorConf.num_rows - 1;
+    s++;
+  } else if (isdigit((unsigned char)*s)) {
+    long n = strtol(s, &s, 10);
+    if (n > INT_MAX)
+      n = INT_MAX;
+    editorWaitRows(n);
+    *line = n - 1;
+  } else {
+    return 0;
+  }
+  *p = s;
+  return 1;
+}
+
+/* Parse an optional line range ("%", "N", "N,M", "." or "$") off the front
+ * of a command into 0-based rows [*from, *to]. Without one the range is the
+ * cursor line, or the whole buffer when all is set. */
+int editorParseRange(char **p, int *from, int *to, int all) {
+  if (**p == '%' || (all && !strchr(".$,0123456789", **p))) {
+    if (**p == '%')
+      (*p)++;
+    editorWaitRows(INT_MAX);
+    *from = 0;
+    *to = editorConf.num_rows - 1;
+    return 0;
+  }
+  *from = *to = editorConf.cy;
+  if (editorParseAddress(p, from)) {
+    *to = *from;
+    if (**p == ',') {
+      (*p)++;
+      if (!editorParseAddress(p, to))
+        return -1;
+    }
+  }
+  if (*from > *to) {
+    int t = *from;
+    *from = *to;
+    *to = t;
+  }
+  if (*from < 0)
+    *from = 0;
+  if (*to >= editorConf.num_rows)
+    *to = editorConf.num_rows - 1;
+  return 0;
+}
+
+/* Cut the next delim-terminated field off *p in place. A backslash before
+ * the delimiter escapes it. */
+char *editorParseField(char **p, char delim) {
+  char *field = *p;
+  char *out = field;
+  char *s = field;
+  while (*s && *s != delim) {
+    if (s[0] == '\\' && s[1] == delim)
+      s++;
+    *out++ = *s++;
+  }
+  if (*s == delim)
+    s++;
+  *out = '\0';
+  *p = s;
+  return field;
+}
+
+void *editorSubstRows(void *arg) {
+  struct substTask *t = arg;
+  size_t used = 0;
+
+  for (int at = t->from; at < t->to; at++) {
+    char *chars = editorConf.row[at].chars;
+    size_t size = editorConf.row_size[at];
+    char *m = memmem(chars, size, t->pat, t->pat_len);
+    if (m == NULL)
+      continue;
+
+    if (t->num_lines == t->lines_cap) {
+      t->lines_cap = t->lines_cap ? t->lines_cap * 2 : 64;
+      t->lines = realloc(t->lines, sizeof(struct substLine) * t->lines_cap);
+      if (t->lines == NULL)
+        die("realloc");
+    }
+    struct substLine *line = &t->lines[t->num_lines++];
+    line->row = at;
+    line->off = used;
+
+    char *p = chars;
+    while (1) {
+      size_t keep = m ? (size_t)(m - p) : size - (p - chars);
+      size_t need = used + keep + (m ? t->rep_len : 1);
+      if (need > t->block_cap) {
+        t->block_cap = need * 2 > (1 << 16) ? need * 2 : (1 << 16);
+        t->block = realloc(t->block, sizeof(struct arenaBlock) + t->block_cap);
+        if (t->block == NULL)
+          die("realloc");
+      }
+      char *out = (char *)(t->block + 1);
+      memcpy(out + used, p, keep);
+      used += keep;
+      if (m == NULL) {
+        out[used++] = '\0';
+        break;
+      }
+      memcpy(out + used, t->rep, t->rep_len);
+      used += t->rep_len;
+      t->count++;
+      p = m + t->pat_len;
+      m = t->global ? memmem(p, size - (p - chars), t->pat, t->pat_len) : NULL;
+    }
+    line->size = used - line->off - 1;
+  }
+  if (t->block)
+    t->block->size = used;
+  return NULL;
+}
+
+/* :[range]s/pat/rep/[g] with a literal pattern. Rows are rewritten in
+ * parallel into per-thread blocks that the arena adopts, and the result
+ * is applied as a single step so it is one undo entry. */
+void editorSubstitute(int from, int to, char *args) {
+  char delim = *args;
+  if (delim == '\0' || isalnum((unsigned char)delim) || delim == '\\') {
+    editorSetStatusMessage("Usage: s/pattern/replacement/[g]");
+    return;
+  }
+  args++;
+  char *pat = editorParseField(&args, delim);
+  char *rep = editorParseField(&args, delim);
+  int global = strchr(args, 'g') != NULL;
+  if (*pat == '\0') {
+    if (editorConf.search_query == NULL) {
+      editorSetStatusMessage("No previous pattern");
+      return;
+    }
+    pat = editorConf.search_query;
+  }
+  if (from > to) {
+    editorSetStatusMessage("Pattern not found: %s", pat);
+    return;
+  }
+
+  struct substTask tasks[ZOR_MAX_THREADS];
+  int n = editorThreadCount();
+  if (n > (to - from) / 1024 + 1)
+    n = (to - from) / 1024 + 1;
+  memset(tasks, 0, sizeof(struct substTask) * n);
+  for (int i = 0; i < n; i++) {
+    tasks[i].from = from + (long long)(to - from + 1) * i / n;
+    tasks[i].to = from + (long long)(to - from + 1) * (i + 1) / n;
+    tasks[i].pat = pat;
+    tasks[i].pat_len = strlen(pat);
+    tasks[i].rep = rep;
+    tasks[i].rep_len = strlen(rep);
+    tasks[i].global = global;
+  }
+  editorRunParallel(editorSubstRows, tasks, sizeof(struct substTask), n);
+
+  /* consecutive rewritten rows share a hunk */
+  struct editorStep step = {0};
+  int hunks_cap = 0;
+  int lines_cap = 0;
+  long long count = 0;
+  int touched = 0;
+  int last_row = -1;
+  for (int i = 0; i < n; i++) {
+    struct substTask *t = &tasks[i];
+    count += t->count;
+    touched += t->num_lines;
+    if (t->block)
+      arenaAdopt(editorConf.arena, t->block, MEM_TEXT);
+    for (int j = 0; j < t->num_lines; j++) {
+      struct substLine *l = &t->lines[j];
+      struct editorHunk *h = step.num_hunks ? &step.hunks[step.num_hunks - 1]
+                                            : NULL;
+      if (h == NULL || l->row != last_row + 1) {
+        if (step.num_hunks == hunks_cap) {
+          hunks_cap = hunks_cap ? hunks_cap * 2 : 64;
+          step.hunks =
+              realloc(step.hunks, sizeof(struct editorHunk) * hunks_cap);
+          if (step.hunks == NULL)
+            die("realloc");
+        }
+        h = &step.hunks[step.num_hunks++];
+        h->at = l->row;
+        h->del = h->ins = 0;
+        h->lines = NULL;
+        lines_cap = 0;
+      }
+      if (h->ins == lines_cap) {
+        lines_cap = lines_cap ? lines_cap * 2 : 4;
+        h->lines = realloc(h->lines, sizeof(struct editorLine) * lines_cap);
+        if (h->lines == NULL)
+          die("realloc");
+      }
+      h->lines[h->ins].chars = (char *)(t->block + 1) + l->off;
+      h->lines[h->ins].size = l->size;
+      h->lines[h->ins].flags = ROW_PACKED;
+      h->ins++;
+      h->del++;
+      last_row = l->row;
+    }
+    free(t->lines);
+  }
+
+  if (count == 0) {
+    free(step.hunks);
+    editorSetStatusMessage("Pattern not found: %s", pat);
+    return;
+  }
+  editorUndoBreak();
+  editorUndoPush(editorUndoOpen(), editorSpliceRows(step));
+  editorUndoBreak();
+  editorConf.cy = last_row;
+  editorConf.cx = 0;
+  editorSetStatusMessage("%lld substitution%s on %d line%s", count,
+                         count == 1 ? "" : "s", touched,
+                         touched == 1 ? "" : "s");
+}
+
+void *editorGlobalRows(void *arg) {
+  struct globalTask *t = arg;
+  for (int at = t->from; at < t->to; at++) {
+    int hit = memmem(editorConf.row[at].chars, editorConf.row_size[at],
+                     t->pat, t->pat_len) != NULL;
+    if (hit == t->invert)
+      continue;
+    if (t->num_rows == t->rows_cap) {
+      t->rows_cap = t->rows_cap ? t->rows_cap * 2 : 256;
+      t->rows = realloc(t->rows, sizeof(int) * t->rows_cap);
+      if (t->rows == NULL)
+        die("realloc");
+    }
+    t->rows[t->num_rows++] = at;
+  }
+  return NULL;
+}
+
+/* Drop the listed rows (ascending) as one step, one hunk per run. */
+void editorDeleteRowList(int *rows, int n) {
+  struct editorStep step = {0};
+  step.hunks = malloc(sizeof(struct editorHunk) * (n ? n : 1));
+  if (step.hunks == NULL)
+    die("malloc");
+  for (int i = 0; i < n; i++) {
+    struct editorHunk *h;
+    if (step.num_hunks) {
+      h = &step.hunks[step.num_hunks - 1];
+      if (h->at + h->del == rows[i]) {
+        h->del++;
+        continue;
+      }
+    }
+    h = &step.hunks[step.num_hunks++];
+    h->at = rows[i];
+    h->del = 1;
+    h->ins = 0;
+    h->lines = NULL;
+  }
+  editorUndoPush(editorUndoOpen(), editorSpliceRows(step));
+}
+
+/* :[range]g/pat/d and :v/pat/d. Matching runs on worker threads and all
+ * the deletions are compacted out of the row arrays in one pass. */
+void editorGlobal(int from, int to, char *args, int invert) {
+  if (*args == '!') {
+    invert = !invert;
+    args++;
+  }
+  char delim = *args;
+  if (delim == '\0' || isalnum((unsigned char)delim) || delim == '\\') {
+    editorSetStatusMessage("Usage: g/pattern/d");
+    return;
+  }
+  args++;
+  char *pat = editorParseField(&args, delim);
+  if (strcmp(args, "d") != 0) {
+    editorSetStatusMessage("Only d is supported after g/pattern/");
+    return;
+  }
+  if (*pat == '\0') {
+    if (editorConf.search_query == NULL) {
+      editorSetStatusMessage("No previous pattern");
+      return;
+    }
+    pat = editorConf.search_query;
+  }
+
+  struct globalTask tasks[ZOR_MAX_THREADS];
+  int n = editorThreadCount();
+  if (n > (to - from) / 1024 + 1)
+    n = (to - from) / 1024 + 1;
+  if (n < 1)
+    n = 1;
+  memset(tasks, 0, sizeof(struct globalTask) * n);
+  for (int i = 0; i < n; i++) {
+    tasks[i].from = from + (long long)(to - from + 1) * i / n;
+    tasks[i].to = from + (long long)(to - from + 1) * (i + 1) / n;
+    tasks[i].pat = pat;
+    tasks[i].pat_len = strlen(pat);
+    tasks[i].invert = invert;
+  }
+  if (from <= to)
+    editorRunParallel(editorGlobalRows, tasks, sizeof(struct globalTask), n);
+
+  int total = 0;
+  for (int i = 0; i < n; i++)
+    total += tasks[i].num_rows;
+  if (total == 0) {
+    for (int i = 0; i < n; i++)
+      free(tasks[i].rows);
+    editorSetStatusMessage("Pattern not found: %s", pat);
+    return;
+  }
+  int *rows = malloc(sizeof(int) * total);
+  if (rows == NULL)
+    die("malloc");
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(&rows[k], tasks[i].rows, sizeof(int) * tasks[i].num_rows);
+    k += tasks[i].num_rows;
+    free(tasks[i].rows);
+  }
+
+  editorDeleteRowList(rows, total);
+  editorConf.cy = rows[0] < editorConf.num_rows ? rows[0]
+                                                : editorConf.num_rows;
+  editorConf.cx = 0;
+  free(rows);
+  editorSetStatusMessage("%d fewer line%s", total, total == 1 ? "" : "s");
+}
+
+int editorSortCompare(struct sortCtx *c, int a, int b) {
+  if (c->numeric) {
+    if (c->has_num[a] != c->has_num[b])
+      return c->has_num[a] - c->has_num[b];
+    if (!c->has_num[a])
+      return 0;
+    return (c->num[a] > c->num[b]) - (c->num[a] < c->num[b]);
+  }
+  int sa = editorConf.row_size[c->from + a];
+  int sb = editorConf.row_size[c->from + b];
+  int r = memcmp(editorConf.row[c->from + a].chars,
+                 editorConf.row[c->from + b].chars, sa < sb ? sa : sb);
+  if (r)
+    return r;
+  return (sa > sb) - (sa < sb);
+}
+
+/* Stable merge of src[lo, mid) and src[mid, hi) into dst. */
+void *editorSortMerge(void *arg) {
+  struct sortTask *t = arg;
+  int i = t->lo, j = t->mid, k = t->lo;
+  while (i < t->mid && j < t->hi) {
+    if (editorSortCompare(t->ctx, t->src[j], t->src[i]) < 0)
+      t->dst[k++] = t->src[j++];
+    else
+      t->dst[k++] = t->src[i++];
+  }
+  memcpy(&t->dst[k], &t->src[i], sizeof(int) * (t->mid - i));
+  k += t->mid - i;
+  memcpy(&t->dst[k], &t->src[j], sizeof(int) * (t->hi - j));
+  return NULL;
+}
+
+/* Sort src[lo, hi) by bottom-up merging, leaving the result in src. For
+ * "n" the numeric keys of the slice are parsed first. */
+void *editorSortSlice(void *arg) {
+  struct sortTask *t = arg;
+  struct sortCtx *c = t->ctx;
+  if (c->numeric) {
+    for (int i = t->lo; i < t->hi; i++) {
+      char *chars = editorConf.row[c->from + i].chars;
+      int size = editorConf.row_size[c->from + i];
+      int j = 0;
+      while (j < size && !isdigit((unsigned char)chars[j]))
+        j++;
+      c->has_num[i] = j < size;
+      if (j < size) {
+        int neg = j > 0 && chars[j - 1] == '-';
+        long long v = 0;
+        while (j < size && isdigit((unsigned char)chars[j]))
+          v = v * 10 + (chars[j++] - '0');
+        c->num[i] = neg ? -v : v;
+      }
+    }
+  }
+
+  int *src = t->src, *dst = t->dst;
+  for (int width = 1; width < t->hi - t->lo; width *= 2) {
+    for (int lo = t->lo; lo < t->hi; lo += 2 * width) {
+      struct sortTask m = {c, src, dst, lo, lo + width, lo + 2 * width};
+      if (m.mid > t->hi)
+        m.mid = t->hi;
+      if (m.hi > t->hi)
+        m.hi = t->hi;
+      editorSortMerge(&m);
+    }
+    int *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != t->src)
+    memcpy(&t->src[t->lo], &src[t->lo], sizeof(int) * (t->hi - t->lo));
+  return NULL;
+}
+
+/* :[range]sort [n][u]. Slices are sorted on worker threads and merged
+ * pairwise in parallel rounds; the result is applied as a reordering of
+ * the row arrays, plus one deletion step for "u", in a single undo entry. */
+void editorSort(int from, int to, char *args) {
+  struct sortCtx ctx = {from, strchr(args, 'n') != NULL, NULL, NULL};
+  int unique = strchr(args, 'u') != NULL;
+  int len = to - from + 1;
+  if (len < 2)
+    return;
+
+  int *idx = malloc(sizeof(int) * len);
+  int *tmp = malloc(sizeof(int) * len);
+  if (idx == NULL || tmp == NULL)
+    die("malloc");
+  if (ctx.numeric) {
+    ctx.num = malloc(sizeof(long long) * len);
+    ctx.has_num = malloc(len);
+    if (ctx.num == NULL || ctx.has_num == NULL)
+      die("malloc");
+  }
+  for (int i = 0; i < len; i++)
+    idx[i] = i;
+
+  struct sortTask tasks[ZOR_MAX_THREADS];
+  int n = editorThreadCount();
+  if (n > len / 4096 + 1)
+    n = len / 4096 + 1;
+  int bounds[ZOR_MAX_THREADS + 1];
+  for (int i = 0; i <= n; i++)
+    bounds[i] = (long long)len * i / n;
+  for (int i = 0; i < n; i++) {
+    struct sortTask t = {&ctx, idx, tmp, bounds[i], bounds[i], bounds[i + 1]};
+    tasks[i] = t;
+  }
+  editorRunParallel(editorSortSlice, tasks, sizeof(struct sortTask), n);
+
+  int *src = idx, *dst = tmp;
+  for (int width = 1; width < n; width *= 2) {
+    int m = 0;
+    for (int i = 0; i < n; i += 2 * width) {
+      int mid = i + width < n ? i + width : n;
+      int hi = i + 2 * width < n ? i + 2 * width : n;
+      struct sortTask t = {&ctx, src, dst, bounds[i], bounds[mid], bounds[hi]};
+      tasks[m++] = t;
+    }
+    editorRunParallel(editorSortMerge, tasks, sizeof(struct sortTask), m);
+    int *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  int *dups = NULL;
+  int num_dups = 0;
+  if (unique) {
+    dups = dst;
+    for (int i = 1; i < len; i++) {
+      if (editorSortCompare(&ctx, src[i - 1], src[i]) == 0)
+        dups[num_dups++] = from + i;
+    }
+  }
+
+  struct editorStep step = {0};
+  step.perm_at = from;
+  step.perm_len = len;
+  step.perm = src;
+  editorUndoPush(editorUndoOpen(), editorPermuteRows(step));
+  if (num_dups)
+    editorDeleteRowList(dups, num_dups);
+  free(dst);
+  free(ctx.num);
+  free(ctx.has_num);
+
+  editorConf.cy = from;
+  editorConf.cx = 0;
+  if (num_dups)
+    editorSetStatusMessage("%d fewer line%s", num_dups,
+                           num_dups == 1 ? "" : "s");
+}
+
+/* Run a command that takes a line range. Returns -1 if command is not
+ * one of them. */
+int editorRangeCommand(char *command) {
+  char *name = command;
+  while (*name && strchr("%.$,0123456789", *name))
+    name++;
+
+  int from, to;
+  char *p = command;
+  if (strcmp(name, "cursors") == 0) {
+    if (editorParseRange(&p, &from, &to, 1) == 0 && p == name)
+      editorCursorsCommand(from, to);
+    else
+      editorSetStatusMessage("Invalid range");
+  } else if (strncmp(name, "sort", 4) == 0) {
+    if (editorParseRange(&p, &from, &to, 1) == 0 && p == name)
+      editorSort(from, to, name + 4);
+    else
+      editorSetStatusMessage("Invalid range");
+  } else if (*name == 's' && !isalpha((unsigned char)name[1])) {
+    if (editorParseRange(&p, &from, &to, 0) == 0 && p == name)
+      editorSubstitute(from, to, name + 1);
+    else
+      editorSetStatusMessage("Invalid range");
+  } else if (*name == '\0' && name != command) {
+    if (editorParseRange(&p, &from, &to, 0) == 0 && p == name)
+      editorGotoLine(to);
+    else
+      editorSetStatusMessage("Invalid range");
+  } else if (*name == '!') {
+    if (name != command && editorParseRange(&p, &from, &to, 0) == 0 &&
+        p == name)
+      editorFilter(from, to, name + 1);
+    else
+      editorSetStatusMessage("Usage: [range]!command");
+  } else if ((*name == 'g' || *name == 'v') &&
+             !isalpha((unsigned char)name[1])) {
+    if (editorParseRange(&p, &from, &to, 1) == 0 && p == name)
+      editorGlobal(from, to, name + 1, *name == 'v');
+    else
+      editorSetStatusMessage("Invalid range");
   } else {
-    editorRow *row = &editorConf.row[editorConf.cy];
-    editorInsertRow(editorConf.cy + 1, &row->chars[editorConf.cx],
-                    row->size - editorConf.cx);
-    row = &editorConf.row[editorConf.cy];
-    row->size = editorConf.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    return -1;
   }
-  editorConf.cy++;
-  editorConf.cx = 0;
+  return 0;
 }
 
-void editorDeleteChar() {
-  if (editorConf.cy == editorConf.num_rows)
+/*file i/o*/
+
+int editorWriteAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+/* Write rows [from, to) to fd, each followed by a newline, straight out of
+ * row storage. */
+int editorWriteRows(int fd, int from, int to) {
+  static char newline = '\n';
+  struct iovec iov[ZOR_IOV_MAX];
+
+  while (from < to) {
+    int n = 0;
+    for (; from < to && n + 2 <= ZOR_IOV_MAX; from++) {
+      if (editorConf.row_size[from]) {
+        iov[n].iov_base = editorConf.row[from].chars;
+        iov[n].iov_len = editorConf.row_size[from];
+        n++;
+      }
+      iov[n].iov_base = &newline;
+      iov[n].iov_len = 1;
+      n++;
+    }
+    if (editorWriteAll(fd, iov, n) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+struct editorCodec *editorDetectCodec(int fd, char *filename) {
+  unsigned char magic[4];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  for (unsigned int i = 0; i < CODECS_ENTRIES; i++) {
+    if (n >= CODECS[i].magic_len &&
+        !memcmp(magic, CODECS[i].magic, CODECS[i].magic_len))
+      return &CODECS[i];
+  }
+
+  /* an empty or new file is compressed on save if its name says so */
+  char *ext = strrchr(filename, '.');
+  for (unsigned int i = 0; n <= 0 && ext && i < CODECS_ENTRIES; i++) {
+    if (!strcmp(ext, CODECS[i].ext))
+      return &CODECS[i];
+  }
+  return NULL;
+}
+
+void chunkPushLine(struct loadChunk *c, size_t nl, int tabs) {
+  size_t e = nl;
+  while (e > c->line_start && c->buf[e - 1] == '\r')
+    e--;
+  c->buf[e] = '\0';
+
+  if (c->num_lines == c->lines_cap) {
+    c->lines_cap = c->lines_cap ? c->lines_cap * 2 : 1024;
+    c->lines = realloc(c->lines, sizeof(struct lineSpan) * c->lines_cap);
+    if (c->lines == NULL)
+      die("realloc");
+  }
+  c->lines[c->num_lines].start = c->line_start;
+  c->lines[c->num_lines].size = e - c->line_start;
+  c->lines[c->num_lines].tabs = tabs;
+  c->lines[c->num_lines].cr = nl - e;
+  c->num_lines++;
+  c->line_start = nl + 1;
+}
+
+void *editorScanChunk(void *arg) {
+  struct loadChunk *c = arg;
+  char *buf = c->buf;
+  size_t i = c->begin;
+  int tabs = 0;
+
+  while (c->fd != -1 && i < c->end) {
+    ssize_t n = pread(c->fd, buf + i, c->end - i, c->base + i);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      c->err = n == 0 ? EIO : errno;
+      return NULL;
+    }
+    i += n;
+  }
+
+  i = c->begin;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= c->end; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    unsigned int m_nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned int m_tab = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+    while (m_nl) {
+      unsigned int bit = __builtin_ctz(m_nl);
+      unsigned int before = (1u << bit) - 1;
+      if (m_tab & before)
+        tabs = 1;
+      m_tab &= ~before;
+      chunkPushLine(c, i + bit, tabs);
+      tabs = 0;
+      m_nl &= m_nl - 1;
+    }
+    if (m_tab)
+      tabs = 1;
+  }
+#endif
+  for (; i < c->end; i++) {
+    if (buf[i] == '\n') {
+      chunkPushLine(c, i, tabs);
+      tabs = 0;
+    } else if (buf[i] == '\t') {
+      tabs = 1;
+    }
+  }
+  return NULL;
+}
+
+void *editorFillRows(void *arg) {
+  struct loadChunk *c = arg;
+  for (int j = 0; j < c->num_lines; j++) {
+    int at = c->row + j;
+    editorConf.row[at].chars = c->buf + c->lines[j].start;
+    editorConf.row_cache[at] = 0;
+    editorConf.row_size[at] = c->lines[j].size;
+    editorConf.row_flags[at] = ROW_PACKED |
+                               (c->lines[j].tabs ? ROW_HAS_TABS : 0) |
+                               (c->lines[j].cr == 1 ? ROW_CRLF : 0) |
+                               (c->lines[j].cr == 0 ? ROW_LF : 0);
+  }
+  return NULL;
+}
+
+/* Index buf[0..len) into the batch's slices. Bytes before from are a line
+ * carried over from the previous block; the rest is pread from fd at file
+ * offset base first unless fd is -1. At eof an unterminated last line is
+ * indexed too. Returns where the trailing partial line starts (len when
+ * there is none), or -1 with errno set on a read error. This runs on the
+ * loader thread and must not touch editorConf. */
+ssize_t editorIndexBlock(struct loadBatch *batch, int fd, off_t base,
+                         char *buf, size_t from, size_t len, int eof) {
+  struct loadChunk *chunks = batch->chunks;
+  int n = editorThreadCount();
+  if ((size_t)n > (len - from) / ZOR_LOAD_CHUNK + 1)
+    n = (len - from) / ZOR_LOAD_CHUNK + 1;
+
+  memset(chunks, 0, sizeof(struct loadChunk) * n);
+  for (int i = 0; i < n; i++) {
+    chunks[i].fd = fd;
+    chunks[i].base = base;
+    chunks[i].buf = buf;
+    chunks[i].begin = from + (len - from) / n * i;
+    chunks[i].end = (i == n - 1) ? len : from + (len - from) / n * (i + 1);
+    chunks[i].line_start = chunks[i].begin;
+  }
+  batch->num_chunks = n;
+  editorRunParallel(editorScanChunk, chunks, sizeof(struct loadChunk), n);
+
+  size_t open_start = 0;
+  for (int i = 0; i < n; i++) {
+    struct loadChunk *c = &chunks[i];
+    if (c->err) {
+      errno = c->err;
+      return -1;
+    }
+    if (c->num_lines == 0)
+      continue;
+
+    struct lineSpan *first = &c->lines[0];
+    if (open_start < c->begin) {
+      /* a CRLF or a run of CRs may straddle the slice boundary */
+      size_t e = first->start + first->size;
+      size_t nl = e + first->cr;
+      if (e == c->begin) {
+        while (e > open_start && buf[e - 1] == '\r')
+          e--;
+        buf[e] = '\0';
+      }
+      first->cr = nl - e;
+      if (!first->tabs)
+        first->tabs = memchr(buf + open_start, '\t', c->begin - open_start) !=
+                      NULL;
+      first->start = open_start;
+      first->size = e - open_start;
+    }
+    open_start = c->line_start;
+  }
+
+  if (eof && open_start < len) {
+    struct loadChunk *c = &chunks[n - 1];
+    c->line_start = open_start;
+    chunkPushLine(c, len, memchr(buf + open_start, '\t', len - open_start) !=
+                              NULL);
+    c->lines[c->num_lines - 1].cr = -1;
+    open_start = len;
+    batch->partial = 1;
+  }
+  return open_start;
+}
+
+void editorLoaderPublish(struct editorLoader *l, struct loadBatch *batch) {
+  pthread_mutex_lock(&l->lock);
+  *l->tail = batch;
+  l->tail = &batch->next;
+  pthread_mutex_unlock(&l->lock);
+  write(l->wake[1], "", 1);
+}
+
+/* Loader thread: read the file a block at a time, starting small so the
+ * first screen shows up at once, and hand each indexed block over to the
+ * main thread. A line cut off at the end of a block is copied to the start
+ * of the next one. */
+void *editorLoaderMain(void *arg) {
+  struct editorLoader *l = arg;
+  size_t want = ZOR_FIRST_BLOCK;
+  char *carry = NULL;
+  size_t carry_len = 0;
+  off_t off = 0;
+
+  while (1) {
+    pthread_mutex_lock(&l->lock);
+    int cancel = l->cancel;
+    pthread_mutex_unlock(&l->lock);
+
+    struct loadBatch *batch = calloc(1, sizeof(struct loadBatch));
+    if (batch == NULL)
+      die("calloc");
+    if (cancel) {
+      batch->last = 1;
+      editorLoaderPublish(l, batch);
+      break;
+    }
+
+    size_t n = want;
+    if (l->seekable && (size_t)off + n > l->size)
+      n = l->size - off;
+    struct arenaBlock *b =
+        malloc(sizeof(struct arenaBlock) + carry_len + n + 1);
+    if (b == NULL)
+      die("malloc");
+    b->size = carry_len + n + 1;
+    char *buf = (char *)(b + 1);
+    if (carry_len)
+      memcpy(buf, carry, carry_len);
+
+    size_t len = carry_len;
+    int eof = 0;
+    int fd = -1;
+    if (l->seekable) {
+      fd = l->fd;
+      len += n;
+      eof = (size_t)off + n == l->size;
+    } else {
+      /* a pipe hands over whatever one read returns so slow writers show up
+       * line by line */
+      ssize_t r;
+      while ((r = read(l->fd, buf + len, n)) == -1 && errno == EINTR)
+        ;
+      if (r == -1)
+        batch->err = errno;
+      if (r <= 0)
+        eof = 1;
+      else
+        len += r;
+    }
+
+    batch->on_disk = l->seekable;
+    batch->base = off - carry_len;
+    ssize_t tail = batch->err ? -1
+                              : editorIndexBlock(batch, fd, off - carry_len,
+                                                 buf, carry_len, len, eof);
+    if (tail == -1) {
+      if (!batch->err)
+        batch->err = errno;
+      for (int i = 0; i < batch->num_chunks; i++)
+        free(batch->chunks[i].lines);
+      batch->num_chunks = 0;
+      eof = 1;
+      tail = len;
+    }
+    off += len - carry_len;
+
+    /* the unfinished line moves to the next block; the copy left behind in
+     * this one is never referenced by a row */
+    free(carry);
+    carry_len = len - tail;
+    carry = malloc(carry_len ? carry_len : 1);
+    memcpy(carry, buf + tail, carry_len);
+
+    batch->block = b;
+    batch->bytes = off;
+    batch->last = eof;
+    editorLoaderPublish(l, batch);
+    if (eof)
+      break;
+    if (want < ZOR_STREAM_BLOCK)
+      want *= 16;
+  }
+  free(carry);
+  return NULL;
+}
+
+void editorFillBatch(struct loadBatch *batch) {
+  int total = editorConf.num_rows;
+  for (int i = 0; i < batch->num_chunks; i++) {
+    batch->chunks[i].row = total;
+    total += batch->chunks[i].num_lines;
+  }
+
+  if (total > editorConf.row_cap) {
+    /* size the row arrays for the whole file from the density so far */
+    long long guess = total;
+    if (editorConf.loader && editorConf.loader->seekable && batch->bytes)
+      guess = (long long)total * editorConf.loader->size / batch->bytes + 1;
+    if (guess > INT_MAX)
+      guess = INT_MAX;
+    if (guess < total + total / 8)
+      editorRowsReserve(total);
+    else
+      editorRowsResize(guess);
+  }
+  editorRunParallel(editorFillRows, batch->chunks, sizeof(struct loadChunk),
+                    batch->num_chunks);
+  editorIndexDirty(editorConf.num_rows);
+  editorConf.num_rows = total;
+
+  for (int i = 0; i < batch->num_chunks; i++)
+    free(batch->chunks[i].lines);
+  if (batch->block) {
+    arenaAdopt(editorConf.arena, batch->block, MEM_TEXT);
+    if (batch->on_disk)
+      editorDiskAdd((char *)(batch->block + 1), batch->block->size,
+                    batch->base);
+  }
+  editorConf.load_bytes = batch->bytes;
+  editorConf.load_partial = batch->partial;
+}
+
+void editorFollowStart();
+
+void editorLoaderFinish() {
+  struct editorLoader *l = editorConf.loader;
+  pthread_join(l->thread, NULL);
+  editorUnwatchFd(l->wake[0]);
+  close(l->wake[0]);
+  close(l->wake[1]);
+  close(l->fd);
+  if (l->child && editorReap(l->child) == -1 && !l->cancel)
+    editorSetStatusMessage("Can't read %s: %s failed", editorConf.filename,
+                           editorConf.codec->name);
+  pthread_mutex_destroy(&l->lock);
+  free(l);
+  editorConf.loader = NULL;
+  if (editorConf.follow)
+    editorFollowStart();
+}
+
+/* Turn every block the loader has published so far into rows. */
+void editorLoaderDrain(int fd) {
+  struct editorLoader *l = editorConf.loader;
+  char tmp[64];
+  while (read(fd, tmp, sizeof(tmp)) > 0)
+    ;
+
+  pthread_mutex_lock(&l->lock);
+  struct loadBatch *batch = l->head;
+  l->head = NULL;
+  l->tail = &l->head;
+  pthread_mutex_unlock(&l->lock);
+
+  int last = 0;
+  while (batch) {
+    struct loadBatch *next = batch->next;
+    if (!l->cancel) {
+      editorFillBatch(batch);
+    } else {
+      for (int i = 0; i < batch->num_chunks; i++)
+        free(batch->chunks[i].lines);
+      free(batch->block);
+    }
+    if (batch->err)
+      editorSetStatusMessage("Can't read %s: %s", editorConf.filename,
+                             strerror(batch->err));
+    last |= batch->last;
+    free(batch);
+    batch = next;
+  }
+  if (last)
+    editorLoaderFinish();
+}
+
+/* Wait until row n exists or the whole file is in, draining only as many
+ * blocks as that takes. */
+void editorWaitRows(int n) {
+  while (editorConf.loader && editorConf.num_rows < n) {
+    struct pollfd pfd = {editorConf.loader->wake[0], POLLIN, 0};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+      die("poll");
+    editorLoaderDrain(pfd.fd);
+  }
+}
+
+void editorLoaderStop() {
+  if (editorConf.loader == NULL)
     return;
-  if (editorConf.cx == 0 && editorConf.cy == 0)
+  pthread_mutex_lock(&editorConf.loader->lock);
+  editorConf.loader->cancel = 1;
+  pthread_mutex_unlock(&editorConf.loader->lock);
+  if (editorConf.loader->child)
+    kill(editorConf.loader->child, SIGTERM);
+  editorWaitRows(INT_MAX);
+}
+
+/*follow*/
+
+/* Whether the file holds s[0..len) at off. */
+int editorFollowSame(int fd, off_t off, const char *s, size_t len) {
+  char buf[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    if (pread(fd, buf, n, off) != (ssize_t)n || memcmp(buf, s, n))
+      return 0;
+    off += n;
+    s += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Append whatever the followed file gained since the last read. A last row
+ * without a newline is read again with the new bytes so those that finish
+ * it land on the same row, unless it was edited: then it is left alone and
+ * the new bytes start a row of their own. A file cut short is read again
+ * from the start, as tail -f does; edits are kept, with a row marking
+ * where the file started over. */
+void editorFollowRead() {
+  struct editorFollow *f = editorConf.follower;
+  struct stat st;
+  if (fstat(f->fd, &st) == -1)
     return;
-  editorRow *row = &editorConf.row[editorConf.cy];
-  if (editorConf.cx > 0) {
-    editorRowDeleteChar(row, editorConf.cx - 1);
-    editorConf.cx--;
-  } else {
-    editorConf.cx = editorConf.row[editorConf.cy - 1].size;
-    editorRowAppendString(&editorConf.row[editorConf.cy - 1], row->chars,
-                          row->size);
-    editorDeleteRow(editorConf.cy);
-    editorConf.cy--;
+
+  if (st.st_size < f->off) {
+    editorSetStatusMessage("%s: file truncated", editorConf.filename);
+    f->off = 0;
+    editorConf.load_partial = 0;
+    if (editorConf.dirty) {
+      /* the rows already in are not the file's bytes any more */
+      editorDiskReset();
+      char mark[] = "-- file truncated --";
+      editorInsertRow(editorConf.num_rows, mark, sizeof(mark) - 1);
+    } else {
+      editorFreeRows();
+      editorIndexReset();
+      editorDiskStamp(&st);
+      editorConf.cy = editorConf.cx = 0;
+      editorConf.row_off = 0;
+    }
+  }
+  if (st.st_size == f->off)
+    return;
+
+  int last = editorConf.num_rows - 1;
+  int carry_row = editorConf.load_partial && last >= 0;
+  size_t carry_len = carry_row ? editorConf.row_size[last] : 0;
+  if (carry_row && !editorFollowSame(f->fd, f->off - carry_len,
+                                     editorConf.row[last].chars, carry_len)) {
+    carry_row = 0;
+    carry_len = 0;
+  }
+  size_t n = st.st_size - f->off;
+  int at_end = editorConf.cy >= last;
+
+  struct loadBatch *batch = calloc(1, sizeof(struct loadBatch));
+  struct arenaBlock *b = malloc(sizeof(struct arenaBlock) + carry_len + n + 1);
+  if (batch == NULL || b == NULL)
+    die("malloc");
+  b->size = carry_len + n + 1;
+  char *buf = (char *)(b + 1);
+
+  if (editorIndexBlock(batch, f->fd, f->off - carry_len, buf, 0,
+                       carry_len + n, 1) == -1) {
+    editorSetStatusMessage("Can't read %s: %s", editorConf.filename,
+                           strerror(errno));
+    for (int i = 0; i < batch->num_chunks; i++)
+      free(batch->chunks[i].lines);
+    free(batch);
+    free(b);
+    return;
+  }
+
+  if (carry_row) {
+    struct editorHunk h = {.at = last, .del = 1, .ins = 0};
+    editorFreeRow(last);
+    if (last < editorConf.hl_state_rows)
+      editorConf.hl_state_rows = last;
+    editorRowsShifted(&h, 1);
+    editorConf.num_rows--;
+  }
+  batch->on_disk = 1;
+  batch->base = f->off - carry_len;
+  f->off = st.st_size;
+  batch->block = b;
+  batch->bytes = f->off;
+  editorFillBatch(batch);
+  free(batch);
+  /* the rows now reach the end of the file as it is */
+  if (editorConf.disk.valid)
+    editorDiskStamp(&st);
+
+  if (at_end && editorConf.num_rows > 0) {
+    editorConf.cy = editorConf.num_rows - 1;
+    editorConf.cx = 0;
   }
 }
 
-/*file i/o*/
+/* Switch to whatever file now has our name, after a rotation. */
+void editorFollowReopen() {
+  struct editorFollow *f = editorConf.follower;
+  struct stat old, st;
+  int fd = open(editorConf.filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  if (fstat(fd, &st) == -1 || (fstat(f->fd, &old) == 0 &&
+                               old.st_ino == st.st_ino &&
+                               old.st_dev == st.st_dev)) {
+    close(fd);
+    return;
+  }
 
-char *editorRowsToString(int *buflen) {
-  int totalLen = 0;
-  int j;
-  for (j = 0; j < editorConf.num_rows; j++) {
-    totalLen += editorConf.row[j].size + 1;
+  /* pick up the tail of the old file before letting go of it */
+  editorFollowRead();
+  close(f->fd);
+  if (f->wd != -1)
+    inotify_rm_watch(f->inotify, f->wd);
+  f->fd = fd;
+  f->off = 0;
+  editorDiskReset();
+  f->wd = inotify_add_watch(f->inotify, editorConf.filename,
+                            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                IN_DELETE_SELF);
+  editorConf.load_partial = 0;
+  editorSetStatusMessage("%s: file rotated", editorConf.filename);
+}
+
+void editorFollowEvent(int fd) {
+  struct editorFollow *f = editorConf.follower;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int rotated = 0;
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->wd == f->wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)))
+        rotated = 1;
+      if (ev->wd == f->dir_wd && ev->len && !strcmp(ev->name, f->base))
+        rotated = 1;
+      if (ev->mask & IN_IGNORED && ev->wd == f->wd)
+        f->wd = -1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
   }
-  buflen[0] = totalLen;
 
-  char *buf = malloc(totalLen);
-  char *p = buf;
-  for (j = 0; j < editorConf.num_rows; j++) {
-    memcpy(p, editorConf.row[j].chars, editorConf.row[j].size);
-    p += editorConf.row[j].size;
-    *p = '\n';
-    p++;
+  editorFollowRead();
+  if (rotated)
+    editorFollowReopen();
+  editorFollowRead();
+}
+
+void editorFollowStart() {
+  editorConf.follow = 1;
+  if (editorConf.follower || editorConf.loader || !editorConf.filename)
+    return;
+
+  struct editorFollow *f = calloc(1, sizeof(struct editorFollow));
+  struct stat st;
+  if (f == NULL)
+    die("calloc");
+  f->fd = open(editorConf.filename, O_RDONLY | O_CLOEXEC);
+  if (f->fd == -1 || fstat(f->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      editorConf.codec) {
+    editorSetStatusMessage("Can't follow %s", editorConf.filename);
+    if (f->fd != -1)
+      close(f->fd);
+    free(f);
+    editorConf.follow = 0;
+    return;
   }
-  return buf;
+
+  f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->inotify == -1)
+    die("inotify_init1");
+  f->wd = inotify_add_watch(f->inotify, editorConf.filename,
+                            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                IN_DELETE_SELF);
+
+  /* a rotated log reappears under the same name, so watch the directory */
+  char *slash = strrchr(editorConf.filename, '/');
+  f->base = slash ? slash + 1 : editorConf.filename;
+  int dir_len = slash ? slash - editorConf.filename : 0;
+  char *dir = slash ? strndup(editorConf.filename, dir_len ? dir_len : 1)
+                    : strdup(".");
+  f->dir_wd = inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+  free(dir);
+
+  f->off = editorConf.load_bytes;
+  editorConf.follower = f;
+  editorWatchFd(f->inotify, POLLIN, editorFollowEvent);
+  editorFollowRead();
+  editorSetStatusMessage("Following %s", editorConf.filename);
+}
+
+void editorFollowStop() {
+  struct editorFollow *f = editorConf.follower;
+  editorConf.follow = 0;
+  if (f == NULL)
+    return;
+  editorUnwatchFd(f->inotify);
+  close(f->inotify);
+  close(f->fd);
+  free(f);
+  editorConf.follower = NULL;
+}
+
+/*filter*/
+
+void editorFilterCollect(struct editorFilter *f, int eof) {
+  char *buf = (char *)(f->cur + 1);
+  ssize_t tail = editorIndexBlock(f->batch, -1, 0, buf, f->carry_len,
+                                  f->cur_len, eof);
+  for (int i = 0; i < f->batch->num_chunks; i++) {
+    struct loadChunk *c = &f->batch->chunks[i];
+    for (int j = 0; j < c->num_lines; j++) {
+      if (f->num_lines == f->lines_cap) {
+        f->lines_cap = f->lines_cap ? f->lines_cap * 2 : 1024;
+        f->lines =
+            realloc(f->lines, sizeof(struct editorLine) * f->lines_cap);
+        if (f->lines == NULL)
+          die("realloc");
+      }
+      struct editorLine *l = &f->lines[f->num_lines++];
+      l->chars = buf + c->lines[j].start;
+      l->size = c->lines[j].size;
+      l->flags = ROW_PACKED;
+    }
+    free(c->lines);
+  }
+  if (eof)
+    return;
+
+  /* start the next block with the line that is still open */
+  size_t carry = f->cur_len - tail;
+  size_t size = f->cur->size * 16;
+  if (size > ZOR_STREAM_BLOCK)
+    size = ZOR_STREAM_BLOCK;
+  if (size < carry * 2)
+    size = carry * 2;
+  struct arenaBlock *b = malloc(sizeof(struct arenaBlock) + size + 1);
+  if (b == NULL)
+    die("malloc");
+  b->size = size;
+  memcpy(b + 1, buf + tail, carry);
+  f->cur->next = f->blocks;
+  f->blocks = f->cur;
+  f->cur = b;
+  f->cur_len = carry;
+  f->carry_len = carry;
+}
+
+void editorFilterRead(int fd) {
+  struct editorFilter *f = editorConf.filter;
+  while (1) {
+    if (f->cur_len == f->cur->size)
+      editorFilterCollect(f, 0);
+    ssize_t n = read(fd, (char *)(f->cur + 1) + f->cur_len,
+                     f->cur->size - f->cur_len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      break;
+    if (n <= 0) {
+      editorFilterCollect(f, 1);
+      f->cur->next = f->blocks;
+      f->blocks = f->cur;
+      f->cur = NULL;
+      editorUnwatchFd(fd);
+      close(fd);
+      f->out = -1;
+      f->running = 0;
+      return;
+    }
+    f->cur_len += n;
+    f->bytes_out += n;
+  }
+  editorSetStatusMessage("Filtering: %d of %d lines sent, %zu bytes back "
+                         "(Ctrl-C cancels)",
+                         f->next - f->from, f->to - f->from + 1, f->bytes_out);
+}
+
+void editorFilterCloseInput(struct editorFilter *f) {
+  if (f->in == -1)
+    return;
+  editorUnwatchFd(f->in);
+  close(f->in);
+  f->in = -1;
+}
+
+/* Feed the next rows to the child straight from the row text. vmsplice
+ * maps the pages into the pipe instead of copying them; the rows are not
+ * touched until the child is done, so that is safe. */
+void editorFilterWrite(int fd) {
+  struct editorFilter *f = editorConf.filter;
+  static char newline[] = "\n";
+  while (f->next <= f->to) {
+    struct iovec iov[ZOR_IOV_MAX];
+    int n = 0;
+    for (int at = f->next; at <= f->to && n + 2 <= ZOR_IOV_MAX; at++) {
+      iov[n].iov_base = editorConf.row[at].chars;
+      iov[n].iov_len = editorConf.row_size[at];
+      n++;
+      iov[n].iov_base = newline;
+      iov[n].iov_len = 1;
+      n++;
+    }
+    /* skip what an earlier short write already sent */
+    int first = 0;
+    size_t skip = f->next_off;
+    while (skip >= iov[first].iov_len) {
+      skip -= iov[first].iov_len;
+      first++;
+    }
+    iov[first].iov_base = (char *)iov[first].iov_base + skip;
+    iov[first].iov_len -= skip;
+
+    ssize_t w;
+    if (f->use_vmsplice) {
+      w = vmsplice(fd, &iov[first], n - first, SPLICE_F_NONBLOCK);
+      if (w == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        f->use_vmsplice = 0;
+        continue;
+      }
+    } else {
+      w = writev(fd, &iov[first], n - first);
+    }
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w == -1 && errno == EAGAIN)
+      return;
+    if (w == -1) {
+      /* the child stopped reading; whatever it printed still counts */
+      break;
+    }
+
+    size_t done = f->next_off + w;
+    while (f->next <= f->to &&
+           done >= (size_t)editorConf.row_size[f->next] + 1) {
+      done -= editorConf.row_size[f->next] + 1;
+      f->next++;
+    }
+    f->next_off = done;
+  }
+  editorFilterCloseInput(f);
+}
+
+void editorFilterFree(struct editorFilter *f) {
+  while (f->blocks) {
+    struct arenaBlock *next = f->blocks->next;
+    free(f->blocks);
+    f->blocks = next;
+  }
+  free(f->cur);
+  free(f->lines);
+  free(f->batch);
+  free(f);
+  editorConf.filter = NULL;
+}
+
+/* :[range]!cmd. The rows go to cmd's stdin and its stdout is read back
+ * at the same time from the event loop; when it is done the output
+ * replaces the rows as one undo step. Ctrl-C kills it and leaves the
+ * buffer alone. */
+void editorFilter(int from, int to, char *cmd) {
+  while (*cmd == ' ')
+    cmd++;
+  if (*cmd == '\0') {
+    editorSetStatusMessage("Usage: [range]!command");
+    return;
+  }
+  if (from > to)
+    return;
+
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) == -1)
+    goto fail;
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    close(in[0]);
+    close(in[1]);
+    goto fail;
+  }
+  fcntl(in[1], F_SETPIPE_SZ, 1 << 20);
+  fcntl(out[0], F_SETPIPE_SZ, 1 << 20);
+  char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+  pid_t pid = editorSpawn(argv, in[0], out[1]);
+  close(in[0]);
+  close(out[1]);
+  if (pid == -1) {
+    close(in[1]);
+    close(out[0]);
+    goto fail;
+  }
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+  struct editorFilter *f = calloc(1, sizeof(struct editorFilter));
+  if (f == NULL)
+    die("calloc");
+  f->batch = calloc(1, sizeof(struct loadBatch));
+  f->cur = malloc(sizeof(struct arenaBlock) + ZOR_FIRST_BLOCK + 1);
+  if (f->batch == NULL || f->cur == NULL)
+    die("malloc");
+  f->cur->size = ZOR_FIRST_BLOCK;
+  f->pid = pid;
+  f->in = in[1];
+  f->out = out[0];
+  f->from = from;
+  f->to = to;
+  f->next = from;
+  f->use_vmsplice = 1;
+  f->running = 1;
+  editorConf.filter = f;
+  editorWatchFd(f->in, POLLOUT, editorFilterWrite);
+  editorWatchFd(f->out, POLLIN, editorFilterRead);
+
+  int cancelled = 0;
+  while (f->running) {
+    if (editorPollEvents() && editorReadKey() == CTRL_KEY('c')) {
+      cancelled = 1;
+      kill(pid, SIGTERM);
+      break;
+    }
+  }
+  editorFilterCloseInput(f);
+  if (f->out != -1) {
+    editorUnwatchFd(f->out);
+    close(f->out);
+  }
+  int status = editorReap(pid);
+
+  if (cancelled || (status == -1 && f->num_lines == 0)) {
+    editorSetStatusMessage(cancelled ? "Filter cancelled"
+                                     : "%s failed, buffer unchanged",
+                           cmd);
+    editorFilterFree(f);
+    return;
+  }
+
+  /* the lines point into the output blocks, which now join the arena */
+  while (f->blocks) {
+    struct arenaBlock *next = f->blocks->next;
+    arenaAdopt(editorConf.arena, f->blocks, MEM_TEXT);
+    f->blocks = next;
+  }
+  struct editorStep step = {0};
+  step.num_hunks = 1;
+  step.hunks = malloc(sizeof(struct editorHunk));
+  if (step.hunks == NULL)
+    die("malloc");
+  step.hunks[0].at = from;
+  step.hunks[0].del = to - from + 1;
+  step.hunks[0].ins = f->num_lines;
+  step.hunks[0].lines = f->lines;
+  f->lines = NULL;
+  int num_lines = f->num_lines;
+  editorFilterFree(f);
+
+  editorUndoPush(editorUndoOpen(), editorSpliceRows(step));
+  editorConf.cy = from < editorConf.num_rows ? from : editorConf.num_rows;
+  editorConf.cx = 0;
+  editorSetStatusMessage("%d line%s filtered into %d", to - from + 1,
+                         to - from ? "s" : "", num_lines);
+  return;
+
+fail:
+  editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+}
+
+/* An in-place save first puts what it will write in a journal next to
+ * the file: ZOR_JOURNAL_MAGIC and the file's device, inode, size and
+ * mtime, then for each extent its offset, length and how many bytes of
+ * the file it covers as 64-bit numbers, its bytes and the ones it covers,
+ * then an offset of -1 with the new file length and an FNV-1a sum of all
+ * before it. Only once that is on disk is the file touched, so a journal
+ * found on open is replayed if it is complete and the file is as it was
+ * or part way to the new one, and dropped otherwise. */
+char *editorJournalName(const char *filename) {
+  char *name = malloc(strlen(filename) + 13);
+  if (name == NULL)
+    die("malloc");
+  sprintf(name, "%s.zor-journal", filename);
+  return name;
+}
+
+unsigned long long editorJournalSum(unsigned long long h, const void *p,
+                                    size_t len) {
+  const unsigned char *s = p;
+  for (size_t i = 0; i < len; i++) {
+    h ^= s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+/* Make a new entry in the directory of path durable. */
+void editorSyncDir(const char *path) {
+  char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+  if (dir == NULL)
+    die("strdup");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/* Copy len bytes from offset from of in to offset to of out, adding them
+ * to *sum; with out -1 they are only summed. */
+int editorJournalCopy(int in, off_t from, int out, off_t to, uint64_t len,
+                      unsigned long long *sum) {
+  char buf[1 << 16];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    ssize_t r = pread(in, buf, n, from);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    *sum = editorJournalSum(*sum, buf, r);
+    for (ssize_t w = 0; out != -1 && w < r;) {
+      ssize_t k = pwrite(out, buf + w, r - w, to + w);
+      if (k == -1 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        return -1;
+      w += k;
+    }
+    from += r;
+    to += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Journal the extents of an in-place save to name. The file is open in
+ * in, and st is how it stands before the save. */
+int editorJournalWrite(const char *name, int in, struct stat *st,
+                       struct saveExtent *ext, int n, long long len) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return -1;
+  unsigned long long sum = 14695981039346656037ull;
+  uint64_t stamp[5] = {st->st_dev, st->st_ino, st->st_size,
+                       st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+  sum = editorJournalSum(sum, stamp, sizeof(stamp));
+  struct iovec iov[2] = {{ZOR_JOURNAL_MAGIC, 8}, {stamp, sizeof(stamp)}};
+  int ok = editorWriteAll(fd, iov, 2) == 0;
+  off_t pos = 8 + sizeof(stamp);
+  for (int i = 0; ok && i < n; i++) {
+    uint64_t old = ext[i].off >= st->st_size ? 0
+                   : ext[i].len < st->st_size - ext[i].off
+                       ? ext[i].len
+                       : st->st_size - ext[i].off;
+    uint64_t head[3] = {ext[i].off, ext[i].len, old};
+    sum = editorJournalSum(sum, head, sizeof(head));
+    for (int r = ext[i].from; r < ext[i].to; r++) {
+      sum = editorJournalSum(sum, editorConf.row[r].chars,
+                             editorConf.row_size[r]);
+      sum = editorJournalSum(sum, "\n", 1);
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    pos += sizeof(head) + ext[i].len;
+    ok = editorWriteAll(fd, iov, 1) == 0 &&
+         editorWriteRows(fd, ext[i].from, ext[i].to) == 0 &&
+         editorJournalCopy(in, ext[i].off, fd, pos, old, &sum) == 0 &&
+         lseek(fd, pos + old, SEEK_SET) != -1;
+    pos += old;
+  }
+  uint64_t tail[3] = {UINT64_MAX, len, sum};
+  iov[0].iov_base = tail;
+  iov[0].iov_len = sizeof(tail);
+  ok = ok && editorWriteAll(fd, iov, 1) == 0 && fsync(fd) == 0;
+  int saved = errno;
+  close(fd);
+  if (!ok) {
+    unlink(name);
+    errno = saved;
+    return -1;
+  }
+  editorSyncDir(name);
+  return 0;
+}
+
+/* Walk the journal in jfd: with fd -1 check that it is complete and adds
+ * up, otherwise apply it to fd. Returns the new file length, or -1 if it
+ * is cut short or does not add up. */
+long long editorJournalReplay(int jfd, int fd) {
+  struct stat st;
+  char magic[8];
+  uint64_t stamp[5];
+  errno = EIO;
+  if (fstat(jfd, &st) == -1 || pread(jfd, magic, 8, 0) != 8 ||
+      memcmp(magic, ZOR_JOURNAL_MAGIC, 8) != 0 ||
+      pread(jfd, stamp, sizeof(stamp), 8) != sizeof(stamp))
+    return -1;
+  unsigned long long sum = 14695981039346656037ull;
+  sum = editorJournalSum(sum, stamp, sizeof(stamp));
+  off_t pos = 8 + sizeof(stamp);
+  while (pos + 24 <= st.st_size) {
+    uint64_t head[3];
+    if (pread(jfd, head, 24, pos) != 24)
+      return -1;
+    if (head[0] == UINT64_MAX) {
+      if (head[2] != sum)
+        return -1;
+      if (fd != -1 && ftruncate(fd, head[1]) == -1)
+        return -1;
+      return head[1];
+    }
+    sum = editorJournalSum(sum, head, 24);
+    if (head[1] > (uint64_t)(st.st_size - pos - 24) ||
+        head[2] > (uint64_t)(st.st_size - pos - 24) - head[1] ||
+        editorJournalCopy(jfd, pos + 24, fd, head[0], head[1], &sum) == -1 ||
+        editorJournalCopy(jfd, pos + 24 + head[1], -1, 0, head[2], &sum) ==
+            -1)
+      return -1;
+    pos += 24 + head[1] + head[2];
+  }
+  return -1;
+}
+
+/* How the file in fd stands to the complete journal in jfd, which makes
+ * it len bytes long: 1 if it is as it was or part way there, so the
+ * journal is to be replayed, 0 if it is already there, -1 if it was
+ * changed some other way since, and -2 with errno set on a read error. */
+int editorJournalCheck(int jfd, int fd, uint64_t len) {
+  struct stat st;
+  uint64_t stamp[5];
+  if (fstat(fd, &st) == -1 ||
+      pread(jfd, stamp, sizeof(stamp), 8) != sizeof(stamp))
+    return -2;
+  if (stamp[0] != (uint64_t)st.st_dev || stamp[1] != (uint64_t)st.st_ino)
+    return -1;
+  if (stamp[2] == (uint64_t)st.st_size &&
+      stamp[3] == (uint64_t)st.st_mtim.tv_sec &&
+      stamp[4] == (uint64_t)st.st_mtim.tv_nsec)
+    return 1;
+
+  /* the save got cut short or went through: every byte an extent covers
+   * holds either what it had or what the journal puts there */
+  uint64_t size = st.st_size;
+  if (size < (stamp[2] < len ? stamp[2] : len) ||
+      size > (stamp[2] > len ? stamp[2] : len))
+    return -1;
+  int done = size == len;
+  off_t pos = 8 + sizeof(stamp);
+  for (;;) {
+    uint64_t head[3];
+    if (pread(jfd, head, 24, pos) != 24)
+      return -2;
+    if (head[0] == UINT64_MAX)
+      return done ? 0 : 1;
+    pos += 24;
+    for (uint64_t i = 0; i < head[1];) {
+      unsigned char cur[4096], now[4096], was[4096];
+      size_t n = head[1] - i < sizeof(cur) ? head[1] - i : sizeof(cur);
+      size_t old = head[2] <= i ? 0 : head[2] - i < n ? head[2] - i : n;
+      ssize_t got = pread(fd, cur, n, head[0] + i);
+      if (got == -1 || pread(jfd, now, n, pos + i) != (ssize_t)n ||
+          pread(jfd, was, old, pos + head[1] + i) != (ssize_t)old)
+        return -2;
+      if ((size_t)got < n)
+        done = 0;
+      for (ssize_t k = 0; k < got; k++) {
+        if (cur[k] == now[k])
+          continue;
+        if ((size_t)k >= old || cur[k] != was[k])
+          return -1;
+        done = 0;
+      }
+      i += n;
+    }
+    pos += head[1] + head[2];
+  }
+}
+
+/* Finish an in-place save of filename that was cut short, or drop its
+ * journal if it never got far enough to be needed, if the save went
+ * through, or if the file was changed some other way since. */
+void editorJournalRecover(const char *filename) {
+  char *name = editorJournalName(filename);
+  int jfd = open(name, O_RDONLY | O_CLOEXEC);
+  if (jfd == -1) {
+    free(name);
+    return;
+  }
+  long long len = editorJournalReplay(jfd, -1);
+  if (len != -1) {
+    int fd = open(filename, O_RDWR | O_CLOEXEC);
+    int state = fd == -1 ? -2 : editorJournalCheck(jfd, fd, len);
+    if (state == -2 || (state == 1 && (editorJournalReplay(jfd, fd) == -1 ||
+                                       fsync(fd) == -1))) {
+      /* keep the journal for another try */
+      editorSetStatusMessage("Can't finish interrupted save of %s: %s",
+                             filename, strerror(errno));
+      if (fd != -1)
+        close(fd);
+      close(jfd);
+      free(name);
+      return;
+    }
+    close(fd);
+    if (state == 1)
+      editorSetStatusMessage("Finished interrupted save of %s", filename);
+    else if (state == -1)
+      editorSetStatusMessage("Dropped the journal of %s: the file changed "
+                             "since",
+                             filename);
+  }
+  close(jfd);
+  unlink(name);
+  free(name);
+}
+
+/* A save that did not go through the journal leaves any there stale. */
+void editorJournalDrop(const char *filename) {
+  char *name = editorJournalName(filename);
+  unlink(name);
+  free(name);
+}
+
+/* Save by writing only the rows that are not already where the file has
+ * them, through the journal. Returns 1 when the file is not as it was
+ * read or too much of it changed, for a full rewrite instead; otherwise 0
+ * with *written set, or -1 with errno set. */
+int editorSaveInPlace(long long len, long long *written) {
+  struct editorDisk *d = &editorConf.disk;
+  if (editorConf.codec || !d->valid || d->num_ext == 0)
+    return 1;
+  int fd = open(editorConf.filename, O_RDWR | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !editorDiskSame(&st)) {
+    if (fd != -1)
+      close(fd);
+    return 1;
+  }
+
+  struct saveExtent *ext = NULL;
+  int n = 0, cap = 0, hint = 0;
+  long long off = 0, changed = 0;
+  off_t moved = d->moved;
+  for (int i = 0; i < editorConf.num_rows; i++) {
+    long long size = editorConf.row_size[i] + 1;
+    off_t o = editorDiskOrigin(i, &hint);
+    if (o == off && (editorConf.row_flags[i] & ROW_LF)) {
+      off += size;
+      continue;
+    }
+    if (o != -1 && o < moved)
+      moved = o;
+    if (n && ext[n - 1].to == i) {
+      ext[n - 1].to++;
+      ext[n - 1].len += size;
+    } else {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 16;
+        ext = realloc(ext, sizeof(struct saveExtent) * cap);
+        if (ext == NULL)
+          die("realloc");
+      }
+      ext[n].off = off;
+      ext[n].len = size;
+      ext[n].from = i;
+      ext[n].to = i + 1;
+      n++;
+    }
+    changed += size;
+    off += size;
+  }
+  if (changed * ZOR_INPLACE_SHARE > len) {
+    free(ext);
+    close(fd);
+    return 1;
+  }
+
+  char *journal = editorJournalName(editorConf.filename);
+  int ret = -1;
+  if (editorJournalWrite(journal, fd, &st, ext, n, len) == 0) {
+    int ok = 1;
+    for (int i = 0; ok && i < n; i++)
+      ok = lseek(fd, ext[i].off, SEEK_SET) != -1 &&
+           editorWriteRows(fd, ext[i].from, ext[i].to) == 0;
+    if (ok && ftruncate(fd, len) == 0 && fsync(fd) == 0) {
+      unlink(journal);
+      /* rows that now sit elsewhere in the file were read from moved on */
+      d->moved = moved;
+      for (int i = 0; i < n; i++)
+        editorDiskCut(ext[i].off, ext[i].off + ext[i].len);
+      editorDiskCut(len, (off_t)LLONG_MAX);
+      if (fstat(fd, &st) == 0)
+        editorDiskStamp(&st);
+      *written = changed;
+      ret = 0;
+    }
+  }
+  int saved = errno;
+  free(journal);
+  free(ext);
+  close(fd);
+  errno = saved;
+  return ret;
 }
 
 void editorOpen(char *filename) {
+  editorLoaderStop();
+  editorFollowStop();
+  editorFreeRows();
   free(editorConf.filename);
   editorConf.filename = strdup(filename);
 
   editorSelectSyntaxHighlight();
+  editorIndexReset();
+
+  editorJournalRecover(filename);
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      editorSetStatusMessage("\"%s\" [New]", filename);
+    else
+      editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+  struct editorLoader *l = calloc(1, sizeof(struct editorLoader));
+  struct stat st;
+  if (l == NULL || pipe2(l->wake, O_NONBLOCK | O_CLOEXEC) == -1)
+    die("pipe");
+  l->tail = &l->head;
+
+  /* compressed files are read through the codec's decompressor and indexed
+   * as a stream, like a pipe */
+  editorConf.codec = editorDetectCodec(fd, filename);
+  if (editorConf.codec) {
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) == -1)
+      die("pipe");
+    l->child = editorSpawn(editorConf.codec->decompress, fd, out[1]);
+    if (l->child == -1)
+      die("fork");
+    close(out[1]);
+    close(fd);
+    fd = out[0];
+  }
+  l->fd = fd;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    l->seekable = 1;
+    l->size = st.st_size;
+    editorDiskStamp(&st);
+  }
+  pthread_mutex_init(&l->lock, NULL);
+  editorConf.loader = l;
+  editorConf.load_bytes = 0;
+  if (pthread_create(&l->thread, NULL, editorLoaderMain, l) != 0)
+    die("pthread_create");
+  editorWatchFd(l->wake[0], POLLIN, editorLoaderDrain);
+
+  /* show the first block as soon as it is indexed */
+  struct pollfd pfd = {l->wake[0], POLLIN, 0};
+  while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+    ;
+  editorLoaderDrain(pfd.fd);
+  editorConf.dirty = 0;
+}
 
-  char *line = NULL;
-  size_t line_cap = 0;
-  ssize_t line_len;
-  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-    while (line_len > 0 &&
-           (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-      line_len--;
-    }
-    editorInsertRow(editorConf.num_rows, line, line_len);
+/* Compress on the way out: rows are streamed into the codec, which writes
+ * file.tmp next to the file. Only once the codec has finished cleanly and
+ * the copy is on disk does it replace the file, so a failed save leaves
+ * the old one as it was. */
+void editorSaveCompressed(long long len) {
+  struct editorCodec *codec = editorConf.codec;
+  char *tmp = malloc(strlen(editorConf.filename) + 5);
+  if (tmp == NULL)
+    die("malloc");
+  sprintf(tmp, "%s.tmp", editorConf.filename);
+
+  struct stat st;
+  mode_t mode = stat(editorConf.filename, &st) == 0 ? st.st_mode & 07777
+                                                     : 0644;
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  int in[2];
+  int err = 0, failed = 0;
+  if (out == -1 || pipe2(in, O_CLOEXEC) == -1) {
+    err = errno;
+  } else {
+    pid_t pid = editorSpawn(codec->compress, in[0], out);
+    close(in[0]);
+    int wrote = pid != -1 &&
+                editorWriteRows(in[1], 0, editorConf.num_rows) == 0;
+    int saved = errno;
+    close(in[1]);
+    if (pid == -1)
+      err = saved;
+    else if (editorReap(pid) == -1)
+      failed = 1;
+    else if (!wrote)
+      err = saved ? saved : EIO;
+    else if (fsync(out) == -1 || fstat(out, &st) == -1 ||
+             rename(tmp, editorConf.filename) == -1)
+      err = errno;
   }
-  free(line);
-  fclose(fp);
+  if (out != -1)
+    close(out);
+  if (err || failed) {
+    if (out != -1)
+      unlink(tmp);
+    free(tmp);
+    if (failed)
+      editorSetStatusMessage("Can't save! %s failed", codec->compress[0]);
+    else
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+    return;
+  }
+  free(tmp);
+  editorJournalDrop(editorConf.filename);
   editorConf.dirty = 0;
+  editorSetStatusMessage("%lld bytes written to disk (%lld %s)", len,
+                         (long long)st.st_size, codec->name);
 }
 
 void editorSave() {
@@ -567,32 +6603,63 @@ void editorSave() {
       return;
     }
     editorSelectSyntaxHighlight();
+    editorIndexReset();
+    editorBracketsFree(editorConf.brackets);
+    editorConf.brackets = NULL;
+    int fd = open(editorConf.filename, O_RDONLY | O_CLOEXEC);
+    editorConf.codec = editorDetectCodec(fd, editorConf.filename);
+    if (fd != -1)
+      close(fd);
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
+  editorWaitRows(INT_MAX);
+
+  long long len = 0;
+  for (int j = 0; j < editorConf.num_rows; j++)
+    len += editorConf.row_size[j] + 1;
+
+  if (editorConf.codec) {
+    editorSaveCompressed(len);
+    return;
+  }
+
+  long long written;
+  int inplace = editorSaveInPlace(len, &written);
+  if (inplace == 0) {
+    editorConf.dirty = 0;
+    editorSetStatusMessage("%lld bytes written to disk (%lld in place)", len,
+                           written);
+    return;
+  } else if (inplace == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
 
-  int fd = open(editorConf.filename, O_RDWR | O_CREAT, 0644);
+  int fd = open(editorConf.filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
   if (fd != -1) {
     if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
+      if (editorWriteRows(fd, 0, editorConf.num_rows) == 0) {
+        /* the rows no longer point at their own place in the file */
+        struct stat st;
+        editorDiskReset();
+        if (fstat(fd, &st) == 0)
+          editorDiskStamp(&st);
         close(fd);
-        free(buf);
+        editorJournalDrop(editorConf.filename);
         editorConf.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
+        editorSetStatusMessage("%lld bytes written to disk", len);
         return;
       }
     }
     close(fd);
   }
-  free(buf);
   editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
 void editorExecuteCommand(char *command) {
   static int quit_times = ZOR_QUIT_TIMES;
   if (strcmp(command, "q") == 0) {
-    if (editorConf.dirty) {
+    if (editorModifiedBuffers() && editorConf.server == -1) {
       editorSetStatusMessage("File has unsaved changes. Quit anyway? (y/n)");
       /*if (editorPrompt("File has unsaved changes. Quit anyway? (y/n)") == 'y')
        * {*/
@@ -600,52 +6667,531 @@ void editorExecuteCommand(char *command) {
       /*  write(STDOUT_FILENO, "\x1b[H", 3);*/
       /*  exit(0);*/
       /*}*/
-      if (editorConf.dirty && quit_times > 0) {
+      if (quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                                "Press Ctrl-Q %d more times to quit.",
                                quit_times);
         quit_times--;
         return;
       }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
-      exit(0);
+      editorQuit();
     } else {
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
-      exit(0);
+      editorQuit();
     }
   } else if (strcmp(command, "q!") == 0) {
-    exit(0);
+    editorQuit();
   } else if (strcmp(command, "w") == 0) {
     editorSave();
+  } else if (strncmp(command, "sym", 3) == 0 &&
+             (command[3] == ' ' || command[3] == '\0')) {
+    char *name = command + 3;
+    while (*name == ' ')
+      name++;
+    editorSymCommand(name);
+  } else if (strcmp(command, "follow") == 0) {
+    if (editorConf.follow) {
+      editorFollowStop();
+      editorSetStatusMessage("Stopped following");
+    } else {
+      editorFollowStart();
+    }
+  } else if (strcmp(command, "diff") == 0) {
+    editorDiffCommand();
+  } else if (strcmp(command, "set wrap") == 0 ||
+             strcmp(command, "set nowrap") == 0) {
+    editorConf.wrap = command[4] == 'w';
+    editorConf.wrap_off = 0;
+    editorInvalidateScreens();
+  } else if (strcmp(command, "noh") == 0) {
+    editorSetSearch(NULL);
   } else if (strcmp(command, "wq") == 0) {
     editorSave();
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
-  } else {
+    editorQuit();
+  } else if (editorBufferCommand(command) == -1 &&
+             editorMemCommand(command) == -1 &&
+             editorRangeCommand(command) == -1) {
     editorSetStatusMessage("Unknown command: %s", command);
   }
 }
 
+/*buffers*/
+
+int editorAddBuffer(const char *filename) {
+  if (editorConf.num_buffers == editorConf.buffers_cap) {
+    editorConf.buffers_cap =
+        editorConf.buffers_cap ? editorConf.buffers_cap * 2 : 8;
+    editorConf.buffers =
+        realloc(editorConf.buffers,
+                sizeof(struct editorBuffer) * editorConf.buffers_cap);
+    if (editorConf.buffers == NULL)
+      die("realloc");
+  }
+  struct editorBuffer *b = &editorConf.buffers[editorConf.num_buffers];
+  memset(b, 0, sizeof(struct editorBuffer));
+  b->filename = filename ? strdup(filename) : NULL;
+  b->arena = calloc(1, sizeof(struct editorArena));
+  if (b->arena == NULL)
+    die("calloc");
+  return editorConf.num_buffers++;
+}
+
+char *editorBufferName(int i) {
+  if (i == editorConf.cur_buffer)
+    return editorConf.filename;
+  return editorConf.buffers[i].filename;
+}
+
+int editorBufferDirty(int i) {
+  if (i == editorConf.cur_buffer)
+    return editorConf.dirty;
+  return editorConf.buffers[i].dirty;
+}
+
+int editorModifiedBuffers() {
+  int n = 0;
+  for (int i = 0; i < editorConf.num_buffers; i++)
+    n += editorBufferDirty(i) != 0;
+  return n;
+}
+
+/* Move the active buffer's state out of editorConf. Its loader and
+ * follower are not served until it is shown again; the loader thread keeps
+ * indexing meanwhile. */
+void editorBufferStash(struct editorBuffer *b) {
+  if (editorConf.loader)
+    editorUnwatchFd(editorConf.loader->wake[0]);
+  if (editorConf.follower)
+    editorUnwatchFd(editorConf.follower->inotify);
+  b->loaded = 1;
+  /* extra cursors are not kept for a buffer that is not shown */
+  editorConf.num_cursors = 0;
+  b->cx = editorConf.cx;
+  b->cy = editorConf.cy;
+  b->row_off = editorConf.row_off;
+  b->col_off = editorConf.col_off;
+  b->wrap_off = editorConf.wrap_off;
+  b->num_rows = editorConf.num_rows;
+  b->row_cap = editorConf.row_cap;
+  b->row_size = editorConf.row_size;
+  b->row_cache = editorConf.row_cache;
+  b->row_flags = editorConf.row_flags;
+  b->row = editorConf.row;
+  b->cached_rows = editorConf.cached_rows;
+  b->arena = editorConf.arena;
+  b->loader = editorConf.loader;
+  b->load_bytes = editorConf.load_bytes;
+  b->load_partial = editorConf.load_partial;
+  b->follow = editorConf.follow;
+  b->follower = editorConf.follower;
+  b->dirty = editorConf.dirty;
+  b->filename = editorConf.filename;
+  b->codec = editorConf.codec;
+  b->syntax = editorConf.syntax;
+  b->hl_state_rows = editorConf.hl_state_rows;
+  b->index = editorConf.index;
+  b->brackets = editorConf.brackets;
+  b->layout = editorConf.layout;
+  b->folds = editorConf.folds;
+  b->num_folds = editorConf.num_folds;
+  b->folds_cap = editorConf.folds_cap;
+  b->disk = editorConf.disk;
+  b->undo = editorConf.undo;
+  b->redo = editorConf.redo;
+}
+
+void editorBufferRestore(struct editorBuffer *b) {
+  editorConf.cx = b->cx;
+  editorConf.cy = b->cy;
+  editorConf.row_off = b->row_off;
+  editorConf.col_off = b->col_off;
+  editorConf.wrap_off = b->wrap_off;
+  editorConf.num_rows = b->num_rows;
+  editorConf.row_cap = b->row_cap;
+  editorConf.row_size = b->row_size;
+  editorConf.row_cache = b->row_cache;
+  editorConf.row_flags = b->row_flags;
+  editorConf.row = b->row;
+  editorConf.cached_rows = b->cached_rows;
+  editorConf.arena = b->arena;
+  editorConf.loader = b->loader;
+  editorConf.load_bytes = b->load_bytes;
+  editorConf.load_partial = b->load_partial;
+  editorConf.follow = b->follow;
+  editorConf.follower = b->follower;
+  editorConf.dirty = b->dirty;
+  editorConf.filename = b->filename;
+  editorConf.codec = b->codec;
+  editorConf.syntax = b->syntax;
+  editorConf.hl_state_rows = b->hl_state_rows;
+  editorConf.index = b->index;
+  editorConf.brackets = b->brackets;
+  editorConf.layout = b->layout;
+  editorConf.folds = b->folds;
+  editorConf.num_folds = b->num_folds;
+  editorConf.folds_cap = b->folds_cap;
+  editorConf.disk = b->disk;
+  editorConf.undo = b->undo;
+  editorConf.redo = b->redo;
+  editorConf.undo_open = 0;
+  if (editorConf.loader)
+    editorWatchFd(editorConf.loader->wake[0], POLLIN, editorLoaderDrain);
+  if (editorConf.follower)
+    editorWatchFd(editorConf.follower->inotify, POLLIN, editorFollowEvent);
+  b->last_shown = ++editorConf.buffer_tick;
+}
+
+/* Free the caches of a buffer that is not on screen, leaving its text and
+ * cursor. They are rebuilt from the text when it is shown again. */
+void editorBufferDropCaches(struct editorBuffer *b) {
+  for (int i = 0; i < b->num_rows && b->cached_rows; i++) {
+    if (b->row_cache[i] == 0)
+      continue;
+    editorFreeCache(b->arena, b->row_cache[i]);
+    b->row_cache[i] = 0;
+    b->row_flags[i] &= ~ROW_HL_VALID;
+    b->cached_rows--;
+  }
+}
+
+/* Keep the row caches of all buffers within ZOR_CACHE_BUDGET by dropping
+ * those of the buffers shown least recently. The active buffer keeps its
+ * own. */
+void editorTrimCaches() {
+  long total = editorConf.cached_rows;
+  for (int i = 0; i < editorConf.num_buffers; i++) {
+    if (i != editorConf.cur_buffer)
+      total += editorConf.buffers[i].cached_rows;
+  }
+  while (total > ZOR_CACHE_BUDGET) {
+    struct editorBuffer *lru = NULL;
+    for (int i = 0; i < editorConf.num_buffers; i++) {
+      struct editorBuffer *b = &editorConf.buffers[i];
+      if (i != editorConf.cur_buffer && b->cached_rows &&
+          (lru == NULL || b->last_shown < lru->last_shown))
+        lru = b;
+    }
+    if (lru == NULL)
+      break;
+    total -= lru->cached_rows;
+    editorBufferDropCaches(lru);
+  }
+}
+
+void editorSwitchBuffer(int i) {
+  if (i == editorConf.cur_buffer)
+    return;
+  if (editorConf.filter) {
+    editorSetStatusMessage("Filter still running");
+    return;
+  }
+  editorBufferStash(&editorConf.buffers[editorConf.cur_buffer]);
+  editorConf.cur_buffer = i;
+  struct editorBuffer *b = &editorConf.buffers[i];
+  int loaded = b->loaded;
+  editorBufferRestore(b);
+  editorInvalidateScreens();
+  if (!loaded) {
+    char *name = editorConf.filename;
+    editorConf.filename = NULL;
+    editorOpen(name);
+    free(name);
+  }
+  editorTrimCaches();
+}
+
+void editorListBuffers() {
+  char msg[sizeof(editorConf.statusmsg)];
+  int len = 0;
+  for (int i = 0; i < editorConf.num_buffers; i++) {
+    char *name = editorBufferName(i);
+    int n = snprintf(msg + len, sizeof(msg) - len, "%s%d%s%s \"%s\"",
+                     len ? "  " : "", i + 1,
+                     i == editorConf.cur_buffer ? "%" : "",
+                     editorBufferDirty(i) ? "+" : "",
+                     name ? name : "[No Name]");
+    if (n >= (int)sizeof(msg) - len)
+      break;
+    len += n;
+  }
+  editorSetStatusMessage("%s", msg);
+}
+
+/* The buffer for filename, added unloaded if it is not open yet. */
+int editorFindBuffer(const char *filename) {
+  for (int i = 0; i < editorConf.num_buffers; i++) {
+    char *name = editorBufferName(i);
+    if (name && strcmp(name, filename) == 0)
+      return i;
+  }
+  return editorAddBuffer(filename);
+}
+
+/* :e file, :bn, :bp, :b N and :ls. Returns -1 if command is none of
+ * them. */
+int editorBufferCommand(char *command) {
+  int n = editorConf.num_buffers;
+  int cur = editorConf.cur_buffer;
+  if (command[0] == 'e' && (command[1] == ' ' || command[1] == '\0')) {
+    char *name = command + 1;
+    while (*name == ' ')
+      name++;
+    if (*name == '\0')
+      editorSetStatusMessage("No file name");
+    else
+      editorSwitchBuffer(editorFindBuffer(name));
+  } else if (strcmp(command, "bn") == 0) {
+    editorSwitchBuffer((cur + 1) % n);
+  } else if (strcmp(command, "bp") == 0) {
+    editorSwitchBuffer((cur + n - 1) % n);
+  } else if (command[0] == 'b' && (command[1] == ' ' ||
+                                  isdigit((unsigned char)command[1]))) {
+    int i = atoi(command + 1);
+    if (i < 1 || i > n)
+      editorSetStatusMessage("No buffer %d", i);
+    else
+      editorSwitchBuffer(i - 1);
+  } else if (strcmp(command, "ls") == 0) {
+    editorListBuffers();
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/*memory*/
+
+/* Bytes per kind, malloc'd and in every buffer's arena, and their total.
+ * Arena memory not handed out as chunks and spare blocks are reported as
+ * free; they are reused before anything grows, so the budget leaves them
+ * out. */
+size_t editorMemUsage(size_t usage[MEM_KINDS], size_t *free_bytes) {
+  size_t total = 0;
+  memcpy(usage, editorConf.mem, sizeof(editorConf.mem));
+  usage[MEM_TEXT] += editorConf.pinned_bytes;
+  *free_bytes = (size_t)editorConf.num_spare * ARENA_BLOCK_SIZE;
+  for (int b = -1; b < editorConf.num_buffers; b++) {
+    if (b == editorConf.cur_buffer)
+      continue;
+    struct editorArena *a =
+        b == -1 ? editorConf.arena : editorConf.buffers[b].arena;
+    for (int i = 0; i < MEM_KINDS; i++)
+      usage[i] += a->used[i];
+    *free_bytes += a->bump_bytes - a->small_bytes;
+  }
+  for (int i = 0; i < MEM_KINDS; i++)
+    total += usage[i];
+  return total;
+}
+
+/* Free a buffer's word index and its bracket and line trees. The index
+ * is then built when a lookup needs it, the trees when a match, a fold or
+ * a wrapped scroll does. */
+void editorDropTrees(struct editorIndex **index,
+                     struct editorBrackets **brackets,
+                     struct editorLayout **layout, unsigned char *row_flags,
+                     int num_rows) {
+  if (*index) {
+    editorIndexFree(*index);
+    *index = NULL;
+    for (int i = 0; i < num_rows; i++)
+      row_flags[i] &= ~ROW_INDEXED;
+  }
+  editorBracketsFree(*brackets);
+  *brackets = NULL;
+  editorLayoutFree(*layout);
+  *layout = NULL;
+}
+
+/* Over budget, drop what can be rebuilt from the text: the caches and
+ * trees of hidden buffers, then the caches of rows off screen, which also
+ * hold the search matches, and last the active buffer's own trees. Text
+ * and undo history are left alone. */
+void editorEnforceBudget() {
+  size_t usage[MEM_KINDS], free_bytes;
+  if (editorConf.mem_budget == 0 ||
+      editorMemUsage(usage, &free_bytes) <= editorConf.mem_budget)
+    return;
+  if (usage[MEM_RENDER] + usage[MEM_HL] + usage[MEM_SEARCH] +
+          usage[MEM_INDEX] <
+      ZOR_DERIVED_FLOOR)
+    return;
+
+  for (int i = 0; i < editorConf.num_buffers; i++) {
+    struct editorBuffer *b = &editorConf.buffers[i];
+    if (i == editorConf.cur_buffer)
+      continue;
+    editorBufferDropCaches(b);
+    editorDropTrees(&b->index, &b->brackets, &b->layout, b->row_flags,
+                    b->num_rows);
+  }
+  int top = editorConf.row_off;
+  int bottom = editorVisibleRow(editorConf.row_off, editorConf.screen_rows);
+  for (int i = 0; i < editorConf.num_rows && editorConf.cached_rows; i++) {
+    if ((i < top || i >= bottom) && editorConf.row_cache[i]) {
+      editorRowDropCache(i);
+      editorConf.row_flags[i] &= ~ROW_HL_VALID;
+    }
+  }
+  if (editorMemUsage(usage, &free_bytes) > editorConf.mem_budget)
+    editorDropTrees(&editorConf.index, &editorConf.brackets,
+                    &editorConf.layout, editorConf.row_flags,
+                    editorConf.num_rows);
+}
+
+/* Parse a byte count with an optional K, M or G suffix. */
+int editorParseSize(const char *s, size_t *size) {
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (end == s || errno)
+    return -1;
+  int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    shift += 10;
+    /* fall through */
+  case 'M':
+    shift += 10;
+    /* fall through */
+  case 'K':
+    shift += 10;
+    end++;
+    break;
+  }
+  if (*end != '\0' || n > (SIZE_MAX >> shift))
+    return -1;
+  *size = (size_t)n << shift;
+  return 0;
+}
+
+/* Print n as 512, 12K, 3.4M or 1.2G. */
+char *editorFormatSize(char buf[16], size_t n) {
+  const char *units = "KMGT";
+  if (n < 1024) {
+    snprintf(buf, 16, "%zu", n);
+    return buf;
+  }
+  double v = n / 1024.0;
+  int u = 0;
+  while (v >= 1024 && u < 3) {
+    v /= 1024;
+    u++;
+  }
+  snprintf(buf, 16, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+  return buf;
+}
+
+/* Resident set size from /proc, or 0 where that is not available. */
+size_t editorResidentBytes() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL)
+    return 0;
+  unsigned long pages = 0, resident = 0;
+  if (fscanf(fp, "%lu %lu", &pages, &resident) != 2)
+    resident = 0;
+  fclose(fp);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* :mem reports usage per kind; :mem SIZE sets the budget, 0 clears it.
+ * Returns -1 if command is not :mem. */
+int editorMemCommand(char *command) {
+  if (strncmp(command, "mem", 3) != 0 ||
+      (command[3] != ' ' && command[3] != '\0'))
+    return -1;
+  char *arg = command + 3;
+  while (*arg == ' ')
+    arg++;
+  if (*arg) {
+    if (editorParseSize(arg, &editorConf.mem_budget) == -1) {
+      editorSetStatusMessage("Invalid size: %s", arg);
+      return 0;
+    }
+    editorEnforceBudget();
+  }
+
+  size_t usage[MEM_KINDS], free_bytes;
+  size_t total = editorMemUsage(usage, &free_bytes);
+  char b[MEM_KINDS + 4][16];
+  for (int i = 0; i < MEM_KINDS; i++)
+    editorFormatSize(b[i], usage[i]);
+  editorSetStatusMessage(
+      "text %s rows %s render %s hl %s search %s index %s undo %s out %s "
+      "free %s | total %s rss %s budget %s",
+      b[MEM_TEXT], b[MEM_ROWS], b[MEM_RENDER], b[MEM_HL], b[MEM_SEARCH],
+      b[MEM_INDEX], b[MEM_UNDO], b[MEM_OUTPUT],
+      editorFormatSize(b[MEM_KINDS], free_bytes),
+      editorFormatSize(b[MEM_KINDS + 1], total + free_bytes),
+      editorFormatSize(b[MEM_KINDS + 2], editorResidentBytes()),
+      editorConf.mem_budget
+          ? editorFormatSize(b[MEM_KINDS + 3], editorConf.mem_budget)
+          : "none");
+  return 0;
+}
+
 /*search*/
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+/* Point every row's match cache at a new query; rows refill lazily when
+ * they are next drawn. */
+void editorSetSearch(const char *query) {
+  if (query && *query == '\0')
+    query = NULL;
+  if (query == NULL && editorConf.search_query == NULL)
+    return;
+  if (query && editorConf.search_query &&
+      strcmp(query, editorConf.search_query) == 0)
+    return;
+  free(editorConf.search_query);
+  editorConf.search_query = query ? strdup(query) : NULL;
+  editorConf.search_gen++;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl_search = NULL;
+editorMatchSpan *editorRowMatches(int at, int *len) {
+  editorRowCache *cache = editorCacheSlot(editorConf.row_cache[at]);
+  *len = 0;
+  if (editorConf.search_query == NULL)
+    return NULL;
+  if (cache && cache->match_gen == editorConf.search_gen) {
+    *len = cache->match_len;
+    return cache->match;
+  }
 
-  if (saved_hl_search) {
-    memcpy(editorConf.row[saved_hl_line].hl, saved_hl_search,
-           editorConf.row[saved_hl_line].rsize);
-    free(saved_hl_search);
-    saved_hl_search = NULL;
+  cache = editorRowCacheOf(at);
+  arenaFree(editorConf.arena, cache->match);
+  cache->match = NULL;
+  cache->match_len = 0;
+  cache->match_gen = editorConf.search_gen;
+
+  char *query = editorConf.search_query;
+  size_t qlen = strlen(query);
+  char *chars = editorConf.row[at].chars;
+  size_t size = editorConf.row_size[at];
+  int cap = 0;
+  char *p = chars;
+  char *m;
+  while ((m = memmem(p, size - (p - chars), query, qlen)) != NULL) {
+    if (cache->match_len == cap) {
+      cap = cap ? cap * 2 : 4;
+      cache->match = arenaRealloc(editorConf.arena, cache->match,
+                                  sizeof(editorMatchSpan) * cap, MEM_SEARCH);
+    }
+    int cx = m - chars;
+    editorMatchSpan *span = &cache->match[cache->match_len++];
+    span->start = editorRowCxToRx(at, cx);
+    span->end = editorRowCxToRx(at, cx + qlen);
+    p = m + qlen;
   }
+  *len = cache->match_len;
+  return cache->match;
+}
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
 
   if (key == '\r' || key == '\x1b') {
+    if (key == '\x1b')
+      editorSetSearch(NULL);
     last_match = -1;
     direction = 1;
     return;
@@ -658,6 +7204,8 @@ void editorFindCallback(char *query, int key) {
     direction = 1;
   }
 
+  editorSetSearch(query);
+
   if (last_match == -1) {
     direction = 1;
   }
@@ -670,19 +7218,14 @@ void editorFindCallback(char *query, int key) {
     else if (current == editorConf.num_rows)
       current = 0;
 
-    editorRow *row = &editorConf.row[current];
-    char *match = strstr(row->render, query);
+    char *chars = editorConf.row[current].chars;
+    char *match = memmem(chars, editorConf.row_size[current], query,
+                         strlen(query));
     if (match) {
       last_match = current;
       editorConf.cy = current;
-      editorConf.cx = editorRowRxToCx(row, match - row->render);
+      editorConf.cx = match - chars;
       editorConf.row_off = editorConf.num_rows;
-
-      saved_hl_line = current;
-      saved_hl_search = malloc(row->rsize);
-      memcpy(saved_hl_search, row->hl, row->rsize);
-
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
       return;
     }
   }
@@ -693,6 +7236,7 @@ void editorFind() {
   int saved_cy = editorConf.cy;
   int saved_coll_off = editorConf.col_off;
   int saved_row_off = editorConf.row_off;
+  int saved_wrap_off = editorConf.wrap_off;
 
   char *query = editorPrompt("Search: %s", editorFindCallback);
 
@@ -703,6 +7247,7 @@ void editorFind() {
     editorConf.cy = saved_cy;
     editorConf.col_off = saved_coll_off;
     editorConf.row_off = saved_row_off;
+    editorConf.wrap_off = saved_wrap_off;
   }
 }
 
@@ -726,21 +7271,619 @@ void abAppend(struct abuf *ab, const char *s, int len) {
 }
 void abFree(struct abuf *ab) { free(ab->b); }
 
+/*diff*/
+
+/* Remember which file the rows are being read from; those read from it
+ * can be traced back to it as long as it stays the same. */
+void editorDiskStamp(struct stat *st) {
+  struct editorDisk *d = &editorConf.disk;
+  d->valid = 1;
+  d->dev = st->st_dev;
+  d->ino = st->st_ino;
+  d->size = st->st_size;
+  d->mtime = st->st_mtim;
+}
+
+/* Whether st is the file as it was stamped. */
+int editorDiskSame(struct stat *st) {
+  struct editorDisk *d = &editorConf.disk;
+  return d->valid && d->dev == st->st_dev && d->ino == st->st_ino &&
+         d->size == st->st_size && d->mtime.tv_sec == st->st_mtim.tv_sec &&
+         d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Forget where the rows came from. */
+void editorDiskReset() {
+  editorConf.disk.num_ext = 0;
+  editorConf.disk.valid = 0;
+  editorConf.disk.moved = (off_t)LLONG_MAX;
+}
+
+/* Note that text[0..len) is the file from offset off on. */
+void editorDiskAdd(char *text, size_t len, off_t off) {
+  struct editorDisk *d = &editorConf.disk;
+  if (d->num_ext == d->ext_cap) {
+    int cap = d->ext_cap ? d->ext_cap * 2 : 16;
+    d->ext = realloc(d->ext, sizeof(struct diskExtent) * cap);
+    if (d->ext == NULL)
+      die("realloc");
+    editorConf.mem[MEM_INDEX] += sizeof(struct diskExtent) * (cap - d->ext_cap);
+    d->ext_cap = cap;
+  }
+  int i = d->num_ext++;
+  while (i > 0 && (uintptr_t)d->ext[i - 1].text > (uintptr_t)text) {
+    d->ext[i] = d->ext[i - 1];
+    i--;
+  }
+  d->ext[i].text = text;
+  d->ext[i].len = len;
+  d->ext[i].off = off;
+}
+
+/* The file's bytes [from, to) were written over, so rows read from there,
+ * which undo may still bring back, no longer match it. */
+void editorDiskCut(off_t from, off_t to) {
+  struct editorDisk *d = &editorConf.disk;
+  for (int i = d->num_ext - 1; i >= 0; i--) {
+    struct diskExtent e = d->ext[i];
+    off_t end = e.off + (off_t)e.len;
+    if (end <= from || e.off >= to)
+      continue;
+    if (end > to)
+      editorDiskAdd(e.text + (to - e.off), end - to, to);
+    if (e.off < from) {
+      d->ext[i].len = from - e.off;
+    } else {
+      memmove(&d->ext[i], &d->ext[i + 1],
+              sizeof(struct diskExtent) * (d->num_ext - i - 1));
+      d->num_ext--;
+    }
+  }
+}
+
+/* Offset in the file of row at's text, or -1 if the row was edited or
+ * did not come from the file. *hint is the extent to try first. */
+off_t editorDiskOrigin(int at, int *hint) {
+  struct editorDisk *d = &editorConf.disk;
+  uintptr_t p = (uintptr_t)editorConf.row[at].chars;
+  int i = *hint;
+  if (i >= d->num_ext || p < (uintptr_t)d->ext[i].text ||
+      p >= (uintptr_t)d->ext[i].text + d->ext[i].len) {
+    int lo = 0, hi = d->num_ext;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if ((uintptr_t)d->ext[mid].text <= p)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    i = lo - 1;
+    if (i < 0 || p >= (uintptr_t)d->ext[i].text + d->ext[i].len)
+      return -1;
+    *hint = i;
+  }
+  /* a row cut across by a write is not the file's any more */
+  if (p + editorConf.row_size[at] >=
+      (uintptr_t)d->ext[i].text + d->ext[i].len)
+    return -1;
+  off_t off = d->ext[i].off + (off_t)(p - (uintptr_t)d->ext[i].text);
+  return off < d->moved ? off : -1;
+}
+
+/* Line hash for the diff: eight bytes at a time in two lanes whose
+ * multiplies do not wait on each other. */
+unsigned long long editorDiffHash(const char *s, int len) {
+  uint64_t a = 0x9e3779b97f4a7c15ull ^ (uint64_t)len;
+  uint64_t b = 0xc2b2ae3d27d4eb4full;
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    uint64_t x, y;
+    memcpy(&x, s + i, 8);
+    memcpy(&y, s + i + 8, 8);
+    a = (a ^ x) * 0xff51afd7ed558ccdull;
+    b = (b ^ y) * 0xc4ceb9fe1a85ec53ull;
+    a ^= a >> 32;
+    b ^= b >> 29;
+  }
+  uint64_t tail[2] = {0, 0};
+  memcpy(tail, s + i, len - i);
+  a = (a ^ tail[0]) * 0xff51afd7ed558ccdull;
+  b = (b ^ tail[1]) * 0xc4ceb9fe1a85ec53ull;
+  uint64_t h = a ^ (b >> 31) ^ (b << 33);
+  return h ^ (h >> 29);
+}
+
+int editorDiffEqual(struct diffLine *x, struct diffLine *y) {
+  return x->hash == y->hash && x->len == y->len &&
+         memcmp(x->s, y->s, x->len) == 0;
+}
+
+/* Split buf[0..len) into lines as the loader does, without the carriage
+ * returns at their ends. With skip, the text up to the first newline is
+ * the tail of a line already counted. Returns the number of lines. */
+int editorDiffSplit(char *buf, size_t len, int skip, struct diffLine **out) {
+  struct diffLine *lines = NULL;
+  int n = 0, cap = 0;
+  size_t i = 0;
+  if (skip) {
+    char *nl = memchr(buf, '\n', len);
+    i = nl ? (size_t)(nl - buf) + 1 : len;
+  }
+  while (i < len) {
+    char *nl = memchr(buf + i, '\n', len - i);
+    size_t end = nl ? (size_t)(nl - buf) : len;
+    size_t e = end;
+    while (e > i && buf[e - 1] == '\r')
+      e--;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      lines = realloc(lines, sizeof(struct diffLine) * cap);
+      if (lines == NULL)
+        die("realloc");
+    }
+    lines[n].s = buf + i;
+    lines[n].len = e - i;
+    lines[n].hash = editorDiffHash(buf + i, e - i);
+    n++;
+    i = end + 1;
+  }
+  *out = lines;
+  return n;
+}
+
+void editorDiffAddHunk(struct editorDiff *d, struct diffLine *a, int at,
+                       int na, int b, int nb) {
+  if (d->num_hunks == d->hunks_cap) {
+    d->hunks_cap = d->hunks_cap ? d->hunks_cap * 2 : 16;
+    d->hunks = realloc(d->hunks, sizeof(struct diffHunk) * d->hunks_cap);
+    if (d->hunks == NULL)
+      die("realloc");
+  }
+  if (d->num_old + na > d->old_cap) {
+    while (d->num_old + na > d->old_cap)
+      d->old_cap = d->old_cap ? d->old_cap * 2 : 64;
+    d->old = realloc(d->old, sizeof(struct diffLine) * d->old_cap);
+    if (d->old == NULL)
+      die("realloc");
+  }
+  struct diffHunk *h = &d->hunks[d->num_hunks++];
+  h->a = at;
+  h->na = na;
+  h->b = b;
+  h->nb = nb;
+  h->old = d->num_old;
+  memcpy(&d->old[d->num_old], a, sizeof(struct diffLine) * na);
+  d->num_old += na;
+}
+
+/* Diff file lines a[0, na), which start at line, against rows [row, row +
+ * nb) with Myers' algorithm after trimming what both ends share. Past
+ * ZOR_DIFF_MAX_EDITS edits the window is one hunk. */
+void editorDiffWindow(struct editorDiff *d, struct diffLine *a, int na,
+                      int line, int row, int nb) {
+  struct diffLine *b = malloc(sizeof(struct diffLine) * (nb ? nb : 1));
+  if (b == NULL)
+    die("malloc");
+  for (int i = 0; i < nb; i++) {
+    b[i].s = editorConf.row[row + i].chars;
+    b[i].len = editorConf.row_size[row + i];
+    b[i].hash = editorDiffHash(b[i].s, b[i].len);
+  }
+  int p = 0;
+  while (p < na && p < nb && editorDiffEqual(&a[p], &b[p]))
+    p++;
+  int n = na - p, m = nb - p;
+  while (n > 0 && m > 0 && editorDiffEqual(&a[p + n - 1], &b[p + m - 1])) {
+    n--;
+    m--;
+  }
+
+  /* keep marks the lines on the path through both sides */
+  char *keep_a = calloc(n + 1, 1);
+  char *keep_b = calloc(m + 1, 1);
+  int max = n + m < ZOR_DIFF_MAX_EDITS ? n + m : ZOR_DIFF_MAX_EDITS;
+  int *v = malloc(sizeof(int) * (2 * max + 3));
+  int *trace = NULL;
+  if (keep_a == NULL || keep_b == NULL || v == NULL)
+    die("malloc");
+  int found = -1;
+  v[max + 2] = 0;
+  for (int e = 0; e <= max && found == -1 && n && m; e++) {
+    for (int k = -e; k <= e; k += 2) {
+      int x = (k == -e || (k != e && v[max + 1 + k - 1] < v[max + 1 + k + 1]))
+                  ? v[max + 1 + k + 1]
+                  : v[max + 1 + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && editorDiffEqual(&a[p + x], &b[p + y])) {
+        x++;
+        y++;
+      }
+      v[max + 1 + k] = x;
+      if (x >= n && y >= m)
+        found = e;
+    }
+    /* step e's row of v is kept at e * e for the walk back */
+    trace = realloc(trace, sizeof(int) * (e + 1) * (e + 1));
+    if (trace == NULL)
+      die("realloc");
+    memcpy(&trace[e * e], &v[max + 1 - e], sizeof(int) * (2 * e + 1));
+  }
+  if (found != -1) {
+    int x = n, y = m;
+    for (int e = found; e > 0; e--) {
+      int *prev = &trace[(e - 1) * (e - 1) + e - 1];
+      int k = x - y;
+      int pk = (k == -e || (k != e && prev[k - 1] < prev[k + 1])) ? k + 1
+                                                                  : k - 1;
+      int px = prev[pk];
+      int mid = pk == k + 1 ? px : px + 1;
+      while (x > mid) {
+        keep_a[--x] = 1;
+        keep_b[--y] = 1;
+      }
+      x = px;
+      y = px - pk;
+    }
+    while (x > 0) {
+      keep_a[--x] = 1;
+      keep_b[--y] = 1;
+    }
+  }
+
+  for (int i = 0, j = 0; i < n || j < m;) {
+    if (i < n && j < m && keep_a[i] && keep_b[j]) {
+      i++;
+      j++;
+      continue;
+    }
+    int i0 = i, j0 = j;
+    while (i < n && !keep_a[i])
+      i++;
+    while (j < m && !keep_b[j])
+      j++;
+    editorDiffAddHunk(d, &a[p + i0], line + p + i0, i - i0, row + p + j0,
+                      j - j0);
+  }
+  free(trace);
+  free(v);
+  free(keep_a);
+  free(keep_b);
+  free(b);
+}
+
+/* Diff the file text buf[0..len) against rows [row, end), keeping buf
+ * for the lines the hunks delete. *line is the first file line in buf and
+ * is moved past it. */
+void editorDiffText(struct editorDiff *d, char *buf, size_t len, int skip,
+                    int *line, int row, int end) {
+  if (d->num_bufs == d->bufs_cap) {
+    d->bufs_cap = d->bufs_cap ? d->bufs_cap * 2 : 16;
+    d->bufs = realloc(d->bufs, sizeof(char *) * d->bufs_cap);
+    if (d->bufs == NULL)
+      die("realloc");
+  }
+  d->bufs[d->num_bufs++] = buf;
+  struct diffLine *lines;
+  int n = editorDiffSplit(buf, len, skip, &lines);
+  editorDiffWindow(d, lines, n, *line, row, end - row);
+  free(lines);
+  *line += n;
+}
+
+/* Diff against the file as it was loaded. Rows whose text still points
+ * into the load blocks, in file order, are anchors known to be unchanged;
+ * only the bytes between anchors that are not next to each other are read
+ * back and compared. Returns -1 on a read error. */
+int editorDiffAnchored(struct editorDiff *d, int fd, off_t size) {
+  int hint = 0, pa = -1, line = 0;
+  off_t pe = 0;
+  for (int i = 0; i <= editorConf.num_rows; i++) {
+    off_t o = size;
+    if (i < editorConf.num_rows) {
+      o = editorDiskOrigin(i, &hint);
+      if (o == -1 || o < pe + (pa != -1))
+        continue;
+    }
+    off_t next = pa == -1 ? 0
+                          : pe + 1 + ((editorConf.row_flags[pa] & ROW_CRLF)
+                                          ? 1
+                                          : 0);
+    if (i != pa + 1 || o != next) {
+      char *buf = malloc(o - pe + 1);
+      if (buf == NULL)
+        die("malloc");
+      for (off_t got = 0; got < o - pe;) {
+        ssize_t r = pread(fd, buf + got, o - pe - got, pe + got);
+        if (r == -1 && errno == EINTR)
+          continue;
+        if (r <= 0) {
+          free(buf);
+          errno = r == 0 ? EIO : errno;
+          return -1;
+        }
+        got += r;
+      }
+      editorDiffText(d, buf, o - pe, pa != -1, &line, pa + 1, i);
+    }
+    if (i < editorConf.num_rows) {
+      pe = o + editorConf.row_size[i];
+      line++;
+    }
+    pa = i;
+  }
+  return 0;
+}
+
+/* Read all of fd, through the codec's decompressor if the file has one.
+ * Returns NULL with errno set on failure. */
+char *editorDiffReadAll(int fd, size_t *len) {
+  pid_t pid = -1;
+  int in = fd;
+  if (editorConf.codec) {
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) == -1)
+      return NULL;
+    pid = editorSpawn(editorConf.codec->decompress, fd, out[1]);
+    close(out[1]);
+    if (pid == -1) {
+      close(out[0]);
+      return NULL;
+    }
+    in = out[0];
+  }
+  size_t cap = 1 << 16, n = 0;
+  char *buf = malloc(cap);
+  while (buf) {
+    if (n == cap) {
+      char *grown = realloc(buf, cap * 2);
+      if (grown == NULL) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = grown;
+      cap *= 2;
+    }
+    ssize_t r = read(in, buf + n, cap - n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1) {
+      free(buf);
+      buf = NULL;
+    }
+    if (r <= 0)
+      break;
+    n += r;
+  }
+  if (pid != -1) {
+    close(in);
+    if (editorReap(pid) != 0 && buf) {
+      free(buf);
+      buf = NULL;
+      errno = EIO;
+    }
+  }
+  *len = n;
+  return buf;
+}
+
+/* Lay the hunks out as a unified diff, one line per newline. Hunks less
+ * than two contexts apart share a header. */
+void editorDiffFormat(struct editorDiff *d, struct abuf *ab) {
+  char buf[64];
+  int len;
+  abAppend(ab, "--- ", 4);
+  abAppend(ab, editorConf.filename, strlen(editorConf.filename));
+  abAppend(ab, "\t(on disk)\n+++ ", 15);
+  abAppend(ab, editorConf.filename, strlen(editorConf.filename));
+  abAppend(ab, "\t(buffer)\n", 10);
+  for (int g = 0; g < d->num_hunks;) {
+    int h = g;
+    while (h + 1 < d->num_hunks &&
+           d->hunks[h + 1].b - (d->hunks[h].b + d->hunks[h].nb) <=
+               2 * ZOR_DIFF_CONTEXT)
+      h++;
+    struct diffHunk *first = &d->hunks[g], *last = &d->hunks[h];
+    int b0 = first->b > ZOR_DIFF_CONTEXT ? first->b - ZOR_DIFF_CONTEXT : 0;
+    int b1 = last->b + last->nb + ZOR_DIFF_CONTEXT;
+    if (b1 > editorConf.num_rows)
+      b1 = editorConf.num_rows;
+    int a0 = first->a - (first->b - b0);
+    int na = b1 - b0, nb = b1 - b0;
+    for (int i = g; i <= h; i++) {
+      na += d->hunks[i].na - d->hunks[i].nb;
+    }
+    len = snprintf(buf, sizeof(buf), "@@ -%d,%d +%d,%d @@\n",
+                   na ? a0 + 1 : a0, na, nb ? b0 + 1 : b0, nb);
+    abAppend(ab, buf, len);
+
+    int r = b0;
+    for (int i = g; i <= h + 1; i++) {
+      int until = i <= h ? d->hunks[i].b : b1;
+      for (; r < until; r++) {
+        abAppend(ab, " ", 1);
+        abAppend(ab, editorConf.row[r].chars, editorConf.row_size[r]);
+        abAppend(ab, "\n", 1);
+      }
+      if (i > h)
+        break;
+      struct diffHunk *k = &d->hunks[i];
+      for (int j = 0; j < k->na; j++) {
+        abAppend(ab, "-", 1);
+        abAppend(ab, d->old[k->old + j].s, d->old[k->old + j].len);
+        abAppend(ab, "\n", 1);
+      }
+      for (; r < k->b + k->nb; r++) {
+        abAppend(ab, "+", 1);
+        abAppend(ab, editorConf.row[r].chars, editorConf.row_size[r]);
+        abAppend(ab, "\n", 1);
+      }
+    }
+    g = h + 1;
+  }
+}
+
+void editorDiffFree(struct editorDiff *d) {
+  for (int i = 0; i < d->num_bufs; i++)
+    free(d->bufs[i]);
+  free(d->bufs);
+  free(d->hunks);
+  free(d->old);
+}
+
+/* :diff: show how the buffer differs from its file as a unified diff in
+ * the buffer <name>.diff. */
+void editorDiffCommand() {
+  if (editorConf.filename == NULL) {
+    editorSetStatusMessage("No file name");
+    return;
+  }
+  editorWaitRows(INT_MAX);
+  int fd = open(editorConf.filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    editorSetStatusMessage("Can't open %s: %s", editorConf.filename,
+                           strerror(errno));
+    return;
+  }
+  struct editorDiff d = {0};
+  struct stat st;
+  int ok;
+  if (editorConf.codec == NULL && fstat(fd, &st) == 0 && editorDiskSame(&st)) {
+    ok = editorDiffAnchored(&d, fd, st.st_size) == 0;
+  } else {
+    /* the file changed since it was read: compare all of it */
+    size_t len;
+    char *buf = editorDiffReadAll(fd, &len);
+    ok = buf != NULL;
+    if (ok) {
+      int line = 0;
+      editorDiffText(&d, buf, len, 0, &line, 0, editorConf.num_rows);
+    }
+  }
+  close(fd);
+  if (!ok) {
+    editorSetStatusMessage("Can't read %s: %s", editorConf.filename,
+                           strerror(errno));
+    editorDiffFree(&d);
+    return;
+  }
+  if (d.num_hunks == 0) {
+    editorSetStatusMessage("No changes");
+    editorDiffFree(&d);
+    return;
+  }
+
+  struct abuf ab = ABUF_INIT;
+  editorDiffFormat(&d, &ab);
+  int hunks = d.num_hunks, added = 0, removed = d.num_old;
+  for (int i = 0; i < d.num_hunks; i++)
+    added += d.hunks[i].nb;
+  editorDiffFree(&d);
+
+  char *name = malloc(strlen(editorConf.filename) + 6);
+  if (name == NULL)
+    die("malloc");
+  sprintf(name, "%s.diff", editorConf.filename);
+  int i = editorFindBuffer(name);
+  free(name);
+  /* its contents come from here, not from a file of that name */
+  editorConf.buffers[i].loaded = 1;
+  editorSwitchBuffer(i);
+  if (editorConf.cur_buffer != i) {
+    abFree(&ab);
+    return;
+  }
+  editorFreeRows();
+  for (int start = 0; start < ab.len;) {
+    char *nl = memchr(ab.b + start, '\n', ab.len - start);
+    editorInsertRow(editorConf.num_rows, ab.b + start, nl - ab.b - start);
+    start = nl - ab.b + 1;
+  }
+  abFree(&ab);
+  editorConf.dirty = 0;
+  editorConf.cx = editorConf.cy = 0;
+  editorConf.row_off = editorConf.col_off = editorConf.wrap_off = 0;
+  editorSetStatusMessage("%d hunks, +%d -%d; ]c and [c move between them",
+                         hunks, added, removed);
+}
+
+/* ]c and [c: the next or previous hunk header of a diff. */
+void editorDiffJump(int dir) {
+  for (int i = editorConf.cy + dir; i >= 0 && i < editorConf.num_rows;
+       i += dir) {
+    if (editorConf.row_size[i] >= 2 &&
+        memcmp(editorConf.row[i].chars, "@@", 2) == 0) {
+      editorGotoLine(i);
+      editorConf.cx = 0;
+      return;
+    }
+  }
+  editorSetStatusMessage("No more hunks");
+}
+
 /*output*/
 
+/* Screen lines row at shows as, taking folds into account. */
+int editorShownLines(int at) {
+  if (editorConf.num_folds && editorFoldAt(at) != -1)
+    return 1;
+  return editorRowLines(at);
+}
+
+/* editorScroll with wrap set: rows are never cut, so only the top moves,
+ * by whole screen lines. */
+void editorScrollWrapped() {
+  editorConf.col_off = 0;
+  int start;
+  int sub = editorConf.cy < editorConf.num_rows &&
+                    editorShownLines(editorConf.cy) > 1
+                ? editorWrapLine(editorConf.cy, editorConf.rx, &start)
+                : 0;
+  if (editorConf.wrap_off >= editorShownLines(editorConf.row_off))
+    editorConf.wrap_off = 0;
+  if (editorConf.cy < editorConf.row_off ||
+      (editorConf.cy == editorConf.row_off && sub < editorConf.wrap_off)) {
+    editorConf.row_off = editorConf.cy;
+    editorConf.wrap_off = sub;
+  } else if (editorVisibleLines(editorConf.row_off, editorConf.cy) -
+                 editorConf.wrap_off + sub >=
+             editorConf.screen_rows) {
+    editorConf.wrap_off = sub;
+    editorConf.row_off = editorDisplayRow(editorConf.cy, &editorConf.wrap_off,
+                                          -(editorConf.screen_rows - 1));
+  }
+}
+
 void editorScroll() {
   editorConf.rx = 0;
   if (editorConf.cy < editorConf.num_rows) {
     editorConf.rx =
-        editorRowCxToRx(&editorConf.row[editorConf.cy], editorConf.cx);
+        editorRowCxToRx(editorConf.cy, editorConf.cx);
   }
 
   editorConf.rx = editorConf.cx;
+  /* a closed fold shows only its first row, and the cursor stays there */
+  if (editorConf.num_folds) {
+    int cy = editorFoldStart(editorConf.cy);
+    if (cy != editorConf.cy) {
+      editorConf.cy = cy;
+      if (editorConf.cx > editorConf.row_size[cy])
+        editorConf.cx = editorConf.rx = editorConf.row_size[cy];
+    }
+    editorConf.row_off = editorFoldStart(editorConf.row_off);
+  }
+  if (editorConf.wrap) {
+    editorScrollWrapped();
+    return;
+  }
+  editorConf.wrap_off = 0;
   if (editorConf.cy < editorConf.row_off) {
     editorConf.row_off = editorConf.cy;
   }
-  if (editorConf.cy >= editorConf.row_off + editorConf.screen_rows) {
-    editorConf.row_off = editorConf.cy - editorConf.screen_rows + 1;
+  if (editorVisibleLines(editorConf.row_off, editorConf.cy) >=
+      editorConf.screen_rows) {
+    editorConf.row_off =
+        editorVisibleRow(editorConf.cy, -(editorConf.screen_rows - 1));
   }
   if (editorConf.rx < editorConf.col_off) {
     editorConf.col_off = editorConf.rx;
@@ -750,61 +7893,130 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  for (y = 0; y < editorConf.screen_rows; y++) {
-    int file_row = y + editorConf.row_off;
-    if (file_row >= editorConf.num_rows) {
-      if (editorConf.num_rows == 0 && y == editorConf.screen_rows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-                                  "ZOR EDITOR -- VERSION %s", ZOR_VERSION);
-        if (welcomelen > editorConf.screen_cols)
-          welcomelen = editorConf.screen_cols;
-        int padding = (editorConf.screen_cols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
+/* Draw a closed fold starting at file_row as one line. */
+void editorDrawFold(struct abuf *ab, int file_row) {
+  struct editorFold *f = &editorConf.folds[editorFoldAt(file_row)];
+  char *render = editorRowRender(file_row);
+  int rsize = editorRowRsize(file_row);
+  int i = 0;
+  while (i < rsize && render[i] == ' ')
+    i++;
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "+--%d lines: %.*s",
+                     f->end - f->start + 1, rsize - i, render + i);
+  if (len > (int)sizeof(buf) - 1)
+    len = sizeof(buf) - 1;
+  len -= editorConf.col_off;
+  if (len > editorConf.screen_cols)
+    len = editorConf.screen_cols;
+  abAppend(ab, "\x1b[36m", 5);
+  if (len > 0)
+    abAppend(ab, buf + editorConf.col_off, len);
+  abAppend(ab, "\x1b[39m", 5);
+}
+
+/* Draw screen line y, which shows file_row or, with wrap set, line sub
+ * of it. */
+void editorDrawRow(struct abuf *ab, int y, int file_row, int sub) {
+  if (file_row < editorConf.num_rows && editorConf.num_folds &&
+      editorFoldAt(file_row) != -1) {
+    editorDrawFold(ab, file_row);
+  } else if (file_row >= editorConf.num_rows) {
+    if (editorConf.num_rows == 0 && y == editorConf.screen_rows / 3) {
+      char welcome[80];
+      int welcomelen = snprintf(welcome, sizeof(welcome),
+                                "ZOR EDITOR -- VERSION %s", ZOR_VERSION);
+      if (welcomelen > editorConf.screen_cols)
+        welcomelen = editorConf.screen_cols;
+      int padding = (editorConf.screen_cols - welcomelen) / 2;
+      if (padding) {
+        abAppend(ab, "~", 1);
+        padding--;
+      }
+      while (padding--)
+        abAppend(ab, " ", 1);
+      abAppend(ab, welcome, welcomelen);
+    } else {
+      abAppend(ab, "~", 1);
+    }
+  } else {
+    int end = editorRowRsize(file_row);
+    int start = editorConf.col_off;
+    int len;
+    if (editorConf.wrap) {
+      int n;
+      int *starts = editorRowWrap(file_row, &n);
+      start = starts[sub];
+      len = (sub + 1 < n ? starts[sub + 1] : end) - start;
+    } else {
+      len = end - start;
+    }
+    if (len < 0)
+      len = 0;
+    if (len > editorConf.screen_cols)
+      len = editorConf.screen_cols;
+
+    char *c = len ? &editorRowRender(file_row)[start] : NULL;
+    int hl_len;
+    editorHlSpan *hl = editorRowHighlight(file_row, &hl_len);
+    int match_len;
+    editorMatchSpan *match = editorRowMatches(file_row, &match_len);
+    int sel_from, sel_to;
+    editorVisualColumns(file_row, &sel_from, &sel_to);
+    int in_sel = 0;
+    int span = 0;
+    int m = 0;
+    int current_color = -1;
+    /* extra cursors show in reverse video like the selection */
+    int cur = editorConf.num_cursors ? editorCursorSearch(file_row) : 0;
+    int cur_rx = editorCursorRx(cur, file_row);
+
+    for (int j = 0; j < len; j++) {
+      int rx = start + j;
+      while (span < hl_len && hl[span].end <= rx)
+        span++;
+      int h = span < hl_len ? hl[span].hl : HL_NORMAL;
+      while (m < match_len && match[m].end <= rx)
+        m++;
+      if (m < match_len && match[m].start <= rx)
+        h = HL_MATCH;
+      while (cur_rx != -1 && cur_rx < rx)
+        cur_rx = editorCursorRx(++cur, file_row);
+      int sel = (rx >= sel_from && rx < sel_to) || rx == cur_rx;
+      if (sel != in_sel) {
+        abAppend(ab, sel ? "\x1b[7m" : "\x1b[27m", sel ? 4 : 5);
+        in_sel = sel;
+      }
+
+      if (h == HL_NORMAL) {
+        if (current_color != -1) {
+          abAppend(ab, "\x1b[39m", 5);
+          current_color = -1;
         }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        abAppend(ab, &c[j], 1);
       } else {
-        abAppend(ab, "~", 1);
-      }
-    } else {
-      int len = editorConf.row[file_row].rsize - editorConf.col_off;
-      if (len < 0)
-        len = 0;
-      if (len > editorConf.screen_cols)
-        len = editorConf.screen_cols;
-
-      char *c = &editorConf.row[file_row].render[editorConf.col_off];
-      unsigned char *hl = &editorConf.row[file_row].hl[editorConf.col_off];
-      int current_color = -1;
-
-      for (int j = 0; j < len; j++) {
-        if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+        int color = editorSyntaxToColor(h);
+        if (color != current_color) {
+          current_color = color;
+          char buf[16];
+          int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+          abAppend(ab, buf, clen);
         }
+        abAppend(ab, &c[j], 1);
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    while (cur_rx != -1 && cur_rx < end)
+      cur_rx = editorCursorRx(++cur, file_row);
+    if ((sel_to > end || cur_rx == end) && start + len == end &&
+        len < editorConf.screen_cols) {
+      if (!in_sel)
+        abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, " ", 1);
+      in_sel = 1;
+    }
+    if (in_sel)
+      abAppend(ab, "\x1b[27m", 5);
+    abAppend(ab, "\x1b[39m", 5);
   }
 }
 
@@ -822,15 +8034,31 @@ void editorDrawStatusBar(struct abuf *ab) {
   case COMMAND_MODE:
     mode = " COMMAND |";
     break;
+  case VISUAL_MODE:
+    mode = editorConf.visual == 'V'   ? " V-LINE |"
+           : editorConf.visual == 'v' ? " VISUAL |"
+                                      : " V-BLOCK |";
+    break;
   default:
     mode = " NORMAL |";
     break;
   }
   /*const char *mode =*/
   /*    (editorConf.mode == NORMAL_MODE) ? " NORMAL |" : " INSERT |";*/
-  int len = snprintf(status, sizeof(status), "%s %.20s - %d lines %s", mode,
+  char lines[40];
+  if (editorConf.loader && editorConf.loader->seekable)
+    snprintf(lines, sizeof(lines), "loading %d%% / %d lines",
+             editorConf.loader->size
+                 ? (int)(editorConf.load_bytes * 100 / editorConf.loader->size)
+                 : 100,
+             editorConf.num_rows);
+  else if (editorConf.loader)
+    snprintf(lines, sizeof(lines), "loading / %d lines", editorConf.num_rows);
+  else
+    snprintf(lines, sizeof(lines), "%d lines", editorConf.num_rows);
+  int len = snprintf(status, sizeof(status), "%s %.20s - %s %s", mode,
                      editorConf.filename ? editorConf.filename : "[No Name]",
-                     editorConf.num_rows, editorConf.dirty ? "(modified)" : "");
+                     lines, editorConf.dirty ? "(modified)" : "");
 
   int rlen =
       snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
@@ -849,11 +8077,9 @@ void editorDrawStatusBar(struct abuf *ab) {
     }
   }
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
   int msglen = strlen(editorConf.statusmsg);
   if (msglen > editorConf.screen_cols)
     msglen = editorConf.screen_cols;
@@ -862,28 +8088,189 @@ void editorDrawMessageBar(struct abuf *ab) {
       abAppend(ab, editorConf.statusmsg, msglen);
 }
 
-void editorRefreshScreen() {
-  editorScroll();
+unsigned long long editorHashLine(const char *s, int len) {
+  unsigned long long h = 14695981039346656037ull;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
 
-  struct abuf ab = ABUF_INIT;
+void editorInvalidateScreens() {
+  editorConf.screen.valid = 0;
+  for (int i = 0; i < editorConf.num_clients; i++)
+    editorConf.clients[i]->screen.valid = 0;
+}
+
+int editorScreenResize(struct editorScreen *s) {
+  free(s->hash);
+  s->hash = calloc(editorConf.screen_rows + 2, sizeof(unsigned long long));
+  s->valid = 0;
+  return s->hash ? 0 : -1;
+}
+
+/* Set the terminal size the editor lays its screen out for. */
+void editorResize(int rows, int cols) {
+  editorConf.screen_rows = rows > 3 ? rows - 2 : 1;
+  editorConf.screen_cols = cols > 1 ? cols : 1;
+  if (editorScreenResize(&editorConf.screen) == -1)
+    die("calloc");
+  for (int i = 0; i < editorConf.num_clients; i++) {
+    if (editorScreenResize(&editorConf.clients[i]->screen) == -1)
+      die("calloc");
+  }
+}
+
+volatile sig_atomic_t editorWinch;
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+void editorWinchHandler(int sig) {
+  (void)sig;
+  editorWinch = 1;
+}
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+/* Follow a SIGWINCH on our own terminal. Wrapped rows are laid out again
+ * for the new width as they are next shown. */
+void editorWinched() {
+  if (!editorWinch || editorConf.server != -1)
+    return;
+  editorWinch = 0;
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == 0) {
+    editorResize(rows, cols);
+    editorRefreshScreen();
+  }
+}
 
+/* Bring one terminal up to date with a frame of lines, appending what to
+ * send it to ab. A vertical scroll moves the text it shows with a scroll
+ * region first; then only lines whose hash differs from what it shows are
+ * written. */
+void editorFlushScreen(struct editorScreen *s, struct abuf *ab, char *frame,
+                       int *off, unsigned long long *hash) {
+  int lines = editorConf.screen_rows + 2;
+  unsigned long long *drawn = s->hash;
+
+  abAppend(ab, "\x1b[?25l", 6);
+
+  int shift = editorConf.row_off >= s->drawn_row_off
+                  ? editorVisibleLines(s->drawn_row_off, editorConf.row_off)
+                  : -editorVisibleLines(editorConf.row_off, s->drawn_row_off);
+  shift += editorConf.wrap_off - s->drawn_wrap_off;
+  if (s->valid && shift != 0 && abs(shift) < editorConf.screen_rows &&
+      editorConf.col_off == s->drawn_col_off) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                       editorConf.screen_rows, abs(shift),
+                       shift > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    if (shift > 0) {
+      memmove(drawn, drawn + shift,
+              sizeof(*drawn) * (editorConf.screen_rows - shift));
+      for (int y = editorConf.screen_rows - shift; y < editorConf.screen_rows;
+           y++)
+        drawn[y] = 0;
+    } else {
+      memmove(drawn - shift, drawn,
+              sizeof(*drawn) * (editorConf.screen_rows + shift));
+      for (int y = 0; y < -shift; y++)
+        drawn[y] = 0;
+    }
+  } else if (shift != 0 || editorConf.col_off != s->drawn_col_off) {
+    s->valid = 0;
+  }
+  s->drawn_row_off = editorConf.row_off;
+  s->drawn_wrap_off = editorConf.wrap_off;
+  s->drawn_col_off = editorConf.col_off;
+
+  for (int y = 0; y < lines; y++) {
+    if (s->valid && drawn[y] == hash[y])
+      continue;
+    drawn[y] = hash[y];
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    abAppend(ab, buf, len);
+    abAppend(ab, frame + off[y], off[y + 1] - off[y]);
+    abAppend(ab, "\x1b[K", 3);
+  }
+  s->valid = 1;
+
+  int start = editorConf.col_off;
+  int y = editorVisibleLines(editorConf.row_off, editorConf.cy) -
+          editorConf.wrap_off;
+  if (editorConf.wrap && editorShownLines(editorConf.cy) > 1)
+    y += editorWrapLine(editorConf.cy, editorConf.rx, &start);
+  int x = editorConf.rx - start;
+  if (x >= editorConf.screen_cols)
+    x = editorConf.screen_cols - 1;
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-           (editorConf.cy - editorConf.row_off) + 1,
-           (editorConf.rx - editorConf.col_off) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, strlen(buf));
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(ab, "\x1b[?25h", 6);
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+/* Redraw only what changed since the last frame. Every screen line (text
+ * rows, status bar, message bar) is built once and hashed, then each
+ * terminal showing the editor gets the lines it is missing. */
+void editorRefreshScreen() {
+  editorScroll();
+  editorEnforceBudget();
+
+  struct abuf frame = ABUF_INIT;
+  int lines = editorConf.screen_rows + 2;
+  int *off = malloc(sizeof(int) * (lines + 1));
+  unsigned long long *hash = malloc(sizeof(unsigned long long) * lines);
+  if (off == NULL || hash == NULL)
+    die("malloc");
+
+  /* folded rows are skipped, not drawn */
+  int file_row = editorConf.row_off;
+  int sub = editorConf.wrap_off;
+  for (int y = 0; y < lines; y++) {
+    off[y] = frame.len;
+    if (y < editorConf.screen_rows) {
+      editorDrawRow(&frame, y, file_row, sub);
+      file_row = editorDisplayRow(file_row, &sub, 1);
+    } else if (y == editorConf.screen_rows) {
+      editorDrawStatusBar(&frame);
+    } else {
+      editorDrawMessageBar(&frame);
+    }
+    hash[y] = editorHashLine(frame.b + off[y], frame.len - off[y]);
+  }
+  off[lines] = frame.len;
+  if ((size_t)frame.len > editorConf.mem[MEM_OUTPUT])
+    editorConf.mem[MEM_OUTPUT] = frame.len;
+
+  if (editorConf.server == -1) {
+    struct abuf ab = ABUF_INIT;
+    editorFlushScreen(&editorConf.screen, &ab, frame.b, off, hash);
+    struct iovec iov = {ab.b, ab.len};
+    editorWriteAll(STDOUT_FILENO, &iov, 1);
+    abFree(&ab);
+  } else {
+    /* a client that is dropped swaps the last one into its slot; one
+     * that has not sent its size yet gets nothing, and one still taking
+     * an older frame gets the whole screen once that is out */
+    for (int i = editorConf.num_clients - 1; i >= 0; i--) {
+      struct editorClient *c = editorConf.clients[i];
+      if (c->rows == 0)
+        continue;
+      if (c->out_len) {
+        c->screen.valid = 0;
+        continue;
+      }
+      struct abuf ab = ABUF_INIT;
+      editorFlushScreen(&c->screen, &ab, frame.b, off, hash);
+      if (editorClientSend(c, ab.b, ab.len) == -1)
+        editorDropClient(c);
+      abFree(&ab);
+    }
+  }
+  abFree(&frame);
+  free(off);
+  free(hash);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -898,18 +8285,23 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 void editorHandleCommand(int c) {
   if (c == '\r') {
+    /* commands report through the status bar, so clear it first */
     editorConf.command_buffer[editorConf.command_len] = '\0';
-    editorExecuteCommand(editorConf.command_buffer);
     editorConf.mode = NORMAL_MODE;
     editorSetStatusMessage("");
+    editorUndoBreak();
+    editorExecuteCommand(editorConf.command_buffer);
+    editorUndoBreak();
+    return;
   } else if (c == 27) {
     editorConf.mode = NORMAL_MODE;
     editorSetStatusMessage("");
+    return;
   } else if (c == BACKSPACE || c == CTRL_KEY('h')) {
     if (editorConf.command_len > 0) {
       editorConf.command_buffer[--editorConf.command_len] = '\0';
     }
-  } else if (isprint(c) &&
+  } else if (c < 128 && isprint((unsigned char)c) &&
              editorConf.command_len < ZOR_COMMAND_BUFFER_SIZE - 1) {
     editorConf.command_buffer[editorConf.command_len++] = c;
     editorConf.command_buffer[editorConf.command_len] = '\0';
@@ -946,7 +8338,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
           callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c < 128 && !iscntrl((unsigned char)c)) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -960,45 +8352,217 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-  editorRow *row = (editorConf.cy >= editorConf.num_rows)
-                       ? NULL
-                       : &editorConf.row[editorConf.cy];
+  int row_size = (editorConf.cy >= editorConf.num_rows)
+                     ? -1
+                     : editorConf.row_size[editorConf.cy];
   switch (key) {
+  case HOME_KEY:
+    editorConf.cx = 0;
+    break;
+  case END_KEY:
+    if (row_size != -1)
+      editorConf.cx = row_size;
+    break;
   case ARROW_LEFT:
     if (editorConf.cx != 0) {
 
       editorConf.cx--;
     } else if (editorConf.cy > 0) {
       editorConf.cy--;
-      editorConf.cx = editorConf.row[editorConf.cy].size;
+      editorConf.cx = editorConf.row_size[editorConf.cy];
     }
     break;
   case ARROW_RIGHT:
     /*if (editorConf.cx != editorConf.screen_cols - 1)*/
-    if (row && row->size > editorConf.cx) {
+    if (row_size > editorConf.cx) {
       editorConf.cx++;
-    } else if (row && editorConf.cx == row->size) {
+    } else if (row_size != -1 && editorConf.cx == row_size) {
       editorConf.cy++;
       editorConf.cx = 0;
     }
     break;
   case ARROW_UP:
     if (editorConf.cy != 0)
-      editorConf.cy--;
+      editorConf.cy = editorVisibleRow(editorConf.cy, -1);
     break;
   case ARROW_DOWN:
-    if (editorConf.cy <= editorConf.num_rows)
-      editorConf.cy++;
+    editorWaitRows(editorConf.cy + 2);
+    if (editorConf.cy < editorConf.num_rows)
+      editorConf.cy = editorVisibleRow(editorConf.cy, 1);
     break;
   }
 
-  row = (editorConf.cy >= editorConf.num_rows) ? NULL
-                                               : &editorConf.row[editorConf.cy];
-  int row_len = row ? row->size : 0;
+  int row_len = (editorConf.cy >= editorConf.num_rows)
+                    ? 0
+                    : editorConf.row_size[editorConf.cy];
   if (editorConf.cx > row_len)
     editorConf.cx = row_len;
 }
 
+/* Put the cursor on row at, clamped to the buffer, waiting for rows that
+ * are still loading. The column is kept where the new row allows. */
+void editorGotoLine(int at) {
+  if (at < 0)
+    at = 0;
+  editorWaitRows(at < INT_MAX - 1 ? at + 2 : INT_MAX);
+  if (at >= editorConf.num_rows)
+    at = editorConf.num_rows ? editorConf.num_rows - 1 : 0;
+  editorConf.cy = at;
+  int size = at < editorConf.num_rows ? editorConf.row_size[at] : 0;
+  if (editorConf.cx > size)
+    editorConf.cx = size;
+}
+
+/* Word class for w, b and e: 0 for blanks and the end of a row, 1 for
+ * keyword characters, 2 for other punctuation. */
+int editorWordClass(int at, int cx) {
+  if (cx >= editorConf.row_size[at])
+    return 0;
+  unsigned char cc =
+      editorCharClass[(unsigned char)editorConf.row[at].chars[cx]];
+  if (cc & CC_WORD)
+    return 1;
+  return (cc & CC_SPACE) ? 0 : 2;
+}
+
+/* Step one character forward (dir 1) or back (dir -1), crossing rows.
+ * Returns 0 at either end of the buffer. */
+int editorWordStep(int *cy, int *cx, int dir) {
+  if (dir > 0) {
+    if (*cx < editorConf.row_size[*cy]) {
+      (*cx)++;
+      return 1;
+    }
+    editorWaitRows(*cy + 2);
+    if (*cy + 1 >= editorConf.num_rows)
+      return 0;
+    (*cy)++;
+    *cx = 0;
+    return 1;
+  }
+  if (*cx > 0) {
+    (*cx)--;
+    return 1;
+  }
+  if (*cy == 0)
+    return 0;
+  (*cy)--;
+  *cx = editorConf.row_size[*cy];
+  return 1;
+}
+
+/* Move by one word: w to the next word start, e to the next word end, b
+ * to the previous word start. An empty row counts as a word. */
+void editorWordMotion(int key) {
+  int cy = editorConf.cy, cx = editorConf.cx;
+  if (cy >= editorConf.num_rows)
+    return;
+
+  if (key == 'w') {
+    int k = editorWordClass(cy, cx);
+    while (k && editorWordClass(cy, cx) == k)
+      cx++;
+    while (editorWordClass(cy, cx) == 0) {
+      int row = cy;
+      if (!editorWordStep(&cy, &cx, 1))
+        break;
+      if (cy != row && editorConf.row_size[cy] == 0)
+        break;
+    }
+  } else if (key == 'e') {
+    editorWordStep(&cy, &cx, 1);
+    while (editorWordClass(cy, cx) == 0 && editorWordStep(&cy, &cx, 1))
+      ;
+    int k = editorWordClass(cy, cx);
+    while (k && editorWordClass(cy, cx + 1) == k)
+      cx++;
+  } else {
+    editorWordStep(&cy, &cx, -1);
+    while (editorWordClass(cy, cx) == 0) {
+      if (cx == 0 && editorConf.row_size[cy] == 0 && cy != editorConf.cy)
+        break;
+      if (!editorWordStep(&cy, &cx, -1))
+        break;
+    }
+    int k = editorWordClass(cy, cx);
+    while (k && cx > 0 && editorWordClass(cy, cx - 1) == k)
+      cx--;
+  }
+  editorConf.cy = cy;
+  editorConf.cx = cx;
+}
+
+/* Move the cursor for a motion key given count times. Returns 0 if c is
+ * not a motion. */
+int editorMotion(int c, int count, int has_count) {
+  switch (c) {
+  case 'g':
+    editorConf.pending = 'g';
+    editorConf.count = has_count ? count : 0;
+    break;
+  case 'G':
+    if (!has_count)
+      editorWaitRows(INT_MAX);
+    editorGotoLine(has_count ? count - 1 : editorConf.num_rows - 1);
+    break;
+  case 'w':
+  case 'b':
+  case 'e':
+    while (count--)
+      editorWordMotion(c);
+    break;
+  case '0':
+  case HOME_KEY:
+    editorConf.cx = 0;
+    break;
+  case '$':
+  case END_KEY:
+    if (editorConf.cy < editorConf.num_rows)
+      editorConf.cx = editorConf.row_size[editorConf.cy];
+    break;
+  case 'h':
+  case ARROW_LEFT:
+    editorConf.cx = editorConf.cx > count ? editorConf.cx - count : 0;
+    break;
+  case 'l':
+  case ARROW_RIGHT:
+    if (editorConf.cy < editorConf.num_rows) {
+      editorConf.cx += count;
+      if (editorConf.cx > editorConf.row_size[editorConf.cy])
+        editorConf.cx = editorConf.row_size[editorConf.cy];
+    }
+    break;
+  case 'j':
+  case ARROW_DOWN:
+    editorGotoLine(editorVisibleRow(editorConf.cy, count));
+    break;
+  case 'k':
+  case ARROW_UP:
+    editorGotoLine(editorVisibleRow(editorConf.cy, -count));
+    break;
+  case CTRL_KEY('u'):
+  case PAGE_UP: {
+    int sub = editorConf.wrap_off;
+    editorGotoLine(editorDisplayRow(editorConf.row_off, &sub,
+                                    -count * editorConf.screen_rows));
+    break;
+  }
+  case CTRL_KEY('d'):
+  case PAGE_DOWN: {
+    int sub = editorConf.wrap_off;
+    editorGotoLine(editorDisplayRow(editorConf.row_off, &sub,
+                                    (count + 1) * editorConf.screen_rows - 1));
+    break;
+  }
+  case '%':
+    editorMatchBracket();
+    break;
+  default:
+    return 0;
+  }
+  return 1;
+}
+
 void editorProccessKeypress() {
   static int quit_times = ZOR_QUIT_TIMES;
   int c = editorReadKey();
@@ -1006,88 +8570,94 @@ void editorProccessKeypress() {
   switch (editorConf.mode) {
 
   case NORMAL_MODE:
+  case VISUAL_MODE: {
+    editorUndoBreak();
+    if (c >= '0' && c <= '9' && (c != '0' || editorConf.count)) {
+      if (editorConf.count < 100000000)
+        editorConf.count = editorConf.count * 10 + (c - '0');
+      break;
+    }
+    int count = editorConf.count ? editorConf.count : 1;
+    int has_count = editorConf.count != 0;
+    editorConf.count = 0;
+    if (editorConf.pending) {
+      int pending = editorConf.pending;
+      editorConf.pending = 0;
+      if (pending == 'g' && c == 'g') {
+        editorGotoLine(has_count ? count - 1 : 0);
+      } else if (pending == 'z') {
+        editorFoldKey(c);
+      } else if ((pending == ']' || pending == '[') && c == 'c') {
+        editorDiffJump(pending == ']' ? 1 : -1);
+      } else if (pending == '"' && editorRegisterIndex(c) != -1) {
+        editorConf.reg = editorRegisterIndex(c);
+        editorConf.count = has_count ? count : 0;
+      }
+      break;
+    }
+    if (c == '"' || (editorConf.mode == NORMAL_MODE &&
+                     (c == 'z' || c == ']' || c == '['))) {
+      editorConf.pending = c;
+      editorConf.count = has_count ? count : 0;
+      break;
+    }
+    if (editorMotion(c, count, has_count)) {
+      if (editorConf.num_cursors)
+        editorCursorsFollow(c, count, has_count);
+      break;
+    }
+    if (editorConf.mode == VISUAL_MODE) {
+      editorVisualKey(c);
+      break;
+    }
     switch (c) {
+    case 'u':
+      editorUndo();
+      break;
+    case CTRL_KEY('r'):
+      editorRedo();
+      break;
     case 'i':
     case 'I':
       editorConf.mode = INSERT_MODE;
       break;
-    /*case 'v':*/
-    /*case 'V':*/
-    /*  editorConf.mode = VISUAL_MODE;*/
-    /*  break;*/
+    case 'v':
+    case 'V':
+    case CTRL_KEY('v'):
+      if (editorConf.num_rows == 0)
+        break;
+      editorConf.mode = VISUAL_MODE;
+      editorConf.visual = c;
+      editorConf.vy = editorConf.cy < editorConf.num_rows
+                          ? editorConf.cy
+                          : editorConf.num_rows - 1;
+      editorConf.vx = editorConf.cx;
+      break;
+    case 'p':
+    case 'P':
+      editorPutRegister(c == 'P', count);
+      break;
     case ':':
       editorConf.mode = COMMAND_MODE;
       editorConf.command_len = 0;
       editorConf.command_buffer[0] = '\0';
       editorSetStatusMessage(":");
       break;
-    case 'h':
-      editorMoveCursor(ARROW_LEFT);
-      break;
-    case 'j':
-      editorMoveCursor(ARROW_DOWN);
-      break;
-    case 'k':
-      editorMoveCursor(ARROW_UP);
-      break;
-    case 'l':
-      editorMoveCursor(ARROW_RIGHT);
-      break;
     case '/':
       editorFind();
       break;
-
-    case CTRL_KEY('u'):
-    case CTRL_KEY('d'): {
-
-      if (c == CTRL_KEY('u')) {
-        editorConf.cy = editorConf.row_off;
-      } else if (c == CTRL_KEY('d')) {
-        editorConf.cy = editorConf.row_off + editorConf.screen_rows - 1;
-        if (editorConf.cy > editorConf.num_rows)
-          editorConf.cy = editorConf.num_rows;
-      }
-
-      int times = editorConf.screen_rows;
-      while (times--) {
-        editorMoveCursor(c == CTRL_KEY('u') ? ARROW_UP : ARROW_DOWN);
-      }
-    } break;
-
-    case HOME_KEY:
-      editorConf.cx = 0;
-      break;
-    case END_KEY:
-      if (editorConf.cy < editorConf.num_rows)
-        editorConf.cx = editorConf.row[editorConf.cy].size;
-      break;
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
-      if (c == DEL_KEY)
+      if (c == DEL_KEY) {
         editorMoveCursor(ARROW_RIGHT);
+        if (editorConf.num_cursors)
+          editorCursorsFollow(ARROW_RIGHT, 0, 0);
+      }
       editorDeleteChar();
       break;
-    case PAGE_UP:
-    case PAGE_DOWN: {
-      if (c == PAGE_UP) {
-        editorConf.cy = editorConf.row_off;
-      } else if (c == PAGE_DOWN) {
-        editorConf.cy = editorConf.row_off + editorConf.screen_rows - 1;
-        if (editorConf.cy > editorConf.num_rows)
-          editorConf.cy = editorConf.num_rows;
-      }
-
-      int times = editorConf.screen_rows;
-      while (times--) {
-        editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
-    } break;
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-    case ARROW_UP:
-    case ARROW_DOWN:
-      editorMoveCursor(c);
+    case '\x1b':
+      editorConf.num_cursors = 0;
       break;
       /*case CTRL_KEY('q'):*/
       /*  if (editorConf.dirty && quit_times > 0) {*/
@@ -1105,7 +8675,7 @@ void editorProccessKeypress() {
       /*  editorSave();*/
       /*  break;*/
     }
-    break;
+  } break;
 
   case INSERT_MODE:
     switch (c) {
@@ -1113,56 +8683,50 @@ void editorProccessKeypress() {
       editorInsertNewline();
       break;
     case CTRL_KEY('q'):
-      if (editorConf.dirty && quit_times > 0) {
+      if (editorModifiedBuffers() && quit_times > 0 &&
+          editorConf.server == -1) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                                "Press Ctrl-Q %d more times to quit.",
                                quit_times);
         quit_times--;
         return;
       }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
-      exit(0);
+      editorQuit();
       break;
     case CTRL_KEY('s'):
       editorSave();
       break;
-
-    case HOME_KEY:
-      editorConf.cx = 0;
-      break;
-    case END_KEY:
-      if (editorConf.cy < editorConf.num_rows)
-        editorConf.cx = editorConf.row[editorConf.cy].size;
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+      editorComplete(c == CTRL_KEY('n') ? 1 : -1);
       break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
-      if (c == DEL_KEY)
+      if (c == DEL_KEY) {
         editorMoveCursor(ARROW_RIGHT);
+        if (editorConf.num_cursors)
+          editorCursorsFollow(ARROW_RIGHT, 0, 0);
+      }
       editorDeleteChar();
       break;
     case PAGE_UP:
-    case PAGE_DOWN: {
-      if (c == PAGE_UP) {
-        editorConf.cy = editorConf.row_off;
-      } else if (c == PAGE_DOWN) {
-        editorConf.cy = editorConf.row_off + editorConf.screen_rows - 1;
-        if (editorConf.cy > editorConf.num_rows)
-          editorConf.cy = editorConf.num_rows;
-      }
-
-      int times = editorConf.screen_rows;
-      while (times--) {
-        editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
-    } break;
+      editorGotoLine(editorConf.row_off - editorConf.screen_rows);
+      break;
+    case PAGE_DOWN:
+      editorGotoLine(editorConf.row_off + 2 * editorConf.screen_rows - 1);
+      break;
 
+    case HOME_KEY:
+    case END_KEY:
     case ARROW_LEFT:
     case ARROW_RIGHT:
     case ARROW_UP:
     case ARROW_DOWN:
       editorMoveCursor(c);
+      if (editorConf.num_cursors)
+        editorCursorsFollow(c, 0, 0);
       break;
     case CTRL_KEY('l'):
     case '\x1b':
@@ -1180,34 +8744,472 @@ void editorProccessKeypress() {
   quit_times = ZOR_QUIT_TIMES;
 }
 
+/*server*/
+
+/* Where the server listens. Without $ZOR_SOCKET or $XDG_RUNTIME_DIR it is
+ * in a directory of our own under /tmp, made if need be; buf is left
+ * empty if that is not a private directory of ours. */
+void editorSocketPath(char *buf, size_t size) {
+  const char *env = getenv("ZOR_SOCKET");
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (env) {
+    snprintf(buf, size, "%s", env);
+  } else if (dir && *dir) {
+    snprintf(buf, size, "%s/zor.sock", dir);
+  } else {
+    char tmp[64];
+    struct stat st;
+    snprintf(tmp, sizeof(tmp), "/tmp/zor-%d", (int)getuid());
+    mkdir(tmp, 0700);
+    if (lstat(tmp, &st) == -1 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077)) {
+      buf[0] = '\0';
+      return;
+    }
+    snprintf(buf, size, "%s/zor.sock", tmp);
+  }
+}
+
+/* Whether the other end of a socket runs as us. */
+int editorPeerIsUs(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+/* Connect to a running server of ours. Returns -1 if there is none. */
+int editorConnect() {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  editorSocketPath(addr.sun_path, sizeof(addr.sun_path));
+  if (addr.sun_path[0] == '\0')
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      !editorPeerIsUs(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int editorSendMessage(int fd, char type, const void *data, uint32_t len) {
+  char head[5];
+  head[0] = type;
+  memcpy(head + 1, &len, sizeof(len));
+  struct iovec iov[2] = {{head, sizeof(head)}, {(void *)data, len}};
+  return editorWriteAll(fd, iov, 2);
+}
+
+void editorSendSize(int fd) {
+  int size[2];
+  if (getWindowSize(&size[0], &size[1]) == 0)
+    editorSendMessage(fd, 'w', size, sizeof(size));
+}
+
+/* Client side of zor file: name the files, then pass keys to the server
+ * and its frames to the terminal until the server hangs up. */
+void editorAttach(int fd, char **files, int num_files) {
+  enableRawMode();
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  editorSendSize(fd);
+  for (int i = 0; i < num_files; i++) {
+    /* the server has its own working directory */
+    char *path = realpath(files[i], NULL);
+    if (path == NULL && files[i][0] != '/') {
+      char cwd[PATH_MAX];
+      if (getcwd(cwd, sizeof(cwd)) && asprintf(&path, "%s/%s", cwd,
+                                               files[i]) == -1)
+        path = NULL;
+    }
+    const char *name = path ? path : files[i];
+    editorSendMessage(fd, i == 0 ? 'o' : 'a', name, strlen(name));
+    free(path);
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_handler = editorWinchHandler;
+  sigaction(SIGWINCH, &sa, NULL);
+
+  char buf[65536];
+  while (1) {
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) == -1) {
+      if (errno != EINTR)
+        break;
+      if (editorWinch) {
+        editorWinch = 0;
+        editorSendSize(fd);
+      }
+      continue;
+    }
+    if (fds[0].revents) {
+      /* a key message has to fit the server's message buffer */
+      ssize_t n = read(STDIN_FILENO, buf, ZOR_MSG_MAX - 6);
+      if (n > 0 && editorSendMessage(fd, 'i', buf, n) == -1)
+        break;
+    }
+    if (fds[1].revents) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      struct iovec iov = {buf, n};
+      editorWriteAll(STDOUT_FILENO, &iov, 1);
+    }
+  }
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
+
+/* The client whose keys to read next: the one being read stays current
+ * until its queue runs dry. */
+struct editorClient *editorInputClient() {
+  struct editorClient *c = editorConf.client;
+  if (c && c->in_pos < c->in_len)
+    return c;
+  for (int i = 0; i < editorConf.num_clients; i++) {
+    c = editorConf.clients[i];
+    if (c->in_pos < c->in_len) {
+      editorConf.client = c;
+      return c;
+    }
+  }
+  return NULL;
+}
+
+/* Lay the screen out for the smallest attached terminal so every client
+ * sees all of it. */
+void editorServerGeometry() {
+  int rows = 0, cols = 0;
+  for (int i = 0; i < editorConf.num_clients; i++) {
+    struct editorClient *c = editorConf.clients[i];
+    if (c->rows && (rows == 0 || c->rows < rows))
+      rows = c->rows;
+    if (c->cols && (cols == 0 || c->cols < cols))
+      cols = c->cols;
+  }
+  if (rows && cols &&
+      (rows != editorConf.screen_rows + 2 || cols != editorConf.screen_cols))
+    editorResize(rows, cols);
+}
+
+/* Write data to a client without blocking on it. What the socket will not
+ * take now is kept and sent as it drains. Returns -1 if the client is
+ * gone. */
+int editorClientSend(struct editorClient *c, const char *data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(c->fd, data + done, len - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      break;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  if (done == len)
+    return 0;
+  c->out = malloc(len - done);
+  if (c->out == NULL)
+    die("malloc");
+  memcpy(c->out, data + done, len - done);
+  c->out_len = len - done;
+  c->out_pos = 0;
+  editorRewatchFd(c->fd, POLLIN | POLLOUT);
+  return 0;
+}
+
+/* Send more of what a client's socket would not take before. */
+int editorClientDrain(struct editorClient *c) {
+  while (c->out_pos < c->out_len) {
+    ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      return 0;
+    if (n <= 0)
+      return -1;
+    c->out_pos += n;
+  }
+  free(c->out);
+  c->out = NULL;
+  c->out_len = 0;
+  c->out_pos = 0;
+  editorRewatchFd(c->fd, POLLIN);
+  return 0;
+}
+
+void editorDropClient(struct editorClient *c) {
+  editorUnwatchFd(c->fd);
+  close(c->fd);
+  for (int i = 0; i < editorConf.num_clients; i++) {
+    if (editorConf.clients[i] == c) {
+      editorConf.clients[i] = editorConf.clients[--editorConf.num_clients];
+      break;
+    }
+  }
+  if (editorConf.client == c)
+    editorConf.client = NULL;
+  free(c->in);
+  free(c->out);
+  free(c->screen.hash);
+  free(c);
+  editorServerGeometry();
+}
+
+void editorClientMessage(struct editorClient *c, char type, char *data,
+                         uint32_t len) {
+  if (type == 'i') {
+    if (c->in_len + len > c->in_cap) {
+      c->in_cap = c->in_len + len > 2 * c->in_cap ? c->in_len + len
+                                                  : 2 * c->in_cap;
+      c->in = realloc(c->in, c->in_cap);
+      if (c->in == NULL)
+        die("realloc");
+    }
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+  } else if (type == 'w' && len == 2 * sizeof(int)) {
+    memcpy(&c->rows, data, sizeof(int));
+    memcpy(&c->cols, data + sizeof(int), sizeof(int));
+    editorServerGeometry();
+  } else if ((type == 'o' || type == 'a') && len > 0) {
+    data[len] = '\0';
+    int i = editorFindBuffer(data);
+    if (type == 'o')
+      editorSwitchBuffer(i);
+  }
+}
+
+/* Serve a client's socket: send more of a frame it fell behind on, then
+ * take in its messages. */
+void editorClientRead(int fd) {
+  struct editorClient *c = NULL;
+  for (int i = 0; i < editorConf.num_clients; i++) {
+    if (editorConf.clients[i]->fd == fd)
+      c = editorConf.clients[i];
+  }
+  if (c == NULL)
+    return;
+  if (c->out_len && editorClientDrain(c) == -1) {
+    editorDropClient(c);
+    return;
+  }
+
+  ssize_t n = read(fd, c->msg + c->msg_len, sizeof(c->msg) - 1 - c->msg_len);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    editorDropClient(c);
+    return;
+  }
+  c->msg_len += n;
+
+  int pos = 0;
+  while (c->msg_len - pos >= 5) {
+    uint32_t len;
+    memcpy(&len, c->msg + pos + 1, sizeof(len));
+    if (len > sizeof(c->msg) - 6) {
+      editorDropClient(c);
+      return;
+    }
+    if (c->msg_len - pos - 5 < (int)len)
+      break;
+    char type = c->msg[pos];
+    /* a file name is terminated in place, so save the byte after it */
+    char save = c->msg[pos + 5 + len];
+    editorClientMessage(c, type, c->msg + pos + 5, len);
+    c->msg[pos + 5 + len] = save;
+    pos += 5 + len;
+  }
+  memmove(c->msg, c->msg + pos, c->msg_len - pos);
+  c->msg_len -= pos;
+}
+
+void editorServerAccept(int fd) {
+  int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (cfd == -1)
+    return;
+  if (editorConf.num_clients == ZOR_MAX_CLIENTS || !editorPeerIsUs(cfd)) {
+    close(cfd);
+    return;
+  }
+  struct editorClient *c = calloc(1, sizeof(struct editorClient));
+  if (c == NULL || editorScreenResize(&c->screen) == -1)
+    die("calloc");
+  c->fd = cfd;
+  editorConf.clients[editorConf.num_clients++] = c;
+  editorWatchFd(cfd, POLLIN, editorClientRead);
+}
+
+/* zor --server: listen for clients instead of using the terminal. Buffers,
+ * row indexes and caches stay in this process between attaches. */
+void editorServe() {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  editorSocketPath(addr.sun_path, sizeof(addr.sun_path));
+  if (addr.sun_path[0] == '\0') {
+    fprintf(stderr, "zor: no private directory for the socket\n");
+    exit(1);
+  }
+  int fd = editorConnect();
+  if (fd != -1) {
+    fprintf(stderr, "zor: a server is already running on %s\n",
+            addr.sun_path);
+    exit(1);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    die("socket");
+  unlink(addr.sun_path);
+  mode_t mask = umask(077);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    die("bind");
+  umask(mask);
+  if (listen(fd, ZOR_MAX_CLIENTS) == -1)
+    die("listen");
+  editorConf.server = fd;
+  editorWatchFd(fd, POLLIN, editorServerAccept);
+}
+
+/* Leave the editor; in server mode only the client that asked detaches. */
+void editorQuit() {
+  if (editorConf.server != -1) {
+    if (editorConf.client)
+      editorDropClient(editorConf.client);
+    return;
+  }
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
+
 /*init*/
 
 void initEditor() {
+  editorKeywordCheck();
   editorConf.cx = 0;
   editorConf.cy = 0;
   editorConf.rx = 0;
   editorConf.row_off = 0;
   editorConf.col_off = 0;
+  editorConf.wrap = 0;
+  editorConf.wrap_off = 0;
   editorConf.num_rows = 0;
+  editorConf.row_cap = 0;
+  editorConf.row_size = NULL;
+  editorConf.row_cache = NULL;
+  editorConf.row_flags = NULL;
   editorConf.row = NULL;
+  editorConf.cached_rows = 0;
+  editorConf.spare = NULL;
+  editorConf.num_spare = 0;
+  editorConf.pinned_bytes = 0;
+#ifdef __GLIBC__
+  /* a fixed threshold keeps the loader's big line lists in mmaps that go
+   * back when freed, not in the scan threads' malloc arenas */
+  mallopt(M_MMAP_THRESHOLD, 128 << 10);
+#endif
+  memset(editorConf.mem, 0, sizeof(editorConf.mem));
+  char *budget = getenv("ZOR_MEM_BUDGET");
+  if (budget == NULL || editorParseSize(budget, &editorConf.mem_budget) == -1)
+    editorConf.mem_budget = 0;
+  editorConf.buffers = NULL;
+  editorConf.num_buffers = 0;
+  editorConf.buffers_cap = 0;
+  editorConf.cur_buffer = editorAddBuffer(NULL);
+  editorConf.arena = editorConf.buffers[editorConf.cur_buffer].arena;
+  editorConf.buffer_tick = 0;
+  editorConf.loader = NULL;
+  editorConf.load_bytes = 0;
+  editorConf.load_partial = 0;
+  editorConf.follow = 0;
+  editorConf.follower = NULL;
   editorConf.dirty = 0;
   editorConf.filename = NULL;
+  editorConf.codec = NULL;
   editorConf.statusmsg[0] = '\0';
   editorConf.statusmsg_time = 0;
+  editorConf.search_query = NULL;
+  editorConf.search_gen = 1;
   editorConf.syntax = NULL;
+  editorConf.hl_state_rows = 0;
+  editorConf.index = NULL;
+  editorConf.brackets = NULL;
+  editorConf.layout = NULL;
+  editorConf.folds = NULL;
+  editorConf.num_folds = 0;
+  editorConf.folds_cap = 0;
+  editorConf.cursors = NULL;
+  editorConf.num_cursors = 0;
+  editorConf.cursors_cap = 0;
+  memset(&editorConf.disk, 0, sizeof(editorConf.disk));
+  editorDiskReset();
+  editorConf.complete_x = 0;
+  editorConf.complete_y = -1;
+  editorConf.complete_plen = 0;
+  editorConf.complete_word[0] = '\0';
+  editorConf.undo = NULL;
+  editorConf.redo = NULL;
+  editorConf.undo_open = 0;
   editorConf.mode = NORMAL_MODE;
-
-  if (getWindowSize(&editorConf.screen_rows, &editorConf.screen_cols) == -1)
-    die("getWindowSize");
-  editorConf.screen_rows -= 2;
+  editorConf.num_watches = 0;
+  editorConf.filter = NULL;
+  editorConf.count = 0;
+  editorConf.pending = 0;
+  editorConf.visual = 0;
+  editorConf.vx = 0;
+  editorConf.vy = 0;
+  memset(editorConf.registers, 0, sizeof(editorConf.registers));
+  editorConf.reg = 0;
+  memset(&editorConf.screen, 0, sizeof(editorConf.screen));
+  editorConf.server = -1;
+  editorConf.num_clients = 0;
+  editorConf.client = NULL;
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  signal(SIGPIPE, SIG_IGN);
   initEditor();
 
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  int arg = 1;
+  int follow = 0;
+  if (arg < argc && strcmp(argv[arg], "--server") == 0) {
+    editorServe();
+    editorResize(24, 80);
+    arg = argc;
+  } else {
+    if (arg < argc && strcmp(argv[arg], "-f") == 0) {
+      follow = 1;
+      arg++;
+    }
+    int fd = follow ? -1 : editorConnect();
+    if (fd != -1)
+      editorAttach(fd, argv + arg, argc - arg);
+
+    int rows, cols;
+    enableRawMode();
+    if (getWindowSize(&rows, &cols) == -1)
+      die("getWindowSize");
+    editorResize(rows, cols);
+    struct sigaction sa = {0};
+    sa.sa_handler = editorWinchHandler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+  }
+  if (arg < argc) {
+    editorOpen(argv[arg]);
+    if (follow)
+      editorFollowStart();
+    /* the other files load when they are first shown */
+    while (++arg < argc)
+      editorAddBuffer(argv[arg]);
   }
 
   /*editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");*/